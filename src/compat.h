@@ -73,6 +73,17 @@ static inline void taskqgroup_drain_all(struct taskqgroup *tqg)
 #undef atomic_load_ptr
 #define atomic_load_ptr(p) (*(volatile __typeof(*p) *)(p))
 
+#ifndef UMA_ZONE_FIRSTTOUCH
+#define UMA_ZONE_FIRSTTOUCH UMA_ZONE_NUMA
+#endif
+
+/* sys/seqc.h was sys/seq.h before 13.0, with the same functions. */
+#define seqc_t seq_t
+#define seqc_read(s) seq_read(s)
+#define seqc_consistent(s, o) seq_consistent((s), (o))
+#define seqc_write_begin(s) seq_write_begin(s)
+#define seqc_write_end(s) seq_write_end(s)
+
 #endif
 
 #if __FreeBSD_version < 1202000
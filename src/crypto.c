@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/endian.h>
 #include <sys/systm.h>
+#include <sys/malloc.h>
 
 #include "crypto.h"
 
@@ -587,24 +588,48 @@ chacha20poly1305_decrypt(uint8_t *dst, const uint8_t *src, const size_t src_len,
 	return ret;
 }
 
+/* Finish the tag of an mbuf chain of len bytes, without additional data. */
+static inline void
+chacha20poly1305_final_mbuf(struct poly1305_ctx *poly1305_state, size_t len,
+			    uint8_t mac[POLY1305_MAC_SIZE])
+{
+	uint64_t lens[2];
+
+	poly1305_update(poly1305_state, pad0, (0x10 - len) & 0xf);
+
+	lens[0] = 0;
+	lens[1] = cpu_to_le64(len);
+	poly1305_update(poly1305_state, (uint8_t *)lens, sizeof(lens));
+
+	poly1305_final(poly1305_state, mac);
+}
+
+/*
+ * With verify_first, a decryption authenticates the whole packet before
+ * decrypting any of it, so that a forgery costs a Poly1305 pass and a single
+ * ChaCha20 block instead of a full decryption. Genuine packets take a second
+ * pass over the data, so this is only worth it when forgeries are common.
+ */
 static inline int
 chacha20poly1305_crypt_mbuf(struct mbuf *m0, uint64_t nonce,
-			    const uint8_t key[CHACHA20POLY1305_KEY_SIZE], bool encrypt)
+			    const uint8_t key[CHACHA20POLY1305_KEY_SIZE], bool encrypt,
+			    bool verify_first)
 {
 	struct poly1305_ctx poly1305_state;
 	struct chacha20_ctx chacha20_state;
 	uint8_t *buf, mbuf_mac[POLY1305_MAC_SIZE];
 	size_t len, leftover = 0;
 	struct mbuf *m;
-	int ret;
+	int ret = 0;
 	union {
 		uint32_t stream[CHACHA20_BLOCK_WORDS];
 		uint8_t block0[POLY1305_KEY_SIZE];
 		uint8_t mac[POLY1305_MAC_SIZE];
-		uint64_t lens[2];
 	} b = { { 0 } };
 
-	if (!encrypt) {
+	if (encrypt)
+		verify_first = false;
+	else {
 		if (m0->m_pkthdr.len < POLY1305_MAC_SIZE)
 			return EMSGSIZE;
 		m_copydata(m0, m0->m_pkthdr.len - POLY1305_MAC_SIZE, POLY1305_MAC_SIZE, mbuf_mac);
@@ -615,11 +640,21 @@ chacha20poly1305_crypt_mbuf(struct mbuf *m0, uint64_t nonce,
 	chacha20(&chacha20_state, b.block0, b.block0, sizeof(b.block0));
 	poly1305_init(&poly1305_state, b.block0);
 
+	if (verify_first) {
+		for (m = m0; m; m = m->m_next)
+			poly1305_update(&poly1305_state, m->m_data, m->m_len);
+		chacha20poly1305_final_mbuf(&poly1305_state, m0->m_pkthdr.len, b.mac);
+		if (timingsafe_bcmp(b.mac, mbuf_mac, POLY1305_MAC_SIZE) != 0) {
+			ret = EBADMSG;
+			goto out;
+		}
+	}
+
 	for (m = m0; m; m = m->m_next) {
 		len = m->m_len;
 		buf = m->m_data;
 
-		if (!encrypt)
+		if (!encrypt && !verify_first)
 			poly1305_update(&poly1305_state, m->m_data, m->m_len);
 
 		if (leftover != 0) {
@@ -646,19 +681,16 @@ chacha20poly1305_crypt_mbuf(struct mbuf *m0, uint64_t nonce,
 		if (encrypt)
 			poly1305_update(&poly1305_state, m->m_data, m->m_len);
 	}
-	poly1305_update(&poly1305_state, pad0, (0x10 - m0->m_pkthdr.len) & 0xf);
-
-	b.lens[0] = 0;
-	b.lens[1] = cpu_to_le64(m0->m_pkthdr.len);
-	poly1305_update(&poly1305_state, (uint8_t *)b.lens, sizeof(b.lens));
 
-	poly1305_final(&poly1305_state, b.mac);
+	if (verify_first)
+		goto out;
+	chacha20poly1305_final_mbuf(&poly1305_state, m0->m_pkthdr.len, b.mac);
 
 	if (encrypt)
 		ret = m_append(m0, POLY1305_MAC_SIZE, b.mac) ? 0 : ENOMEM;
 	else
 		ret = timingsafe_bcmp(b.mac, mbuf_mac, POLY1305_MAC_SIZE) == 0 ? 0 : EBADMSG;
-
+out:
 	explicit_bzero(&chacha20_state, sizeof(chacha20_state));
 	explicit_bzero(&b, sizeof(b));
 
@@ -669,14 +701,21 @@ int
 chacha20poly1305_encrypt_mbuf(struct mbuf *m, const uint64_t nonce,
 			      const uint8_t key[CHACHA20POLY1305_KEY_SIZE])
 {
-	return chacha20poly1305_crypt_mbuf(m, nonce, key, true);
+	return chacha20poly1305_crypt_mbuf(m, nonce, key, true, false);
 }
 
 int
 chacha20poly1305_decrypt_mbuf(struct mbuf *m, const uint64_t nonce,
 			      const uint8_t key[CHACHA20POLY1305_KEY_SIZE])
 {
-	return chacha20poly1305_crypt_mbuf(m, nonce, key, false);
+	return chacha20poly1305_crypt_mbuf(m, nonce, key, false, false);
+}
+
+int
+chacha20poly1305_verify_decrypt_mbuf(struct mbuf *m, const uint64_t nonce,
+				     const uint8_t key[CHACHA20POLY1305_KEY_SIZE])
+{
+	return chacha20poly1305_crypt_mbuf(m, nonce, key, false, true);
 }
 
 void
@@ -1784,3 +1823,7 @@ bool curve25519(uint8_t out[CURVE25519_KEY_SIZE],
 
 	return timingsafe_bcmp(out, curve25519_null_point, CURVE25519_KEY_SIZE) != 0;
 }
+
+#ifdef SELFTESTS
+#include "selftest/crypto.c"
+#endif /* SELFTESTS */
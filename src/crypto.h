@@ -35,6 +35,10 @@ int
 chacha20poly1305_decrypt_mbuf(struct mbuf *, const uint64_t nonce,
 			      const uint8_t key[CHACHA20POLY1305_KEY_SIZE]);
 
+int
+chacha20poly1305_verify_decrypt_mbuf(struct mbuf *, const uint64_t nonce,
+				     const uint8_t key[CHACHA20POLY1305_KEY_SIZE]);
+
 void
 xchacha20poly1305_encrypt(uint8_t *dst, const uint8_t *src,
 			  const size_t src_len, const uint8_t *ad,
@@ -109,4 +113,9 @@ static inline void curve25519_generate_secret(uint8_t secret[CURVE25519_KEY_SIZE
 	curve25519_clamp_secret(secret);
 }
 
+#ifdef SELFTESTS
+bool crypto_selftest(void);
+bool crypto_benchmark(void);
+#endif /* SELFTESTS */
+
 #endif
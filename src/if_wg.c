@@ -9,6 +9,7 @@
 /* TODO audit imports */
 #include "opt_inet.h"
 #include "opt_inet6.h"
+#include "opt_ipsec.h"
 
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD$");
@@ -17,6 +18,8 @@ __FBSDID("$FreeBSD$");
 #include <sys/types.h>
 #include <sys/systm.h>
 #include <vm/uma.h>
+#include <vm/vm.h>
+#include <vm/vm_phys.h>
 
 #include <sys/mbuf.h>
 #include <sys/socket.h>
@@ -37,8 +40,12 @@ __FBSDID("$FreeBSD$");
 #include <sys/kdb.h>
 #include <sys/sx.h>
 #include <sys/sysctl.h>
+#include <sys/counter.h>
+#include <sys/domainset.h>
 #include <sys/gtaskqueue.h>
 #include <sys/smp.h>
+#include <sys/sched.h>
+#include <sys/pcpu.h>
 #include <sys/nv.h>
 
 #include <net/bpf.h>
@@ -67,20 +74,30 @@ __FBSDID("$FreeBSD$");
 #include <netinet6/in6_pcb.h>
 #include <netinet/udp_var.h>
 #include <netinet6/nd6.h>
+#include <netipsec/ipsec_support.h>
 
 #include <machine/in_cksum.h>
 #include <machine/_inttypes.h>
 
+#include <crypto/siphash/siphash.h>
+
 #include "support.h"
 #include "wg_noise.h"
 #include "wg_cookie.h"
 #include "version.h"
 #include "if_wg.h"
+#include "wg_trace.h"
+#include "wg_lockstat.h"
+#include "wg_aead.h"
+#include "wg_handoff.h"
 
 #define DEFAULT_MTU		(ETHERMTU - 80)
 #define MAX_MTU			(IF_MAXMTU - 80)
 
 #define MAX_STAGED_PKT		128
+#define WG_STAGE_PEERS		4
+#define WG_KEEPALIVE_SLOTS	64	/* seconds, power of 2 */
+#define WG_STAGE_BURST		32
 #define MAX_QUEUED_PKT		1024
 #define MAX_QUEUED_PKT_MASK	(MAX_QUEUED_PKT - 1)
 
@@ -93,6 +110,15 @@ __FBSDID("$FreeBSD$");
 
 #define DPRINTF(sc, ...) if (sc->sc_ifp->if_flags & IFF_DEBUG) if_printf(sc->sc_ifp, ##__VA_ARGS__)
 
+/*
+ * Events on the packet and handshake paths go to the event rings instead of
+ * the console, which would serialise every CPU on the message buffer.
+ */
+#define WG_EVENT(sc, id, peer, arg) do {				\
+	if (__predict_false((sc)->sc_ifp->if_flags & IFF_DEBUG))	\
+		wg_event((sc), (id), (peer), (arg));			\
+} while (0)
+
 /* First byte indicating packet type on the wire */
 #define WG_PKT_INITIATION htole32(1)
 #define WG_PKT_RESPONSE htole32(2)
@@ -171,8 +197,26 @@ struct wg_aip {
 	sa_family_t		 a_af;
 };
 
+/*
+ * Times at which a packet entered each stage of the pipeline. These are only
+ * recorded when net.link.wg.packet_stamps is set, and are meant to be read
+ * from the tracepoints below.
+ */
+enum wg_packet_stamp {
+	WG_STAMP_STAGED,	/* p_stage_queue, transmit only */
+	WG_STAMP_QUEUED,	/* parallel and serial, or handshake queue */
+	WG_STAMP_CRYPTO,	/* dequeued by a crypto worker */
+	WG_STAMP_CRYPTED,	/* crypto done, waiting in the serial queue */
+	WG_STAMP_MAX
+};
+
+enum wg_ring_state {
+	WG_PACKET_UNCRYPTED,
+	WG_PACKET_CRYPTED,
+	WG_PACKET_DEAD,
+};
+
 struct wg_packet {
-	STAILQ_ENTRY(wg_packet)	 p_serial;
 	STAILQ_ENTRY(wg_packet)	 p_parallel;
 	struct wg_endpoint	 p_endpoint;
 	struct noise_keypair	*p_keypair;
@@ -180,11 +224,15 @@ struct wg_packet {
 	struct mbuf		*p_mbuf;
 	int			 p_mtu;
 	sa_family_t		 p_af;
-	enum wg_ring_state {
-		WG_PACKET_UNCRYPTED,
-		WG_PACKET_CRYPTED,
-		WG_PACKET_DEAD,
-	}			 p_state;
+	volatile u_int		 p_state;	/* enum wg_ring_state */
+	bool			 p_stamped;
+	sbintime_t		 p_stamp[WG_STAMP_MAX];	/* sbinuptime */
+	struct wg_softc		*p_sc;
+	u_int			 p_charge;	/* bytes, see wg_mem_charge_packet */
+	bool			 p_charge_shared;
+	u_int			 p_domain;	/* NUMA domain queued in */
+	uint32_t		 p_idx;		/* receiver index, transmit only */
+	struct wg_aead_req	 p_aead;
 };
 
 STAILQ_HEAD(wg_packet_list, wg_packet);
@@ -193,9 +241,125 @@ struct wg_queue {
 	struct mtx		 q_mtx;
 	struct wg_packet_list	 q_queue;
 	size_t			 q_len;
+	size_t			 q_max;		/* high water mark */
+	u_long			 q_drops;	/* packets dropped when full */
+};
+
+/*
+ * Parallel crypto queues and the workers that serve them, one set per NUMA
+ * domain and allocated from it. A packet is queued in the domain of the CPU
+ * that queues it, which for receive is the CPU that took it from the NIC, and
+ * only the workers of CPUs in that domain dequeue it.
+ */
+struct wg_domain {
+	struct wg_queue		 d_encrypt_parallel;
+	u_int			 d_encrypt_last_cpu;	/* index in d_cpus */
+
+	struct wg_queue		 d_decrypt_parallel __aligned(CACHE_LINE_SIZE);
+	u_int			 d_decrypt_last_cpu;
+
+	u_int			 d_ncpus;
+	u_int			 d_cpus[];
+};
+
+/*
+ * Per-peer serial queue, a ring of up to MAX_QUEUED_PKT packets in the order
+ * they were handed to the crypto workers. Producers serialise on s_mtx to
+ * append at s_head. The peer's delivery task is the only consumer and takes
+ * packets from s_tail without the mutex, once the worker has published the
+ * packet's p_state. Each index and p_state is written with a release store and
+ * read with an acquire load by the other side.
+ *
+ * The ring starts at WG_SERIAL_MIN_PKT packets when the first packet is queued
+ * and doubles when it fills. A producer that grows it copies the live entries
+ * to the new ring and publishes it before s_head, so the consumer finds every
+ * packet in whichever ring it loads, and hangs the old ring on sr_old for the
+ * consumer to free, since only the consumer knows when it no longer reads it.
+ * When a packet is queued after more than a second with the ring empty, the
+ * consumer frees the ring once it has drained it again, so that peers that
+ * only see keepalives or sparse traffic hold no ring between packets.
+ */
+#define WG_SERIAL_MIN_PKT	16
+
+struct wg_serial_ring {
+	struct wg_serial_ring	*sr_old;	/* retired by a grow */
+	u_int			 sr_mask;
+	struct wg_packet	*sr_pkts[];
+};
+
+#define WG_SERIAL_RING_SIZE(n) \
+	offsetof(struct wg_serial_ring, sr_pkts[n])
+
+struct wg_serial {
+	struct mtx		 s_mtx;
+	struct wg_serial_ring	*s_ring;
+	volatile u_int		 s_head;
+	int			 s_last;	/* ticks of the last append */
+	bool			 s_release;	/* free the ring once drained */
+	size_t			 s_max;		/* high water mark */
+	u_long			 s_drops;	/* packets dropped when full */
+	volatile u_int		 s_tail __aligned(CACHE_LINE_SIZE);
+};
+
+/*
+ * Reasons for dropping a packet outside of the queues, which account for
+ * their own drops. Counted per interface, and per peer where there is one.
+ */
+enum wg_drop_reason {
+	WG_DROP_NOMEM,		/* mbuf or packet allocation failed */
+	WG_DROP_NO_PEER,	/* no allowed IP matches the destination */
+	WG_DROP_NO_ENDPOINT,	/* peer has no endpoint */
+	WG_DROP_LOOP,		/* packet looped through the tunnel */
+	WG_DROP_ENCRYPT,	/* padding or encryption failed */
+	WG_DROP_SEND,		/* the socket refused the packet */
+	WG_DROP_INVALID,	/* malformed packet or payload */
+	WG_DROP_NO_KEYPAIR,	/* unknown receiver index */
+	WG_DROP_DECRYPT,	/* keypair expired or decryption failed */
+	WG_DROP_AUTH,		/* authentication failed */
+	WG_DROP_AUTH_THROTTLE,	/* source failed authentication too often */
+	WG_DROP_UNALLOWED_SRC,	/* inner source not in the peer's allowed IPs */
+	WG_DROP_REPLAY,		/* nonce replayed or too old */
+	WG_DROP_MEMCAP,		/* interface memory limit reached */
+	WG_DROP_HANDSHAKE_REPLAY, /* copy of a recent handshake initiation */
+	WG_DROP_MAX
+};
+
+/*
+ * Memory charged to an interface, by object type, in bytes. Keypairs are
+ * counted by noise and added when reporting. A packet is charged its
+ * wg_packet and the length of its mbuf chain when it enters the pipeline.
+ */
+enum wg_mem_type {
+	WG_MEM_PEERS,
+	WG_MEM_AIPS,
+	WG_MEM_PACKETS,
+	WG_MEM_MAX
 };
 
+/*
+ * Handshake statistics, protected by p_handshake_mtx. The time from sending an
+ * initiation to consuming the matching response is an RTT sample, including
+ * the responder's processing time, smoothed as in RFC 6298. Latency is
+ * measured from the first initiation of a round, so it includes retries.
+ */
+struct wg_handshake_stats {
+	sbintime_t	hs_sent;	/* last initiation, sbinuptime */
+	sbintime_t	hs_first;	/* first initiation of this round */
+	sbintime_t	hs_rtt;
+	sbintime_t	hs_srtt;
+	sbintime_t	hs_rttvar;
+	sbintime_t	hs_latency;
+	uint64_t	hs_attempts;
+	uint64_t	hs_retries;
+	uint64_t	hs_completed;
+};
+
+/*
+ * As in wg_softc, the fields written per packet are grouped by direction on
+ * separate cache lines.
+ */
 struct wg_peer {
+	/* Read mostly */
 	TAILQ_ENTRY(wg_peer)		 p_entry;
 	uint64_t			 p_id;
 	struct wg_softc			*p_sc;
@@ -203,34 +367,46 @@ struct wg_peer {
 	struct noise_remote		*p_remote;
 	struct cookie_maker		 p_cookie;
 
+	bool				 p_enabled;
+	uint16_t			 p_persistent_keepalive_interval;
+
+	counter_u64_t			 p_tx_bytes;
+	counter_u64_t			 p_rx_bytes;
+
+	LIST_HEAD(, wg_aip)		 p_aips;
+	size_t				 p_aips_num;
+
+	/* Transmit */
+	struct wg_queue	 		 p_stage_queue __aligned(CACHE_LINE_SIZE);
+	struct wg_stage			*p_stage;	/* see wg_stage_push */
+	struct wg_serial		 p_encrypt_serial;
+	struct grouptask		 p_send;
 	struct rwlock			 p_endpoint_lock;
 	struct wg_endpoint		 p_endpoint;
 
-	struct wg_queue	 		 p_stage_queue;
-	struct wg_queue	 		 p_encrypt_serial;
-	struct wg_queue	 		 p_decrypt_serial;
+	/* Receive */
+	struct wg_serial		 p_decrypt_serial __aligned(CACHE_LINE_SIZE);
+	struct grouptask		 p_recv;
 
-	bool				 p_enabled;
-	bool				 p_need_another_keepalive;
-	uint16_t			 p_persistent_keepalive_interval;
+	/* Timers, rearmed by both directions */
+	bool				 p_need_another_keepalive __aligned(CACHE_LINE_SIZE);
 	struct callout			 p_new_handshake;
 	struct callout			 p_send_keepalive;
 	struct callout			 p_retry_handshake;
 	struct callout			 p_zero_key_material;
-	struct callout			 p_persistent_keepalive;
+
+	/* Persistent keepalive, see wg_keepalive_tick */
+	u_int				 p_keepalive_due;	/* time_uptime */
+	bool				 p_keepalive_scheduled;
+	LIST_ENTRY(wg_peer)		 p_keepalive_entry;
+	STAILQ_ENTRY(wg_peer)		 p_keepalive_batch;
 
 	struct mtx			 p_handshake_mtx;
 	struct timespec			 p_handshake_complete;	/* nanotime */
 	int				 p_handshake_retries;
+	struct wg_handshake_stats	 p_handshake_stats;
 
-	struct grouptask		 p_send;
-	struct grouptask		 p_recv;
-
-	counter_u64_t			 p_tx_bytes;
-	counter_u64_t			 p_rx_bytes;
-
-	LIST_HEAD(, wg_aip)		 p_aips;
-	size_t				 p_aips_num;
+	u_long				 p_drops[WG_DROP_MAX];
 };
 
 struct wg_socket {
@@ -241,6 +417,95 @@ struct wg_socket {
 	in_port_t	 so_port;
 };
 
+/*
+ * Latency histograms, with log2 nanosecond buckets: bucket i counts samples
+ * in [2^i, 2^(i+1)) ns, the first and last buckets are open ended.
+ */
+#define WG_HIST_BUCKETS		32
+
+enum wg_histogram {
+	WG_HIST_STAGE,			/* p_stage_queue */
+	WG_HIST_ENCRYPT_PARALLEL,	/* d_encrypt_parallel */
+	WG_HIST_ENCRYPT,		/* wg_encrypt */
+	WG_HIST_ENCRYPT_SERIAL,		/* p_encrypt_serial */
+	WG_HIST_DECRYPT_PARALLEL,	/* d_decrypt_parallel */
+	WG_HIST_DECRYPT,		/* wg_decrypt */
+	WG_HIST_DECRYPT_SERIAL,		/* p_decrypt_serial */
+	WG_HIST_HANDSHAKE,		/* sc_handshake_queue */
+	WG_HIST_MAX
+};
+
+/*
+ * Crypto worker statistics, one slot per CPU. Each slot is only written by the
+ * worker task bound to that CPU, so no atomics are needed.
+ */
+struct wg_worker_stats {
+	uint64_t	ws_packets;
+	uint64_t	ws_bytes;
+	sbintime_t	ws_busy;
+	uint64_t	ws_runs;
+	uint64_t	ws_empty;	/* runs that found no work */
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * Transmit staging, one per encrypt task. wg_xmit() adds each packet to the
+ * slot for its peer on the current CPU's stage, or on the stage that already
+ * holds the peer's packets, and schedules that stage's encrypt task, which
+ * moves every slot to its peer's p_stage_queue and sends it with a single
+ * keypair lookup, nonce reservation and dispatch. A slot is sent straight away once it holds WG_STAGE_BURST packets, and the oldest slot
+ * is sent to make room when a packet arrives for a peer that has none. The
+ * task flushes the stage again after every WG_STAGE_BURST packets it encrypts,
+ * so that packets staged while it drains a long queue are not held until the
+ * end. Each slot holds a reference to its peer's p_remote.
+ */
+struct wg_stage_slot {
+	struct wg_peer		*ss_peer;
+	struct wg_packet_list	 ss_list;
+	u_int			 ss_len;
+};
+
+struct wg_stage {
+	struct mtx		 st_mtx;
+	struct wg_softc		*st_sc;
+	bool			 st_pending;	/* encrypt task scheduled */
+	u_int			 st_nslots;
+	struct wg_stage_slot	 st_slots[WG_STAGE_PEERS];
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * Head of a per-CPU ring of records. Only the owning CPU writes a ring, inside
+ * a critical section, and publishes each record by advancing r_head. Readers
+ * serialise on sc_lock, drain with wg_ring_drain and may lose records the
+ * owner overwrote meanwhile.
+ */
+struct wg_ring {
+	volatile u_int		r_head;
+	u_int			r_tail;		/* reader only */
+};
+
+/* Flow sample ring, one per CPU */
+#define WG_SAMPLE_RING		256	/* power of 2 */
+
+struct wg_sample_ring {
+	struct wg_ring		sr_ring;
+	u_int			sr_skip;	/* packets until the next sample */
+	uint32_t		sr_rand;
+	struct wg_flow_sample	sr_samples[WG_SAMPLE_RING];
+} __aligned(CACHE_LINE_SIZE);
+
+/* Debug event ring, one per CPU, written and read like the sample rings. */
+#define WG_EVENT_RING		512	/* power of 2 */
+
+struct wg_event_ring {
+	struct wg_ring		er_ring;
+	struct wg_event		er_events[WG_EVENT_RING];
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * The fields written per packet are grouped by direction, each group starting
+ * on its own cache line, so that transmitting and receiving CPUs do not
+ * invalidate each other or the read-mostly fields at the top.
+ */
 struct wg_softc {
 	LIST_ENTRY(wg_softc)	 sc_entry;
 	struct ifnet		*sc_ifp;
@@ -259,22 +524,69 @@ struct wg_softc {
 	struct radix_node_head	*sc_aip6;
 
 	struct grouptask	 sc_handshake;
-	struct wg_queue		 sc_handshake_queue;
-
 	struct grouptask	*sc_encrypt;
 	struct grouptask	*sc_decrypt;
-	struct wg_queue		 sc_encrypt_parallel;
-	struct wg_queue		 sc_decrypt_parallel;
-	u_int			 sc_encrypt_last_cpu;
-	u_int			 sc_decrypt_last_cpu;
+	struct wg_stage		*sc_stage;
+	struct wg_worker_stats	*sc_encrypt_stats;
+	struct wg_worker_stats	*sc_decrypt_stats;
 
 	struct sx		 sc_lock;
+
+	struct sysctl_ctx_list	 sc_sysctl_ctx;
+	struct sysctl_oid	*sc_sysctl_tree;
+	int			 sc_jid;
+	int			 sc_histograms;
+	counter_u64_t		 sc_hist[WG_HIST_MAX][WG_HIST_BUCKETS];
+	counter_u64_t		 sc_drops[WG_DROP_MAX];
+	u_int			 sc_sample_rate;
+	struct wg_sample_ring	*sc_samples;
+	uint64_t		 sc_samples_lost;
+	struct wg_event_ring	*sc_events;	/* allocated with IFF_DEBUG */
+	uint64_t		 sc_events_lost;
+	u_long			 sc_mem_limit;	/* bytes, 0 for none */
+	counter_u64_t		 sc_mem_packets;	/* see wg_mem_charge_packet */
+	int			 sc_tryforward;
+	counter_u64_t		 sc_tryforwarded;	/* not returned to netisr */
+
+	/* Crypto queues, indexed by NUMA domain */
+	struct wg_domain	*sc_domains[MAXMEMDOM];
+	counter_u64_t		 sc_cross_domain[2];	/* encrypt, decrypt */
+
+	struct wg_queue		 sc_handshake_queue __aligned(CACHE_LINE_SIZE);
+
+	struct mtx		 sc_keepalive_mtx __aligned(CACHE_LINE_SIZE);
+	struct callout		 sc_keepalive_callout;
+	time_t			 sc_keepalive_last;	/* last second run */
+	size_t			 sc_keepalive_num;
+	LIST_HEAD(, wg_peer)	 sc_keepalive_wheel[WG_KEEPALIVE_SLOTS];
+
+	/* Asynchronous crypto requests not completed yet, see wg_aead_drain */
+	volatile u_int		 sc_aead_inflight __aligned(CACHE_LINE_SIZE);
+
+	u_long			 sc_mem[WG_MEM_MAX] __aligned(CACHE_LINE_SIZE);
 };
 
+/* Keep the groups in wg_peer and wg_softc on separate cache lines. */
+#define	WG_LINE(s, f)	(offsetof(struct s, f) / CACHE_LINE_SIZE)
+CTASSERT(WG_LINE(wg_peer, p_aips_num) < WG_LINE(wg_peer, p_stage_queue));
+CTASSERT(WG_LINE(wg_peer, p_endpoint) < WG_LINE(wg_peer, p_decrypt_serial));
+CTASSERT(WG_LINE(wg_peer, p_recv) < WG_LINE(wg_peer, p_need_another_keepalive));
+CTASSERT(WG_LINE(wg_domain, d_encrypt_last_cpu) <
+    WG_LINE(wg_domain, d_decrypt_parallel));
+CTASSERT(WG_LINE(wg_softc, sc_cross_domain) <
+    WG_LINE(wg_softc, sc_handshake_queue));
+CTASSERT(WG_LINE(wg_softc, sc_handshake_queue) <
+    WG_LINE(wg_softc, sc_keepalive_mtx));
+CTASSERT(WG_LINE(wg_softc, sc_keepalive_wheel) <
+    WG_LINE(wg_softc, sc_aead_inflight));
+CTASSERT(WG_LINE(wg_softc, sc_aead_inflight) < WG_LINE(wg_softc, sc_mem));
+#undef WG_LINE
+
 #define	WGF_DYING	0x0001
 
 #define MAX_LOOPS	8
 #define MTAG_WGLOOP	0x77676c70 /* wglp */
+
 #ifndef ENOKEY
 #define	ENOKEY	ENOTCAPABLE
 #endif
@@ -289,7 +601,10 @@ struct wg_softc {
 
 static int clone_count;
 static uma_zone_t wg_packet_zone;
+/* malloc(9) does not promise the cache line alignment of wg_peer. */
+static uma_zone_t wg_peer_zone;
 static volatile unsigned long peer_counter = 0;
+static volatile u_int wg_sysctl_counter = 0;
 static const char wgname[] = "wg";
 static unsigned wg_osd_jail_slot;
 
@@ -302,6 +617,80 @@ static TASKQGROUP_DEFINE(wg_tqg, mp_ncpus, 1);
 
 MALLOC_DEFINE(M_WG, "WG", "wireguard");
 
+SYSCTL_DECL(_net_link);
+static SYSCTL_NODE(_net_link, OID_AUTO, wg, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "WireGuard");
+
+static int
+wg_ratelimit_memory_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	u_long val = cookie_ratelimit_memory();
+
+	return (sysctl_handle_long(oidp, &val, 0, req));
+}
+SYSCTL_PROC(_net_link_wg, OID_AUTO, ratelimit_memory,
+    CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0,
+    wg_ratelimit_memory_sysctl, "LU",
+    "Bytes used by the handshake rate limiter, shared by all interfaces");
+
+static int
+wg_aead_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	const struct wg_aead *aead;
+	char name[16];
+	int error;
+
+	strlcpy(name, wg_aead_current()->a_name, sizeof(name));
+	error = sysctl_handle_string(oidp, name, sizeof(name), req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if ((aead = wg_aead_lookup(name)) == NULL)
+		return (EINVAL);
+	wg_aead_select(aead);
+	return (0);
+}
+SYSCTL_PROC(_net_link_wg, OID_AUTO, crypto_backend,
+    CTLTYPE_STRING | CTLFLAG_RWTUN | CTLFLAG_MPSAFE, NULL, 0,
+    wg_aead_sysctl, "A",
+    "Data packet crypto for new keypairs: software, async (testing) or ocf");
+
+static int wg_packet_stamps = 0;
+SYSCTL_INT(_net_link_wg, OID_AUTO, packet_stamps, CTLFLAG_RW,
+    &wg_packet_stamps, 0, "Record per-stage timestamps in each packet");
+
+/*
+ * Whether a packet is stamped is decided once, when it enters the pipeline,
+ * so that every packet either has all of its stamps or none.
+ */
+#define WG_PACKET_STAMP_INIT(sc, pkt)					\
+	((pkt)->p_stamped = wg_packet_stamps || (sc)->sc_histograms)
+
+#define WG_PACKET_STAMP(pkt, stage) do {				\
+	if (__predict_false((pkt)->p_stamped))				\
+		(pkt)->p_stamp[(stage)] = sbinuptime();			\
+} while (0)
+
+SDT_PROVIDER_DEFINE(wg);
+WG_TRACE_DEFINE3(xmit, "struct wg_softc *", "struct wg_peer *",
+    "struct wg_packet *");
+WG_TRACE_DEFINE4(queue, "struct wg_queue *", "struct wg_serial *",
+    "struct wg_packet *", "size_t");
+WG_TRACE_DEFINE3(queue__drop, "struct wg_queue *", "struct wg_serial *",
+    "struct wg_packet *");
+WG_TRACE_DEFINE3(encrypt, "struct wg_peer *", "struct wg_packet *", "int");
+WG_TRACE_DEFINE3(decrypt, "struct wg_peer *", "struct wg_packet *", "int");
+WG_TRACE_DEFINE2(deliver__out, "struct wg_peer *", "struct wg_packet *");
+WG_TRACE_DEFINE2(deliver__in, "struct wg_peer *", "struct wg_packet *");
+WG_TRACE_DEFINE4(send, "struct wg_softc *", "struct wg_endpoint *",
+    "size_t", "int");
+WG_TRACE_DEFINE3(input, "struct wg_softc *", "struct mbuf *",
+    "const struct sockaddr *");
+WG_TRACE_DEFINE3(handshake__send, "struct wg_softc *", "struct wg_peer *",
+    "uint32_t");
+WG_TRACE_DEFINE2(handshake__receive, "struct wg_softc *", "struct wg_packet *");
+WG_TRACE_DEFINE3(handshake__consume, "struct wg_softc *", "struct wg_peer *",
+    "uint32_t");
+
 VNET_DEFINE_STATIC(struct if_clone *, wg_cloner);
 
 #define	V_wg_cloner	VNET(wg_cloner)
@@ -338,7 +727,9 @@ static void wg_timers_run_retry_handshake(void *);
 static void wg_timers_run_send_keepalive(void *);
 static void wg_timers_run_new_handshake(void *);
 static void wg_timers_run_zero_key_material(void *);
-static void wg_timers_run_persistent_keepalive(void *);
+static void wg_keepalive_remove(struct wg_peer *);
+static void wg_timers_start_persistent_keepalive(struct wg_peer *);
+static void wg_keepalive_tick(void *);
 static int wg_aip_add(struct wg_softc *, struct wg_peer *, sa_family_t, const void *, uint8_t);
 static struct wg_peer *wg_aip_lookup(struct wg_softc *, sa_family_t, void *);
 static void wg_aip_remove_all(struct wg_softc *, struct wg_peer *);
@@ -354,18 +745,25 @@ static void wg_peer_set_endpoint(struct wg_peer *, struct wg_endpoint *);
 static void wg_peer_clear_src(struct wg_peer *);
 static void wg_peer_get_endpoint(struct wg_peer *, struct wg_endpoint *);
 static void wg_send_buf(struct wg_softc *, struct wg_endpoint *, uint8_t *, size_t);
+static void wg_peer_stage_keepalive(struct wg_peer *);
 static void wg_send_keepalive(struct wg_peer *);
 static void wg_handshake(struct wg_softc *, struct wg_packet *);
-static void wg_encrypt(struct wg_softc *, struct wg_packet *);
-static void wg_decrypt(struct wg_softc *, struct wg_packet *);
+static void wg_encrypt(struct wg_packet *);
+static void wg_encrypt_done(struct wg_aead_req *, int);
+static void wg_decrypt(struct wg_packet *);
+static void wg_decrypt_done(struct wg_aead_req *, int);
 static void wg_softc_handshake_receive(struct wg_softc *);
 static void wg_softc_decrypt(struct wg_softc *);
-static void wg_softc_encrypt(struct wg_softc *);
-static void wg_encrypt_dispatch(struct wg_softc *);
-static void wg_decrypt_dispatch(struct wg_softc *);
+static void wg_softc_encrypt(struct wg_stage *);
+static void wg_encrypt_dispatch(struct wg_softc *, u_int);
+static void wg_decrypt_dispatch(struct wg_softc *, u_int);
+static void wg_cross_domain(struct wg_softc *, struct wg_packet *, bool);
 static void wg_deliver_out(struct wg_peer *);
+static void wg_event(struct wg_softc *, enum wg_event_id, struct wg_peer *, int);
+static void wg_events_alloc(struct wg_softc *);
+static struct mbuf *wg_tryforward(struct mbuf *, sa_family_t);
 static void wg_deliver_in(struct wg_peer *);
-static struct wg_packet *wg_packet_alloc(struct mbuf *);
+static struct wg_packet *wg_packet_alloc(struct wg_softc *, struct mbuf *);
 static void wg_packet_free(struct wg_packet *);
 static void wg_queue_init(struct wg_queue *, const char *);
 static void wg_queue_deinit(struct wg_queue *);
@@ -373,14 +771,20 @@ static size_t wg_queue_len(struct wg_queue *);
 static int wg_queue_enqueue_handshake(struct wg_queue *, struct wg_packet *);
 static struct wg_packet *wg_queue_dequeue_handshake(struct wg_queue *);
 static void wg_queue_push_staged(struct wg_queue *, struct wg_packet *);
-static void wg_queue_enlist_staged(struct wg_queue *, struct wg_packet_list *);
-static void wg_queue_delist_staged(struct wg_queue *, struct wg_packet_list *);
+static void wg_queue_enlist_staged(struct wg_queue *, struct wg_packet_list *, u_int);
+static u_int wg_queue_delist_staged(struct wg_queue *, struct wg_packet_list *);
 static void wg_queue_purge(struct wg_queue *);
-static int wg_queue_both(struct wg_queue *, struct wg_queue *, struct wg_packet *);
-static struct wg_packet *wg_queue_dequeue_serial(struct wg_queue *);
+static void wg_serial_init(struct wg_serial *, const char *);
+static void wg_serial_deinit(struct wg_serial *, struct wg_softc *);
+static int wg_queue_both(struct wg_queue *, struct wg_serial *, struct wg_packet *);
+static struct wg_packet *wg_queue_dequeue_serial(struct wg_serial *, struct wg_softc *);
 static struct wg_packet *wg_queue_dequeue_parallel(struct wg_queue *);
 static bool wg_input(struct mbuf *, int, struct inpcb *, const struct sockaddr *, void *);
+static bool wg_peer_queue_staged(struct wg_peer *, u_int);
 static void wg_peer_send_staged(struct wg_peer *);
+static void wg_stage_push(struct wg_softc *, struct wg_peer *, struct wg_packet *);
+static void wg_stage_flush(struct wg_stage *);
+static void wg_stage_purge(struct wg_softc *);
 static int wg_clone_create(struct if_clone *, int, caddr_t);
 static void wg_qflush(struct ifnet *);
 static inline int determine_af_and_pullup(struct mbuf **m, sa_family_t *af);
@@ -389,7 +793,9 @@ static int wg_transmit(struct ifnet *, struct mbuf *);
 static int wg_output(struct ifnet *, struct mbuf *, const struct sockaddr *, struct route *);
 static void wg_clone_destroy(struct ifnet *);
 static bool wgc_privileged(struct wg_softc *);
+static int wgc_get_nvl(struct wg_softc *, nvlist_t *);
 static int wgc_get(struct wg_softc *, struct wg_data_io *);
+static int wgc_set_nvl(struct wg_softc *, const nvlist_t *);
 static int wgc_set(struct wg_softc *, struct wg_data_io *);
 static int wg_up(struct wg_softc *);
 static void wg_down(struct wg_softc *);
@@ -398,6 +804,17 @@ static void wg_init(void *);
 static int wg_ioctl(struct ifnet *, u_long, caddr_t);
 static void vnet_wg_init(const void *);
 static void vnet_wg_uninit(const void *);
+static void wg_handoff_save(struct wg_softc *);
+static void wg_handoff_restore(struct wg_softc *, struct wg_peer *);
+static void wg_histogram_add(struct wg_softc *, enum wg_histogram, sbintime_t, sbintime_t);
+static void wg_histogram_packet(struct wg_softc *, struct wg_packet *, bool);
+static void wg_sysctl_init(struct wg_softc *);
+static void wg_drop(struct wg_softc *, struct wg_peer *, enum wg_drop_reason);
+static size_t wg_peer_memory(void);
+static int wg_mem_charge(struct wg_softc *, enum wg_mem_type, size_t);
+static void wg_mem_uncharge(struct wg_softc *, enum wg_mem_type, size_t);
+static void wg_handshake_stats_initiation(struct wg_peer *);
+static void wg_handshake_stats_response(struct wg_peer *);
 static int wg_module_init(void);
 static void wg_module_deinit(void);
 
@@ -409,7 +826,7 @@ wg_peer_alloc(struct wg_softc *sc, const uint8_t pub_key[WG_KEY_SIZE])
 
 	sx_assert(&sc->sc_lock, SX_XLOCKED);
 
-	if ((peer = malloc(sizeof(*peer), M_WG, M_NOWAIT | M_ZERO)) == NULL)
+	if ((peer = uma_zalloc(wg_peer_zone, M_NOWAIT | M_ZERO)) == NULL)
 		goto free_none;
 
 	if ((peer->p_remote = noise_remote_alloc(sc->sc_local, peer, pub_key)) == NULL)
@@ -429,16 +846,16 @@ wg_peer_alloc(struct wg_softc *sc, const uint8_t pub_key[WG_KEY_SIZE])
 	rw_init(&peer->p_endpoint_lock, "wg_peer_endpoint");
 
 	wg_queue_init(&peer->p_stage_queue, "stageq");
-	wg_queue_init(&peer->p_encrypt_serial, "txq");
-	wg_queue_init(&peer->p_decrypt_serial, "rxq");
+	wg_serial_init(&peer->p_encrypt_serial, "txq");
+	wg_serial_init(&peer->p_decrypt_serial, "rxq");
 
 	peer->p_enabled = false;
 	peer->p_need_another_keepalive = false;
 	peer->p_persistent_keepalive_interval = 0;
+	peer->p_keepalive_scheduled = false;
 	callout_init(&peer->p_new_handshake, true);
 	callout_init(&peer->p_send_keepalive, true);
 	callout_init(&peer->p_retry_handshake, true);
-	callout_init(&peer->p_persistent_keepalive, true);
 	callout_init(&peer->p_zero_key_material, true);
 
 	mtx_init(&peer->p_handshake_mtx, "peer handshake", NULL, MTX_DEF);
@@ -459,7 +876,7 @@ free_tx_bytes:
 free_remote:
 	noise_remote_free(peer->p_remote, NULL);
 free_peer:
-	free(peer, M_WG);
+	uma_zfree(wg_peer_zone, peer);
 free_none:
 	return NULL;
 }
@@ -477,8 +894,8 @@ wg_peer_free_deferred(struct noise_remote *r)
 	taskqgroup_detach(qgroup_wg_tqg, &peer->p_recv);
 	taskqgroup_detach(qgroup_wg_tqg, &peer->p_send);
 
-	wg_queue_deinit(&peer->p_decrypt_serial);
-	wg_queue_deinit(&peer->p_encrypt_serial);
+	wg_serial_deinit(&peer->p_decrypt_serial, peer->p_sc);
+	wg_serial_deinit(&peer->p_encrypt_serial, peer->p_sc);
 	wg_queue_deinit(&peer->p_stage_queue);
 
 	counter_u64_free(peer->p_tx_bytes);
@@ -488,7 +905,8 @@ wg_peer_free_deferred(struct noise_remote *r)
 
 	cookie_maker_free(&peer->p_cookie);
 
-	free(peer, M_WG);
+	wg_mem_uncharge(peer->p_sc, WG_MEM_PEERS, wg_peer_memory());
+	uma_zfree(wg_peer_zone, peer);
 }
 
 static void
@@ -526,29 +944,35 @@ wg_peer_destroy_all(struct wg_softc *sc)
 static void
 wg_peer_set_endpoint(struct wg_peer *peer, struct wg_endpoint *e)
 {
+	sbintime_t ls;
+
 	MPASS(e->e_remote.r_sa.sa_family != 0);
 	if (memcmp(e, &peer->p_endpoint, sizeof(*e)) == 0)
 		return;
 
-	rw_wlock(&peer->p_endpoint_lock);
+	WG_RW_WLOCK(&peer->p_endpoint_lock, WG_LOCK_ENDPOINT, ls);
 	peer->p_endpoint = *e;
-	rw_wunlock(&peer->p_endpoint_lock);
+	WG_RW_WUNLOCK(&peer->p_endpoint_lock, WG_LOCK_ENDPOINT, ls);
 }
 
 static void
 wg_peer_clear_src(struct wg_peer *peer)
 {
-	rw_wlock(&peer->p_endpoint_lock);
+	sbintime_t ls;
+
+	WG_RW_WLOCK(&peer->p_endpoint_lock, WG_LOCK_ENDPOINT, ls);
 	bzero(&peer->p_endpoint.e_local, sizeof(peer->p_endpoint.e_local));
-	rw_wunlock(&peer->p_endpoint_lock);
+	WG_RW_WUNLOCK(&peer->p_endpoint_lock, WG_LOCK_ENDPOINT, ls);
 }
 
 static void
 wg_peer_get_endpoint(struct wg_peer *peer, struct wg_endpoint *e)
 {
-	rw_rlock(&peer->p_endpoint_lock);
+	sbintime_t ls;
+
+	WG_RW_RLOCK(&peer->p_endpoint_lock, WG_LOCK_ENDPOINT, ls);
 	*e = peer->p_endpoint;
-	rw_runlock(&peer->p_endpoint_lock);
+	WG_RW_RUNLOCK(&peer->p_endpoint_lock, WG_LOCK_ENDPOINT, ls);
 }
 
 /* Allowed IP */
@@ -560,8 +984,12 @@ wg_aip_add(struct wg_softc *sc, struct wg_peer *peer, sa_family_t af, const void
 	struct wg_aip		*aip;
 	int			 i, ret = 0;
 
-	if ((aip = malloc(sizeof(*aip), M_WG, M_NOWAIT | M_ZERO)) == NULL)
+	if ((ret = wg_mem_charge(sc, WG_MEM_AIPS, sizeof(*aip))) != 0)
+		return (ret);
+	if ((aip = malloc(sizeof(*aip), M_WG, M_NOWAIT | M_ZERO)) == NULL) {
+		wg_mem_uncharge(sc, WG_MEM_AIPS, sizeof(*aip));
 		return (ENOBUFS);
+	}
 	aip->a_peer = peer;
 	aip->a_af = af;
 
@@ -586,6 +1014,7 @@ wg_aip_add(struct wg_softc *sc, struct wg_peer *peer, sa_family_t af, const void
 		break;
 #endif
 	default:
+		wg_mem_uncharge(sc, WG_MEM_AIPS, sizeof(*aip));
 		free(aip, M_WG);
 		return (EAFNOSUPPORT);
 	}
@@ -598,9 +1027,11 @@ wg_aip_add(struct wg_softc *sc, struct wg_peer *peer, sa_family_t af, const void
 	} else if (!node)
 		node = root->rnh_lookup(&aip->a_addr, &aip->a_mask, &root->rh);
 	if (!node) {
+		wg_mem_uncharge(sc, WG_MEM_AIPS, sizeof(*aip));
 		free(aip, M_WG);
 		return (ENOMEM);
 	} else if (node != aip->a_nodes) {
+		wg_mem_uncharge(sc, WG_MEM_AIPS, sizeof(*aip));
 		free(aip, M_WG);
 		aip = (struct wg_aip *)node;
 		if (aip->a_peer != peer) {
@@ -664,6 +1095,7 @@ wg_aip_remove_all(struct wg_softc *sc, struct wg_peer *peer)
 				panic("failed to delete aip %p", aip);
 			LIST_REMOVE(aip, a_entry);
 			peer->p_aips_num--;
+			wg_mem_uncharge(sc, WG_MEM_AIPS, sizeof(*aip));
 			free(aip, M_WG);
 		}
 	}
@@ -676,6 +1108,7 @@ wg_aip_remove_all(struct wg_softc *sc, struct wg_peer *peer)
 				panic("failed to delete aip %p", aip);
 			LIST_REMOVE(aip, a_entry);
 			peer->p_aips_num--;
+			wg_mem_uncharge(sc, WG_MEM_AIPS, sizeof(*aip));
 			free(aip, M_WG);
 		}
 	}
@@ -924,6 +1357,7 @@ wg_send(struct wg_softc *sc, struct wg_endpoint *e, struct mbuf *m)
 		m_freem(m);
 	}
 	NET_EPOCH_EXIT(et);
+	WG_TRACE4(send, sc, e, len, ret);
 	if (ret == 0) {
 		if_inc_counter(sc->sc_ifp, IFCOUNTER_OPACKETS, 1);
 		if_inc_counter(sc->sc_ifp, IFCOUNTER_OBYTES, len);
@@ -959,7 +1393,7 @@ retry:
 	}
 out:
 	if (ret)
-		DPRINTF(sc, "Unable to send packet: %d\n", ret);
+		WG_EVENT(sc, WG_EVENT_SEND_FAILED, NULL, ret);
 }
 
 /* Timers */
@@ -967,7 +1401,7 @@ static void
 wg_timers_enable(struct wg_peer *peer)
 {
 	ck_pr_store_bool(&peer->p_enabled, true);
-	wg_timers_run_persistent_keepalive(peer);
+	wg_timers_start_persistent_keepalive(peer);
 }
 
 static void
@@ -992,8 +1426,8 @@ wg_timers_disable(struct wg_peer *peer)
 	callout_stop(&peer->p_new_handshake);
 	callout_stop(&peer->p_send_keepalive);
 	callout_stop(&peer->p_retry_handshake);
-	callout_stop(&peer->p_persistent_keepalive);
 	callout_stop(&peer->p_zero_key_material);
+	wg_keepalive_remove(peer);
 }
 
 static void
@@ -1004,7 +1438,7 @@ wg_timers_set_persistent_keepalive(struct wg_peer *peer, uint16_t interval)
 		ck_pr_store_16(&peer->p_persistent_keepalive_interval, interval);
 		NET_EPOCH_ENTER(et);
 		if (ck_pr_load_bool(&peer->p_enabled))
-			wg_timers_run_persistent_keepalive(peer);
+			wg_timers_start_persistent_keepalive(peer);
 		NET_EPOCH_EXIT(et);
 	}
 }
@@ -1062,15 +1496,12 @@ wg_timers_event_any_authenticated_packet_received(struct wg_peer *peer)
 static void
 wg_timers_event_any_authenticated_packet_traversal(struct wg_peer *peer)
 {
-	struct epoch_tracker et;
 	uint16_t interval;
-	NET_EPOCH_ENTER(et);
+
+	/* Only pushes the deadline back, wg_keepalive_tick finds it. */
 	interval = ck_pr_load_16(&peer->p_persistent_keepalive_interval);
-	if (ck_pr_load_bool(&peer->p_enabled) && interval > 0)
-		callout_reset(&peer->p_persistent_keepalive,
-		     MSEC_2_TICKS(interval * 1000),
-		     wg_timers_run_persistent_keepalive, peer);
-	NET_EPOCH_EXIT(et);
+	if (interval > 0)
+		atomic_store_int(&peer->p_keepalive_due, time_uptime + interval);
 }
 
 static void
@@ -1142,18 +1573,19 @@ wg_timers_run_retry_handshake(void *_peer)
 	mtx_lock(&peer->p_handshake_mtx);
 	if (peer->p_handshake_retries <= MAX_TIMER_HANDSHAKES) {
 		peer->p_handshake_retries++;
+		peer->p_handshake_stats.hs_retries++;
 		mtx_unlock(&peer->p_handshake_mtx);
 
-		DPRINTF(peer->p_sc, "Handshake for peer %" PRIu64 " did not complete "
-		    "after %d seconds, retrying (try %d)\n", peer->p_id,
-		    REKEY_TIMEOUT, peer->p_handshake_retries + 1);
+		WG_EVENT(peer->p_sc, WG_EVENT_HANDSHAKE_RETRY, peer,
+		    peer->p_handshake_retries + 1);
 		wg_peer_clear_src(peer);
 		wg_timers_run_send_initiation(peer, true);
 	} else {
+		/* The next round measures its latency from scratch. */
+		peer->p_handshake_stats.hs_first = 0;
 		mtx_unlock(&peer->p_handshake_mtx);
 
-		DPRINTF(peer->p_sc, "Handshake for peer %" PRIu64 " did not complete "
-		    "after %d retries, giving up\n", peer->p_id,
+		WG_EVENT(peer->p_sc, WG_EVENT_HANDSHAKE_GIVE_UP, peer,
 		    MAX_TIMER_HANDSHAKES + 2);
 
 		callout_stop(&peer->p_send_keepalive);
@@ -1191,9 +1623,8 @@ wg_timers_run_new_handshake(void *_peer)
 {
 	struct wg_peer *peer = _peer;
 
-	DPRINTF(peer->p_sc, "Retrying handshake with peer %" PRIu64 " because we "
-	    "stopped hearing back after %d seconds\n",
-	    peer->p_id, NEW_HANDSHAKE_TIMEOUT);
+	WG_EVENT(peer->p_sc, WG_EVENT_HANDSHAKE_STALE, peer,
+	    NEW_HANDSHAKE_TIMEOUT);
 
 	wg_peer_clear_src(peer);
 	wg_timers_run_send_initiation(peer, false);
@@ -1204,19 +1635,403 @@ wg_timers_run_zero_key_material(void *_peer)
 {
 	struct wg_peer *peer = _peer;
 
-	DPRINTF(peer->p_sc, "Zeroing out keys for peer %" PRIu64 ", since we "
-	    "haven't received a new one in %d seconds\n",
-	    peer->p_id, REJECT_AFTER_TIME * 3);
+	WG_EVENT(peer->p_sc, WG_EVENT_KEYS_ZEROED, peer, 0);
 	noise_remote_keypairs_clear(peer->p_remote);
 }
 
+/*
+ * Persistent keepalives are driven by a per-interface timer wheel with one
+ * slot per second, rather than a callout per peer that every packet would
+ * reset. Traffic only moves a peer's p_keepalive_due forward. Once a second,
+ * wg_keepalive_tick walks the slot for that second, moves peers whose deadline
+ * was pushed back to the slot of their new deadline, and sends keepalives to
+ * the rest as one batch, with a single dispatch to the encrypt workers.
+ *
+ * Traffic stores p_keepalive_due without the lock, so it is a u_int, which
+ * holds the uptime in seconds and cannot tear, rather than a time_t, which is
+ * 64 bits on some 32-bit platforms.
+ */
+static void
+wg_keepalive_insert(struct wg_softc *sc, struct wg_peer *peer)
+{
+	mtx_assert(&sc->sc_keepalive_mtx, MA_OWNED);
+	LIST_INSERT_HEAD(&sc->sc_keepalive_wheel[
+	    atomic_load_int(&peer->p_keepalive_due) & (WG_KEEPALIVE_SLOTS - 1)],
+	    peer, p_keepalive_entry);
+}
+
 static void
-wg_timers_run_persistent_keepalive(void *_peer)
+wg_keepalive_remove(struct wg_peer *peer)
 {
-	struct wg_peer *peer = _peer;
+	struct wg_softc *sc = peer->p_sc;
+
+	mtx_lock(&sc->sc_keepalive_mtx);
+	if (peer->p_keepalive_scheduled) {
+		LIST_REMOVE(peer, p_keepalive_entry);
+		peer->p_keepalive_scheduled = false;
+		sc->sc_keepalive_num--;
+	}
+	mtx_unlock(&sc->sc_keepalive_mtx);
+}
+
+static void
+wg_timers_start_persistent_keepalive(struct wg_peer *peer)
+{
+	struct wg_softc *sc = peer->p_sc;
+	uint16_t interval;
 
-	if (ck_pr_load_16(&peer->p_persistent_keepalive_interval) > 0)
-		wg_send_keepalive(peer);
+	interval = ck_pr_load_16(&peer->p_persistent_keepalive_interval);
+	if (interval == 0) {
+		wg_keepalive_remove(peer);
+		return;
+	}
+
+	mtx_lock(&sc->sc_keepalive_mtx);
+	if (peer->p_keepalive_scheduled)
+		LIST_REMOVE(peer, p_keepalive_entry);
+	else if (sc->sc_keepalive_num++ == 0)
+		sc->sc_keepalive_last = time_uptime;
+	peer->p_keepalive_scheduled = true;
+	atomic_store_int(&peer->p_keepalive_due, time_uptime + interval);
+	wg_keepalive_insert(sc, peer);
+	if (!callout_pending(&sc->sc_keepalive_callout))
+		callout_reset(&sc->sc_keepalive_callout, hz, wg_keepalive_tick, sc);
+	mtx_unlock(&sc->sc_keepalive_mtx);
+
+	wg_send_keepalive(peer);
+}
+
+static void
+wg_keepalive_tick(void *_sc)
+{
+	struct wg_softc *sc = _sc;
+	STAILQ_HEAD(, wg_peer) batch = STAILQ_HEAD_INITIALIZER(batch);
+	struct wg_peer *peer, *tpeer;
+	time_t t, now = time_uptime;
+	uint16_t interval;
+	u_int due, queued = 0, domain;
+
+	mtx_lock(&sc->sc_keepalive_mtx);
+	t = sc->sc_keepalive_last + 1;
+	if (now - t >= WG_KEEPALIVE_SLOTS)
+		t = now - WG_KEEPALIVE_SLOTS + 1;
+	for (; t <= now; t++) {
+		LIST_FOREACH_SAFE(peer, &sc->sc_keepalive_wheel[t &
+		    (WG_KEEPALIVE_SLOTS - 1)], p_keepalive_entry, tpeer) {
+			due = atomic_load_int(&peer->p_keepalive_due);
+			if (due <= now) {
+				interval = ck_pr_load_16(&peer->p_persistent_keepalive_interval);
+				atomic_store_int(&peer->p_keepalive_due,
+				    now + MAX(interval, 1));
+				noise_remote_ref(peer->p_remote);
+				STAILQ_INSERT_TAIL(&batch, peer, p_keepalive_batch);
+			} else if (((due ^ t) &
+			    (WG_KEEPALIVE_SLOTS - 1)) == 0) {
+				continue;
+			}
+			LIST_REMOVE(peer, p_keepalive_entry);
+			wg_keepalive_insert(sc, peer);
+		}
+	}
+	sc->sc_keepalive_last = now;
+	mtx_unlock(&sc->sc_keepalive_mtx);
+
+	domain = PCPU_GET(domain);
+	STAILQ_FOREACH_SAFE(peer, &batch, p_keepalive_batch, tpeer) {
+		if (ck_pr_load_bool(&peer->p_enabled)) {
+			wg_peer_stage_keepalive(peer);
+			queued += wg_peer_queue_staged(peer, domain);
+		}
+		noise_remote_put(peer->p_remote);
+	}
+	for (u_int i = 0; i < min(queued, sc->sc_domains[domain]->d_ncpus); i++)
+		wg_encrypt_dispatch(sc, domain);
+
+	mtx_lock(&sc->sc_keepalive_mtx);
+	if (sc->sc_keepalive_num > 0)
+		callout_reset(&sc->sc_keepalive_callout, hz, wg_keepalive_tick, sc);
+	mtx_unlock(&sc->sc_keepalive_mtx);
+}
+
+/* Statistics */
+static const char *const wg_drop_names[WG_DROP_MAX] = {
+	[WG_DROP_NOMEM] = "nomem",
+	[WG_DROP_NO_PEER] = "no_peer",
+	[WG_DROP_NO_ENDPOINT] = "no_endpoint",
+	[WG_DROP_LOOP] = "loop",
+	[WG_DROP_ENCRYPT] = "encrypt",
+	[WG_DROP_SEND] = "send",
+	[WG_DROP_INVALID] = "invalid",
+	[WG_DROP_NO_KEYPAIR] = "no_keypair",
+	[WG_DROP_DECRYPT] = "decrypt",
+	[WG_DROP_AUTH] = "auth",
+	[WG_DROP_AUTH_THROTTLE] = "auth_throttle",
+	[WG_DROP_UNALLOWED_SRC] = "unallowed_src",
+	[WG_DROP_REPLAY] = "replay",
+	[WG_DROP_MEMCAP] = "memcap",
+	[WG_DROP_HANDSHAKE_REPLAY] = "handshake_replay",
+};
+
+static void
+wg_drop(struct wg_softc *sc, struct wg_peer *peer, enum wg_drop_reason reason)
+{
+	counter_u64_add(sc->sc_drops[reason], 1);
+	if (peer != NULL)
+		atomic_add_long(&peer->p_drops[reason], 1);
+}
+
+static size_t
+wg_peer_memory(void)
+{
+	size_t local, remote, keypair;
+
+	noise_object_sizes(&local, &remote, &keypair);
+	return (sizeof(struct wg_peer) + remote +
+	    2 * sizeof(uint64_t) * mp_ncpus);
+}
+
+static u_long
+wg_mem_total(struct wg_softc *sc)
+{
+	size_t local, remote, keypair;
+	u_long total;
+
+	noise_object_sizes(&local, &remote, &keypair);
+	total = noise_local_keypairs(sc->sc_local) * keypair;
+	for (int i = 0; i < WG_MEM_MAX; i++)
+		total += sc->sc_mem[i];
+	return (total);
+}
+
+/*
+ * The limit is checked before charging without holding anything, so
+ * concurrent charges may overshoot it by a few objects. It is a guard against
+ * exhausting kernel memory, not an exact quota.
+ */
+static int
+wg_mem_charge(struct wg_softc *sc, enum wg_mem_type type, size_t size)
+{
+	u_long limit = sc->sc_mem_limit;
+
+	if (__predict_false(limit != 0) && wg_mem_total(sc) + size > limit)
+		return (EDQUOT);
+	atomic_add_long(&sc->sc_mem[type], size);
+	return (0);
+}
+
+static void
+wg_mem_uncharge(struct wg_softc *sc, enum wg_mem_type type, size_t size)
+{
+	atomic_subtract_long(&sc->sc_mem[type], size);
+}
+
+/*
+ * Packets are charged and uncharged on every CPU, so while there is no limit
+ * they are only counted per CPU in sc_mem_packets, which is not shared. With
+ * a limit they are charged to the shared total it is checked against. The
+ * packet remembers which of the two it was charged to. Packets charged per
+ * CPU before a limit was set are not seen by the limit, but they are gone
+ * once the queues have drained.
+ */
+static int
+wg_mem_charge_packet(struct wg_softc *sc, struct wg_packet *pkt, u_int size)
+{
+	if (__predict_true(sc->sc_mem_limit == 0)) {
+		counter_u64_add(sc->sc_mem_packets, size);
+		pkt->p_charge_shared = false;
+	} else {
+		if (wg_mem_charge(sc, WG_MEM_PACKETS, size) != 0)
+			return (EDQUOT);
+		pkt->p_charge_shared = true;
+	}
+	pkt->p_charge = size;
+	return (0);
+}
+
+static void
+wg_mem_uncharge_packet(struct wg_softc *sc, struct wg_packet *pkt)
+{
+	if (pkt->p_charge_shared)
+		wg_mem_uncharge(sc, WG_MEM_PACKETS, pkt->p_charge);
+	else
+		counter_u64_add(sc->sc_mem_packets, -(int64_t)pkt->p_charge);
+}
+
+static void
+wg_histogram_add(struct wg_softc *sc, enum wg_histogram hist,
+    sbintime_t start, sbintime_t end)
+{
+	uint64_t ns;
+	int bucket = 0;
+
+	if (end > start && (ns = sbttons(end - start)) != 0)
+		bucket = min(flsll(ns) - 1, WG_HIST_BUCKETS - 1);
+	counter_u64_add(sc->sc_hist[hist][bucket], 1);
+}
+
+static void
+wg_histogram_packet(struct wg_softc *sc, struct wg_packet *pkt, bool tx)
+{
+	sbintime_t *stamp = pkt->p_stamp;
+
+	if (!sc->sc_histograms)
+		return;
+	if (tx)
+		wg_histogram_add(sc, WG_HIST_STAGE,
+		    stamp[WG_STAMP_STAGED], stamp[WG_STAMP_QUEUED]);
+	wg_histogram_add(sc, tx ? WG_HIST_ENCRYPT_PARALLEL : WG_HIST_DECRYPT_PARALLEL,
+	    stamp[WG_STAMP_QUEUED], stamp[WG_STAMP_CRYPTO]);
+	wg_histogram_add(sc, tx ? WG_HIST_ENCRYPT : WG_HIST_DECRYPT,
+	    stamp[WG_STAMP_CRYPTO], stamp[WG_STAMP_CRYPTED]);
+	wg_histogram_add(sc, tx ? WG_HIST_ENCRYPT_SERIAL : WG_HIST_DECRYPT_SERIAL,
+	    stamp[WG_STAMP_CRYPTED], sbinuptime());
+}
+
+static void
+wg_sample_fill(struct wg_flow_sample *fs, struct mbuf *m, sa_family_t af)
+{
+	uint16_t ports[2];
+	int off;
+
+	if (af == AF_INET) {
+		struct ip *ip = mtod(m, struct ip *);
+
+		memcpy(fs->fs_src, &ip->ip_src, sizeof(ip->ip_src));
+		memcpy(fs->fs_dst, &ip->ip_dst, sizeof(ip->ip_dst));
+		fs->fs_proto = ip->ip_p;
+		off = ip->ip_hl << 2;
+		/* Only the first fragment carries the ports. */
+		if ((ntohs(ip->ip_off) & IP_OFFMASK) != 0)
+			return;
+	} else {
+		struct ip6_hdr *ip6 = mtod(m, struct ip6_hdr *);
+
+		memcpy(fs->fs_src, &ip6->ip6_src, sizeof(ip6->ip6_src));
+		memcpy(fs->fs_dst, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+		/* Extension headers are not followed, so no ports for those. */
+		fs->fs_proto = ip6->ip6_nxt;
+		off = sizeof(*ip6);
+	}
+
+	switch (fs->fs_proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+		if (off + sizeof(ports) > m->m_pkthdr.len)
+			break;
+		m_copydata(m, off, sizeof(ports), (caddr_t)ports);
+		fs->fs_sport = ports[0];
+		fs->fs_dport = ports[1];
+		break;
+	}
+}
+
+/*
+ * Record one in sc_sample_rate packets on average, with a random gap so that
+ * periodic traffic is not aliased. The inner headers have been pulled up by
+ * the caller, in wg_transmit/wg_output or wg_decrypt.
+ */
+static void
+wg_sample(struct wg_softc *sc, struct wg_peer *peer, struct mbuf *m,
+    sa_family_t af, uint8_t dir)
+{
+	struct wg_sample_ring *sr;
+	struct wg_flow_sample *fs;
+	u_int rate;
+	uint32_t x;
+
+	if ((rate = atomic_load_acq_int(&sc->sc_sample_rate)) == 0)
+		return;
+
+	critical_enter();
+	sr = &sc->sc_samples[curcpu];
+	if (sr->sr_skip > 1) {
+		sr->sr_skip--;
+		critical_exit();
+		return;
+	}
+	/* xorshift32, arc4random may sleep on a mutex */
+	if ((x = sr->sr_rand) == 0)
+		x = curcpu + 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sr->sr_rand = x;
+	sr->sr_skip = 1 + x % (2 * rate - 1);
+
+	fs = &sr->sr_samples[sr->sr_ring.r_head & (WG_SAMPLE_RING - 1)];
+	bzero(fs, sizeof(*fs));
+	fs->fs_time = sbttons(sbinuptime());
+	fs->fs_peer = peer->p_id;
+	fs->fs_len = MIN(m->m_pkthdr.len, UINT16_MAX);
+	fs->fs_af = af;
+	fs->fs_dir = dir;
+	wg_sample_fill(fs, m, af);
+	atomic_store_rel_int(&sr->sr_ring.r_head, sr->sr_ring.r_head + 1);
+	critical_exit();
+}
+
+/* Record a debug event, see WG_EVENT. */
+static void
+wg_event(struct wg_softc *sc, enum wg_event_id id, struct wg_peer *peer, int arg)
+{
+	struct wg_event_ring *er;
+	struct wg_event *ev;
+
+	/* IFF_DEBUG is set before SIOCSIFFLAGS gets to allocate the rings. */
+	if ((er = (void *)atomic_load_acq_ptr((uintptr_t *)&sc->sc_events)) == NULL)
+		return;
+
+	critical_enter();
+	er = &er[curcpu];
+	ev = &er->er_events[er->er_ring.r_head & (WG_EVENT_RING - 1)];
+	ev->ev_time = sbttons(sbinuptime());
+	ev->ev_peer = peer != NULL ? peer->p_id : WG_EVENT_NO_PEER;
+	ev->ev_id = id;
+	ev->ev_arg = arg;
+	atomic_store_rel_int(&er->er_ring.r_head, er->er_ring.r_head + 1);
+	critical_exit();
+}
+
+static void
+wg_handshake_stats_initiation(struct wg_peer *peer)
+{
+	struct wg_handshake_stats *hs = &peer->p_handshake_stats;
+
+	mtx_lock(&peer->p_handshake_mtx);
+	hs->hs_sent = sbinuptime();
+	if (hs->hs_first == 0)
+		hs->hs_first = hs->hs_sent;
+	hs->hs_attempts++;
+	mtx_unlock(&peer->p_handshake_mtx);
+}
+
+static void
+wg_handshake_stats_response(struct wg_peer *peer)
+{
+	struct wg_handshake_stats *hs = &peer->p_handshake_stats;
+	sbintime_t now = sbinuptime(), rtt, delta;
+
+	mtx_lock(&peer->p_handshake_mtx);
+	/* Noise only accepts a response to the latest initiation. */
+	if (hs->hs_sent == 0)
+		goto out;
+	rtt = now - hs->hs_sent;
+	if (hs->hs_srtt == 0) {
+		hs->hs_srtt = rtt;
+		hs->hs_rttvar = rtt / 2;
+	} else {
+		delta = hs->hs_srtt > rtt ? hs->hs_srtt - rtt : rtt - hs->hs_srtt;
+		hs->hs_rttvar += (delta - hs->hs_rttvar) / 4;
+		hs->hs_srtt += (rtt - hs->hs_srtt) / 8;
+	}
+	hs->hs_rtt = rtt;
+	hs->hs_latency = now - hs->hs_first;
+	hs->hs_completed++;
+	hs->hs_sent = hs->hs_first = 0;
+out:
+	mtx_unlock(&peer->p_handshake_mtx);
 }
 
 /* TODO Handshake */
@@ -1241,11 +2056,13 @@ wg_send_initiation(struct wg_peer *peer)
 	    pkt.es, pkt.ets) != 0)
 		return;
 
-	DPRINTF(peer->p_sc, "Sending handshake initiation to peer %" PRIu64 "\n", peer->p_id);
+	WG_EVENT(peer->p_sc, WG_EVENT_SEND_INITIATION, peer, 0);
 
 	pkt.t = WG_PKT_INITIATION;
 	cookie_maker_mac(&peer->p_cookie, &pkt.m, &pkt,
 	    sizeof(pkt) - sizeof(pkt.m));
+	WG_TRACE3(handshake__send, peer->p_sc, peer, le32toh(pkt.t));
+	wg_handshake_stats_initiation(peer);
 	wg_peer_send_buf(peer, (uint8_t *)&pkt, sizeof(pkt));
 	wg_timers_event_handshake_initiated(peer);
 }
@@ -1259,12 +2076,13 @@ wg_send_response(struct wg_peer *peer)
 	    pkt.ue, pkt.en) != 0)
 		return;
 
-	DPRINTF(peer->p_sc, "Sending handshake response to peer %" PRIu64 "\n", peer->p_id);
+	WG_EVENT(peer->p_sc, WG_EVENT_SEND_RESPONSE, peer, 0);
 
 	wg_timers_event_session_derived(peer);
 	pkt.t = WG_PKT_RESPONSE;
 	cookie_maker_mac(&peer->p_cookie, &pkt.m, &pkt,
 	     sizeof(pkt)-sizeof(pkt.m));
+	WG_TRACE3(handshake__send, peer->p_sc, peer, le32toh(pkt.t));
 	wg_peer_send_buf(peer, (uint8_t*)&pkt, sizeof(pkt));
 }
 
@@ -1274,33 +2092,42 @@ wg_send_cookie(struct wg_softc *sc, struct cookie_macs *cm, uint32_t idx,
 {
 	struct wg_pkt_cookie	pkt;
 
-	DPRINTF(sc, "Sending cookie response for denied handshake message\n");
+	WG_EVENT(sc, WG_EVENT_SEND_COOKIE, NULL, 0);
 
 	pkt.t = WG_PKT_COOKIE;
 	pkt.r_idx = idx;
 
 	cookie_checker_create_payload(&sc->sc_cookie, cm, pkt.nonce,
 	    pkt.ec, &e->e_remote.r_sa);
+	WG_TRACE3(handshake__send, sc, NULL, le32toh(pkt.t));
 	wg_send_buf(sc, e, (uint8_t *)&pkt, sizeof(pkt));
 }
 
+/* Stage an empty packet, unless there is data staged to go instead. */
 static void
-wg_send_keepalive(struct wg_peer *peer)
+wg_peer_stage_keepalive(struct wg_peer *peer)
 {
 	struct wg_packet *pkt;
 	struct mbuf *m;
 
 	if (wg_queue_len(&peer->p_stage_queue) > 0)
-		goto send;
+		return;
 	if ((m = m_gethdr(M_NOWAIT, MT_DATA)) == NULL)
 		return;
-	if ((pkt = wg_packet_alloc(m)) == NULL) {
+	if ((pkt = wg_packet_alloc(peer->p_sc, m)) == NULL) {
 		m_freem(m);
 		return;
 	}
+	WG_PACKET_STAMP_INIT(peer->p_sc, pkt);
+	WG_PACKET_STAMP(pkt, WG_STAMP_STAGED);
 	wg_queue_push_staged(&peer->p_stage_queue, pkt);
-	DPRINTF(peer->p_sc, "Sending keepalive packet to peer %" PRIu64 "\n", peer->p_id);
-send:
+	WG_EVENT(peer->p_sc, WG_EVENT_SEND_KEEPALIVE, peer, 0);
+}
+
+static void
+wg_send_keepalive(struct wg_peer *peer)
+{
+	wg_peer_stage_keepalive(peer);
 	wg_peer_send_staged(peer);
 }
 
@@ -1327,6 +2154,11 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 			wg_last_underload = 0;
 	}
 
+	WG_TRACE2(handshake__receive, sc, pkt);
+	if (pkt->p_stamped && sc->sc_histograms)
+		wg_histogram_add(sc, WG_HIST_HANDSHAKE,
+		    pkt->p_stamp[WG_STAMP_QUEUED], sbinuptime());
+
 	m = pkt->p_mbuf;
 	e = &pkt->p_endpoint;
 
@@ -1343,10 +2175,10 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 				sc->sc_ifp->if_vnet);
 
 		if (res == EINVAL) {
-			DPRINTF(sc, "Invalid initiation MAC\n");
+			WG_EVENT(sc, WG_EVENT_INITIATION_BAD_MAC, NULL, 0);
 			goto error;
 		} else if (res == ECONNREFUSED) {
-			DPRINTF(sc, "Handshake ratelimited\n");
+			WG_EVENT(sc, WG_EVENT_INITIATION_RATELIMITED, NULL, 0);
 			goto error;
 		} else if (res == EAGAIN) {
 			wg_send_cookie(sc, &init->m, init->s_idx, e);
@@ -1355,15 +2187,20 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 			panic("unexpected response: %d\n", res);
 		}
 
-		if (noise_consume_initiation(sc->sc_local, &remote,
-		    init->s_idx, init->ue, init->es, init->ets) != 0) {
-			DPRINTF(sc, "Invalid handshake initiation\n");
+		res = noise_consume_initiation(sc->sc_local, &remote,
+		    init->s_idx, init->ue, init->es, init->ets);
+		if (res == EALREADY) {
+			WG_EVENT(sc, WG_EVENT_INITIATION_REPLAY, NULL, 0);
+			wg_drop(sc, NULL, WG_DROP_HANDSHAKE_REPLAY);
 			goto error;
-		}
+		} else if (res != 0) {
+			WG_EVENT(sc, WG_EVENT_INITIATION_INVALID, NULL, 0);
+			goto error;
+		}
 
 		peer = noise_remote_arg(remote);
 
-		DPRINTF(sc, "Receiving handshake initiation from peer %" PRIu64 "\n", peer->p_id);
+		WG_EVENT(sc, WG_EVENT_RECV_INITIATION, peer, 0);
 
 		wg_peer_set_endpoint(peer, e);
 		wg_send_response(peer);
@@ -1377,10 +2214,10 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 				sc->sc_ifp->if_vnet);
 
 		if (res == EINVAL) {
-			DPRINTF(sc, "Invalid response MAC\n");
+			WG_EVENT(sc, WG_EVENT_RESPONSE_BAD_MAC, NULL, 0);
 			goto error;
 		} else if (res == ECONNREFUSED) {
-			DPRINTF(sc, "Handshake ratelimited\n");
+			WG_EVENT(sc, WG_EVENT_RESPONSE_RATELIMITED, NULL, 0);
 			goto error;
 		} else if (res == EAGAIN) {
 			wg_send_cookie(sc, &resp->m, resp->s_idx, e);
@@ -1391,13 +2228,14 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 
 		if (noise_consume_response(sc->sc_local, &remote,
 		    resp->s_idx, resp->r_idx, resp->ue, resp->en) != 0) {
-			DPRINTF(sc, "Invalid handshake response\n");
+			WG_EVENT(sc, WG_EVENT_RESPONSE_INVALID, NULL, 0);
 			goto error;
 		}
 
 		peer = noise_remote_arg(remote);
-		DPRINTF(sc, "Receiving handshake response from peer %" PRIu64 "\n", peer->p_id);
+		WG_EVENT(sc, WG_EVENT_RECV_RESPONSE, peer, 0);
 
+		wg_handshake_stats_response(peer);
 		wg_peer_set_endpoint(peer, e);
 		wg_timers_event_session_derived(peer);
 		wg_timers_event_handshake_complete(peer);
@@ -1406,7 +2244,7 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 		cook = mtod(m, struct wg_pkt_cookie *);
 
 		if ((remote = noise_remote_index(sc->sc_local, cook->r_idx)) == NULL) {
-			DPRINTF(sc, "Unknown cookie index\n");
+			WG_EVENT(sc, WG_EVENT_COOKIE_UNKNOWN_INDEX, NULL, 0);
 			goto error;
 		}
 
@@ -1414,9 +2252,9 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 
 		if (cookie_maker_consume_payload(&peer->p_cookie,
 		    cook->nonce, cook->ec) == 0) {
-			DPRINTF(sc, "Receiving cookie response\n");
+			WG_EVENT(sc, WG_EVENT_RECV_COOKIE, peer, 0);
 		} else {
-			DPRINTF(sc, "Could not decrypt cookie response\n");
+			WG_EVENT(sc, WG_EVENT_COOKIE_INVALID, peer, 0);
 			goto error;
 		}
 
@@ -1429,6 +2267,7 @@ wg_handshake(struct wg_softc *sc, struct wg_packet *pkt)
 	wg_timers_event_any_authenticated_packet_traversal(peer);
 
 not_authenticated:
+	WG_TRACE3(handshake__consume, sc, peer, le32toh(*mtod(m, uint32_t *)));
 	counter_u64_add(peer->p_rx_bytes, m->m_pkthdr.len);
 	if_inc_counter(sc->sc_ifp, IFCOUNTER_IPACKETS, 1);
 	if_inc_counter(sc->sc_ifp, IFCOUNTER_IBYTES, m->m_pkthdr.len);
@@ -1506,28 +2345,47 @@ calculate_padding(struct wg_packet *pkt)
 }
 
 static void
-wg_encrypt(struct wg_softc *sc, struct wg_packet *pkt)
+wg_encrypt(struct wg_packet *pkt)
 {
 	static const uint8_t	 padding[WG_PKT_PADDING] = { 0 };
+	unsigned int		 padlen;
+	int			 ret = ENOMEM;
+
+	pkt->p_aead.ar_done = wg_encrypt_done;
+	pkt->p_aead.ar_arg = pkt;
+	pkt->p_aead.ar_inflight = &pkt->p_sc->sc_aead_inflight;
+
+	/* Pad the packet */
+	padlen = calculate_padding(pkt);
+	if (padlen != 0 && !m_append(pkt->p_mbuf, padlen, padding))
+		goto out;
+
+	/* Do encryption, the backend may complete it later */
+	ret = noise_keypair_encrypt(pkt->p_keypair, &pkt->p_idx, pkt->p_nonce,
+	    pkt->p_mbuf, &pkt->p_aead);
+	if (ret == EINPROGRESS)
+		return;
+out:
+	wg_encrypt_done(&pkt->p_aead, ret);
+}
+
+static void
+wg_encrypt_done(struct wg_aead_req *req, int error)
+{
+	struct wg_packet	*pkt = req->ar_arg;
+	struct wg_softc		*sc = pkt->p_sc;
 	struct wg_pkt_data	*data;
 	struct wg_peer		*peer;
 	struct noise_remote	*remote;
 	struct mbuf		*m;
-	uint32_t		 idx;
-	unsigned int		 padlen;
 	enum wg_ring_state	 state = WG_PACKET_DEAD;
 
 	remote = noise_keypair_remote(pkt->p_keypair);
 	peer = noise_remote_arg(remote);
 	m = pkt->p_mbuf;
+	wg_cross_domain(sc, pkt, true);
 
-	/* Pad the packet */
-	padlen = calculate_padding(pkt);
-	if (padlen != 0 && !m_append(m, padlen, padding))
-		goto out;
-
-	/* Do encryption */
-	if (noise_keypair_encrypt(pkt->p_keypair, &idx, pkt->p_nonce, m) != 0)
+	if (error != 0)
 		goto out;
 
 	/* Put header into packet */
@@ -1536,22 +2394,47 @@ wg_encrypt(struct wg_softc *sc, struct wg_packet *pkt)
 		goto out;
 	data = mtod(m, struct wg_pkt_data *);
 	data->t = WG_PKT_DATA;
-	data->r_idx = idx;
+	data->r_idx = pkt->p_idx;
 	data->nonce = htole64(pkt->p_nonce);
 
 	wg_mbuf_reset(m);
 	state = WG_PACKET_CRYPTED;
 out:
+	if (state == WG_PACKET_DEAD)
+		wg_drop(sc, peer, WG_DROP_ENCRYPT);
 	pkt->p_mbuf = m;
-	wmb();
-	pkt->p_state = state;
+	WG_PACKET_STAMP(pkt, WG_STAMP_CRYPTED);
+	WG_TRACE3(encrypt, peer, pkt, state);
+	atomic_store_rel_int(&pkt->p_state, state);
 	GROUPTASK_ENQUEUE(&peer->p_send);
 	noise_remote_put(remote);
 }
 
 static void
-wg_decrypt(struct wg_softc *sc, struct wg_packet *pkt)
+wg_decrypt(struct wg_packet *pkt)
+{
+	struct mbuf		*m = pkt->p_mbuf;
+	int			 ret;
+
+	pkt->p_aead.ar_done = wg_decrypt_done;
+	pkt->p_aead.ar_arg = pkt;
+	pkt->p_aead.ar_inflight = &pkt->p_sc->sc_aead_inflight;
+
+	/* Read nonce and then adjust to remove the header. */
+	pkt->p_nonce = le64toh(mtod(m, struct wg_pkt_data *)->nonce);
+	m_adj(m, sizeof(struct wg_pkt_data));
+
+	/* Do decryption, the backend may complete it later */
+	ret = noise_keypair_decrypt(pkt->p_keypair, pkt->p_nonce, m, &pkt->p_aead);
+	if (ret != EINPROGRESS)
+		wg_decrypt_done(&pkt->p_aead, ret);
+}
+
+static void
+wg_decrypt_done(struct wg_aead_req *req, int error)
 {
+	struct wg_packet	*pkt = req->ar_arg;
+	struct wg_softc		*sc = pkt->p_sc;
 	struct wg_peer		*peer, *allowed_peer;
 	struct noise_remote	*remote;
 	struct mbuf		*m;
@@ -1561,18 +2444,23 @@ wg_decrypt(struct wg_softc *sc, struct wg_packet *pkt)
 	remote = noise_keypair_remote(pkt->p_keypair);
 	peer = noise_remote_arg(remote);
 	m = pkt->p_mbuf;
-
-	/* Read nonce and then adjust to remove the header. */
-	pkt->p_nonce = le64toh(mtod(m, struct wg_pkt_data *)->nonce);
-	m_adj(m, sizeof(struct wg_pkt_data));
-
-	if (noise_keypair_decrypt(pkt->p_keypair, pkt->p_nonce, m) != 0)
+	wg_cross_domain(sc, pkt, false);
+
+	if (error == EBADMSG) {
+		wg_drop(sc, peer, WG_DROP_AUTH);
+		cookie_auth_failed(&pkt->p_endpoint.e_remote.r_sa,
+		    sc->sc_ifp->if_vnet);
+		if (noise_keypair_auth_failed(pkt->p_keypair))
+			WG_EVENT(sc, WG_EVENT_VERIFY_FIRST, peer, 0);
 		goto out;
+	} else if (error != 0) {
+		wg_drop(sc, peer, WG_DROP_DECRYPT);
+		goto out;
+	}
 
 	/* A packet with length 0 is a keepalive packet */
 	if (__predict_false(m->m_pkthdr.len == 0)) {
-		DPRINTF(sc, "Receiving keepalive packet from peer "
-		    "%" PRIu64 "\n", peer->p_id);
+		WG_EVENT(sc, WG_EVENT_RECV_KEEPALIVE, peer, 0);
 		state = WG_PACKET_CRYPTED;
 		goto out;
 	}
@@ -1599,7 +2487,8 @@ wg_decrypt(struct wg_softc *sc, struct wg_packet *pkt)
 		} else
 			panic("determine_af_and_pullup returned unexpected value");
 	} else {
-		DPRINTF(sc, "Packet is neither ipv4 nor ipv6 from peer %" PRIu64 "\n", peer->p_id);
+		WG_EVENT(sc, WG_EVENT_NOT_IP, peer, 0);
+		wg_drop(sc, peer, WG_DROP_INVALID);
 		goto out;
 	}
 
@@ -1608,7 +2497,8 @@ wg_decrypt(struct wg_softc *sc, struct wg_packet *pkt)
 		noise_remote_put(allowed_peer->p_remote);
 
 	if (__predict_false(peer != allowed_peer)) {
-		DPRINTF(sc, "Packet has unallowed src IP from peer %" PRIu64 "\n", peer->p_id);
+		WG_EVENT(sc, WG_EVENT_UNALLOWED_SRC, peer, 0);
+		wg_drop(sc, peer, WG_DROP_UNALLOWED_SRC);
 		goto out;
 	}
 
@@ -1616,8 +2506,9 @@ wg_decrypt(struct wg_softc *sc, struct wg_packet *pkt)
 	state = WG_PACKET_CRYPTED;
 out:
 	pkt->p_mbuf = m;
-	wmb();
-	pkt->p_state = state;
+	WG_PACKET_STAMP(pkt, WG_STAMP_CRYPTED);
+	WG_TRACE3(decrypt, peer, pkt, state);
+	atomic_store_rel_int(&pkt->p_state, state);
 	GROUPTASK_ENQUEUE(&peer->p_recv);
 	noise_remote_put(remote);
 }
@@ -1625,38 +2516,131 @@ out:
 static void
 wg_softc_decrypt(struct wg_softc *sc)
 {
+	struct wg_worker_stats *ws = &sc->sc_decrypt_stats[curcpu];
+	struct wg_domain *dom = sc->sc_domains[PCPU_GET(domain)];
 	struct wg_packet *pkt;
-	while ((pkt = wg_queue_dequeue_parallel(&sc->sc_decrypt_parallel)) != NULL)
-		wg_decrypt(sc, pkt);
+	sbintime_t start = sbinuptime();
+	uint64_t packets = 0;
+
+	while ((pkt = wg_queue_dequeue_parallel(&dom->d_decrypt_parallel)) != NULL) {
+		WG_PACKET_STAMP(pkt, WG_STAMP_CRYPTO);
+		ws->ws_bytes += pkt->p_mbuf->m_pkthdr.len;
+		packets++;
+		wg_decrypt(pkt);
+	}
+
+	ws->ws_runs++;
+	if (packets == 0)
+		ws->ws_empty++;
+	ws->ws_packets += packets;
+	ws->ws_busy += sbinuptime() - start;
 }
 
 static void
-wg_softc_encrypt(struct wg_softc *sc)
+wg_softc_encrypt(struct wg_stage *st)
 {
+	struct wg_softc *sc = st->st_sc;
+	struct wg_worker_stats *ws = &sc->sc_encrypt_stats[curcpu];
+	struct wg_domain *dom = sc->sc_domains[PCPU_GET(domain)];
 	struct wg_packet *pkt;
-	while ((pkt = wg_queue_dequeue_parallel(&sc->sc_encrypt_parallel)) != NULL)
-		wg_encrypt(sc, pkt);
+	sbintime_t start = sbinuptime();
+	uint64_t packets = 0;
+
+	wg_stage_flush(st);
+	while ((pkt = wg_queue_dequeue_parallel(&dom->d_encrypt_parallel)) != NULL) {
+		WG_PACKET_STAMP(pkt, WG_STAMP_CRYPTO);
+		ws->ws_bytes += pkt->p_mbuf->m_pkthdr.len;
+		wg_encrypt(pkt);
+		if (++packets % WG_STAGE_BURST == 0)
+			wg_stage_flush(st);
+	}
+
+	ws->ws_runs++;
+	if (packets == 0)
+		ws->ws_empty++;
+	ws->ws_packets += packets;
+	ws->ws_busy += sbinuptime() - start;
 }
 
+/* Wake a worker in the domain whose queue the packets were put on. */
 static void
-wg_encrypt_dispatch(struct wg_softc *sc)
+wg_encrypt_dispatch(struct wg_softc *sc, u_int domain)
 {
+	struct wg_domain *dom = sc->sc_domains[domain];
 	/*
-	 * The update to encrypt_last_cpu is racey such that we may
+	 * The update to d_encrypt_last_cpu is racey such that we may
 	 * reschedule the task for the same CPU multiple times, but
 	 * the race doesn't really matter.
 	 */
-	u_int cpu = (sc->sc_encrypt_last_cpu + 1) % mp_ncpus;
-	sc->sc_encrypt_last_cpu = cpu;
-	GROUPTASK_ENQUEUE(&sc->sc_encrypt[cpu]);
+	u_int i = (dom->d_encrypt_last_cpu + 1) % dom->d_ncpus;
+	dom->d_encrypt_last_cpu = i;
+	GROUPTASK_ENQUEUE(&sc->sc_encrypt[dom->d_cpus[i]]);
+}
+
+static void
+wg_decrypt_dispatch(struct wg_softc *sc, u_int domain)
+{
+	struct wg_domain *dom = sc->sc_domains[domain];
+	u_int i = (dom->d_decrypt_last_cpu + 1) % dom->d_ncpus;
+	dom->d_decrypt_last_cpu = i;
+	GROUPTASK_ENQUEUE(&sc->sc_decrypt[dom->d_cpus[i]]);
+}
+
+/* The per-domain queues are only numbered when there is more than one. */
+static void
+wg_domain_name(char *buf, size_t len, const char *name, int domain)
+{
+	if (vm_ndomains == 1)
+		strlcpy(buf, name, len);
+	else
+		snprintf(buf, len, "%s%d", name, domain);
+}
+
+/* Count crypto done outside the domain the packet was queued in. */
+static void
+wg_cross_domain(struct wg_softc *sc, struct wg_packet *pkt, bool tx)
+{
+	if (__predict_false(pkt->p_domain != PCPU_GET(domain)))
+		counter_u64_add(sc->sc_cross_domain[tx ? 0 : 1], 1);
+}
+
+static void
+wg_domains_init(struct wg_softc *sc)
+{
+	struct wg_domain *dom;
+	u_int cpus[MAXMEMDOM] = { 0 };
+	int i;
+
+	/* CPU IDs may be sparse, so only look at the ones that exist. */
+	CPU_FOREACH(i)
+		cpus[pcpu_find(i)->pc_domain]++;
+	for (int d = 0; d < vm_ndomains; d++) {
+		/* A domain without CPUs has its packets queued elsewhere. */
+		dom = malloc_domainset(sizeof(*dom) + sizeof(u_int) * MAX(cpus[d], 1),
+		    M_WG, DOMAINSET_PREF(d), M_WAITOK | M_ZERO);
+		wg_queue_init(&dom->d_encrypt_parallel, "encp");
+		wg_queue_init(&dom->d_decrypt_parallel, "decp");
+		CPU_FOREACH(i)
+			if (pcpu_find(i)->pc_domain == d)
+				dom->d_cpus[dom->d_ncpus++] = i;
+		if (dom->d_ncpus == 0)
+			dom->d_cpus[dom->d_ncpus++] = CPU_FIRST();
+		sc->sc_domains[d] = dom;
+	}
+	for (i = 0; i < nitems(sc->sc_cross_domain); i++)
+		sc->sc_cross_domain[i] = counter_u64_alloc(M_WAITOK);
 }
 
 static void
-wg_decrypt_dispatch(struct wg_softc *sc)
+wg_domains_free(struct wg_softc *sc)
 {
-	u_int cpu = (sc->sc_decrypt_last_cpu + 1) % mp_ncpus;
-	sc->sc_decrypt_last_cpu = cpu;
-	GROUPTASK_ENQUEUE(&sc->sc_decrypt[cpu]);
+	for (int d = 0; d < vm_ndomains; d++) {
+		wg_queue_deinit(&sc->sc_domains[d]->d_encrypt_parallel);
+		wg_queue_deinit(&sc->sc_domains[d]->d_decrypt_parallel);
+		free(sc->sc_domains[d], M_WG);
+	}
+	for (int i = 0; i < nitems(sc->sc_cross_domain); i++)
+		counter_u64_free(sc->sc_cross_domain[i]);
 }
 
 static void
@@ -1670,9 +2654,12 @@ wg_deliver_out(struct wg_peer *peer)
 
 	wg_peer_get_endpoint(peer, &endpoint);
 
-	while ((pkt = wg_queue_dequeue_serial(&peer->p_encrypt_serial)) != NULL) {
+	while ((pkt = wg_queue_dequeue_serial(&peer->p_encrypt_serial, sc)) != NULL) {
+		WG_TRACE2(deliver__out, peer, pkt);
 		if (pkt->p_state != WG_PACKET_CRYPTED)
 			goto error;
+		if (pkt->p_stamped)
+			wg_histogram_packet(sc, pkt, true);
 
 		m = pkt->p_mbuf;
 		pkt->p_mbuf = NULL;
@@ -1689,8 +2676,10 @@ wg_deliver_out(struct wg_peer *peer)
 		} else if (rc == EADDRNOTAVAIL) {
 			wg_peer_clear_src(peer);
 			wg_peer_get_endpoint(peer, &endpoint);
+			wg_drop(sc, peer, WG_DROP_SEND);
 			goto error;
 		} else {
+			wg_drop(sc, peer, WG_DROP_SEND);
 			goto error;
 		}
 		wg_packet_free(pkt);
@@ -1703,6 +2692,68 @@ error:
 	}
 }
 
+/*
+ * Forward a decrypted packet straight out of another interface, without going
+ * through netisr and the full input path, like ip_input and ip6_input do
+ * before anything else when forwarding is on. The checks that the input path
+ * would have done first are only made as far as needed to tell a plain
+ * transit packet. Anything else, including packets for this host, is
+ * returned for netisr to deal with as before. Packets that the firewall sends
+ * to this host come back with M_FASTFWD_OURS and see the inbound hooks a
+ * second time on their way through netisr. Returns NULL if the packet was
+ * consumed, which covers packets that ip_tryforward drops, for a firewall rule
+ * or an expired TTL, as well as those it forwards.
+ */
+static struct mbuf *
+wg_tryforward(struct mbuf *m, sa_family_t af)
+{
+#if defined(IPSEC) || defined(IPSEC_SUPPORT)
+	if (af == AF_INET && IPSEC_ENABLED(ipv4) &&
+	    IPSEC_CAPS(ipv4, m, IPSEC_CAP_OPERABLE) != 0)
+		return (m);
+#ifdef INET6
+	if (af == AF_INET6 && IPSEC_ENABLED(ipv6) &&
+	    IPSEC_CAPS(ipv6, m, IPSEC_CAP_OPERABLE) != 0)
+		return (m);
+#endif
+#endif
+	if (af == AF_INET) {
+		struct ip *ip = mtod(m, struct ip *);
+
+		if (!V_ipforwarding || ip->ip_hl != sizeof(*ip) >> 2 ||
+		    ntohs(ip->ip_len) < sizeof(*ip) ||
+		    ntohs(ip->ip_len) != m->m_pkthdr.len ||
+		    in_cksum_hdr(ip) != 0 ||
+		    IN_LOOPBACK(ntohl(ip->ip_src.s_addr)) ||
+		    IN_LOOPBACK(ntohl(ip->ip_dst.s_addr)) ||
+		    IN_MULTICAST(ntohl(ip->ip_src.s_addr)) ||
+		    ip->ip_src.s_addr == INADDR_ANY)
+			return (m);
+		m->m_pkthdr.csum_flags = CSUM_IP_CHECKED | CSUM_IP_VALID;
+		return (ip_tryforward(m));
+	}
+#ifdef INET6
+	if (af == AF_INET6) {
+		struct ip6_hdr *ip6 = mtod(m, struct ip6_hdr *);
+
+		if (!V_ip6_forwarding || V_ip6_sendredirects ||
+		    ntohs(ip6->ip6_plen) + sizeof(*ip6) != m->m_pkthdr.len ||
+		    IN6_IS_ADDR_MULTICAST(&ip6->ip6_src) ||
+		    IN6_IS_ADDR_UNSPECIFIED(&ip6->ip6_src) ||
+		    IN6_IS_ADDR_UNSPECIFIED(&ip6->ip6_dst) ||
+		    IN6_IS_ADDR_LOOPBACK(&ip6->ip6_src) ||
+		    IN6_IS_ADDR_LOOPBACK(&ip6->ip6_dst) ||
+		    IN6_IS_ADDR_V4MAPPED(&ip6->ip6_src) ||
+		    IN6_IS_ADDR_V4MAPPED(&ip6->ip6_dst) ||
+		    IN6_IS_ADDR_LINKLOCAL(&ip6->ip6_src) ||
+		    IN6_IS_ADDR_LINKLOCAL(&ip6->ip6_dst))
+			return (m);
+		return (ip6_tryforward(m));
+	}
+#endif
+	return (m);
+}
+
 static void
 wg_deliver_in(struct wg_peer *peer)
 {
@@ -1712,13 +2763,18 @@ wg_deliver_in(struct wg_peer *peer)
 	struct mbuf		*m;
 	struct epoch_tracker	 et;
 
-	while ((pkt = wg_queue_dequeue_serial(&peer->p_decrypt_serial)) != NULL) {
+	while ((pkt = wg_queue_dequeue_serial(&peer->p_decrypt_serial, sc)) != NULL) {
+		WG_TRACE2(deliver__in, peer, pkt);
 		if (pkt->p_state != WG_PACKET_CRYPTED)
 			goto error;
+		if (pkt->p_stamped)
+			wg_histogram_packet(sc, pkt, false);
 
 		m = pkt->p_mbuf;
-		if (noise_keypair_nonce_check(pkt->p_keypair, pkt->p_nonce) != 0)
+		if (noise_keypair_nonce_check(pkt->p_keypair, pkt->p_nonce) != 0) {
+			wg_drop(sc, peer, WG_DROP_REPLAY);
 			goto error;
+		}
 
 		if (noise_keypair_received_with(pkt->p_keypair) == ECONNRESET)
 			wg_timers_event_handshake_complete(peer);
@@ -1739,6 +2795,9 @@ wg_deliver_in(struct wg_peer *peer)
 		MPASS(pkt->p_af == AF_INET || pkt->p_af == AF_INET6);
 		pkt->p_mbuf = NULL;
 
+		if (__predict_false(sc->sc_sample_rate != 0))
+			wg_sample(sc, peer, m, pkt->p_af, WG_SAMPLE_RX);
+
 		m->m_pkthdr.rcvif = ifp;
 
 		NET_EPOCH_ENTER(et);
@@ -1746,9 +2805,11 @@ wg_deliver_in(struct wg_peer *peer)
 
 		CURVNET_SET(ifp->if_vnet);
 		M_SETFIB(m, ifp->if_fib);
-		if (pkt->p_af == AF_INET)
+		if (sc->sc_tryforward && (m = wg_tryforward(m, pkt->p_af)) == NULL)
+			counter_u64_add(sc->sc_tryforwarded, 1);
+		else if (pkt->p_af == AF_INET)
 			netisr_dispatch(NETISR_IP, m);
-		if (pkt->p_af == AF_INET6)
+		else if (pkt->p_af == AF_INET6)
 			netisr_dispatch(NETISR_IPV6, m);
 		CURVNET_RESTORE();
 		NET_EPOCH_EXIT(et);
@@ -1767,13 +2828,21 @@ error:
 }
 
 static struct wg_packet *
-wg_packet_alloc(struct mbuf *m)
+wg_packet_alloc(struct wg_softc *sc, struct mbuf *m)
 {
 	struct wg_packet *pkt;
 
-	if ((pkt = uma_zalloc(wg_packet_zone, M_NOWAIT | M_ZERO)) == NULL)
+	if ((pkt = uma_zalloc(wg_packet_zone, M_NOWAIT | M_ZERO)) == NULL) {
+		wg_drop(sc, NULL, WG_DROP_NOMEM);
 		return (NULL);
+	}
+	if (wg_mem_charge_packet(sc, pkt, sizeof(*pkt) + m->m_pkthdr.len) != 0) {
+		uma_zfree(wg_packet_zone, pkt);
+		wg_drop(sc, NULL, WG_DROP_MEMCAP);
+		return (NULL);
+	}
 	pkt->p_mbuf = m;
+	pkt->p_sc = sc;
 	return (pkt);
 }
 
@@ -1784,6 +2853,7 @@ wg_packet_free(struct wg_packet *pkt)
 		noise_keypair_put(pkt->p_keypair);
 	if (pkt->p_mbuf != NULL)
 		m_freem(pkt->p_mbuf);
+	wg_mem_uncharge_packet(pkt->p_sc, pkt);
 	uma_zfree(wg_packet_zone, pkt);
 }
 
@@ -1793,6 +2863,8 @@ wg_queue_init(struct wg_queue *queue, const char *name)
 	mtx_init(&queue->q_mtx, name, NULL, MTX_DEF);
 	STAILQ_INIT(&queue->q_queue);
 	queue->q_len = 0;
+	queue->q_max = 0;
+	queue->q_drops = 0;
 }
 
 static void
@@ -1812,14 +2884,18 @@ static int
 wg_queue_enqueue_handshake(struct wg_queue *hs, struct wg_packet *pkt)
 {
 	int ret = 0;
-	mtx_lock(&hs->q_mtx);
+	sbintime_t ls;
+	WG_MTX_LOCK(&hs->q_mtx, WG_LOCK_QUEUE, ls);
 	if (hs->q_len < MAX_QUEUED_HANDSHAKES) {
+		WG_PACKET_STAMP(pkt, WG_STAMP_QUEUED);
 		STAILQ_INSERT_TAIL(&hs->q_queue, pkt, p_parallel);
-		hs->q_len++;
+		if (++hs->q_len > hs->q_max)
+			hs->q_max = hs->q_len;
 	} else {
+		hs->q_drops++;
 		ret = ENOBUFS;
 	}
-	mtx_unlock(&hs->q_mtx);
+	WG_MTX_UNLOCK(&hs->q_mtx, WG_LOCK_QUEUE, ls);
 	if (ret != 0)
 		wg_packet_free(pkt);
 	return (ret);
@@ -1829,12 +2905,13 @@ static struct wg_packet *
 wg_queue_dequeue_handshake(struct wg_queue *hs)
 {
 	struct wg_packet *pkt;
-	mtx_lock(&hs->q_mtx);
+	sbintime_t ls;
+	WG_MTX_LOCK(&hs->q_mtx, WG_LOCK_QUEUE, ls);
 	if ((pkt = STAILQ_FIRST(&hs->q_queue)) != NULL) {
 		STAILQ_REMOVE_HEAD(&hs->q_queue, p_parallel);
 		hs->q_len--;
 	}
-	mtx_unlock(&hs->q_mtx);
+	WG_MTX_UNLOCK(&hs->q_mtx, WG_LOCK_QUEUE, ls);
 	return (pkt);
 }
 
@@ -1842,37 +2919,63 @@ static void
 wg_queue_push_staged(struct wg_queue *staged, struct wg_packet *pkt)
 {
 	struct wg_packet *old = NULL;
+	sbintime_t ls;
 
-	mtx_lock(&staged->q_mtx);
+	WG_MTX_LOCK(&staged->q_mtx, WG_LOCK_QUEUE, ls);
 	if (staged->q_len >= MAX_STAGED_PKT) {
 		old = STAILQ_FIRST(&staged->q_queue);
 		STAILQ_REMOVE_HEAD(&staged->q_queue, p_parallel);
 		staged->q_len--;
+		staged->q_drops++;
 	}
 	STAILQ_INSERT_TAIL(&staged->q_queue, pkt, p_parallel);
-	staged->q_len++;
-	mtx_unlock(&staged->q_mtx);
+	if (++staged->q_len > staged->q_max)
+		staged->q_max = staged->q_len;
+	WG_MTX_UNLOCK(&staged->q_mtx, WG_LOCK_QUEUE, ls);
 
 	if (old != NULL)
 		wg_packet_free(old);
 }
 
 static void
-wg_queue_enlist_staged(struct wg_queue *staged, struct wg_packet_list *list)
+wg_queue_enlist_staged(struct wg_queue *staged, struct wg_packet_list *list, u_int len)
 {
+	struct wg_packet_list old;
 	struct wg_packet *pkt, *tpkt;
-	STAILQ_FOREACH_SAFE(pkt, list, p_parallel, tpkt)
-		wg_queue_push_staged(staged, pkt);
+	sbintime_t ls;
+
+	STAILQ_INIT(&old);
+	WG_MTX_LOCK(&staged->q_mtx, WG_LOCK_QUEUE, ls);
+	STAILQ_CONCAT(&staged->q_queue, list);
+	staged->q_len += len;
+	while (staged->q_len > MAX_STAGED_PKT) {
+		pkt = STAILQ_FIRST(&staged->q_queue);
+		STAILQ_REMOVE_HEAD(&staged->q_queue, p_parallel);
+		STAILQ_INSERT_TAIL(&old, pkt, p_parallel);
+		staged->q_len--;
+		staged->q_drops++;
+	}
+	if (staged->q_len > staged->q_max)
+		staged->q_max = staged->q_len;
+	WG_MTX_UNLOCK(&staged->q_mtx, WG_LOCK_QUEUE, ls);
+
+	STAILQ_FOREACH_SAFE(pkt, &old, p_parallel, tpkt)
+		wg_packet_free(pkt);
 }
 
-static void
+static u_int
 wg_queue_delist_staged(struct wg_queue *staged, struct wg_packet_list *list)
 {
+	sbintime_t ls;
+	u_int len;
+
 	STAILQ_INIT(list);
-	mtx_lock(&staged->q_mtx);
+	WG_MTX_LOCK(&staged->q_mtx, WG_LOCK_QUEUE, ls);
 	STAILQ_CONCAT(list, &staged->q_queue);
+	len = staged->q_len;
 	staged->q_len = 0;
-	mtx_unlock(&staged->q_mtx);
+	WG_MTX_UNLOCK(&staged->q_mtx, WG_LOCK_QUEUE, ls);
+	return (len);
 }
 
 static void
@@ -1885,47 +2988,167 @@ wg_queue_purge(struct wg_queue *staged)
 		wg_packet_free(pkt);
 }
 
+static void
+wg_serial_init(struct wg_serial *serial, const char *name)
+{
+	mtx_init(&serial->s_mtx, name, NULL, MTX_DEF);
+	serial->s_ring = NULL;
+	serial->s_head = 0;
+	serial->s_tail = 0;
+	serial->s_last = ticks;
+	serial->s_release = false;
+	serial->s_max = 0;
+	serial->s_drops = 0;
+}
+
+/* Free a ring and the rings it retired. */
+static void
+wg_serial_ring_free(struct wg_serial_ring *ring, struct wg_softc *sc)
+{
+	struct wg_serial_ring *old;
+
+	for (; ring != NULL; ring = old) {
+		old = ring->sr_old;
+		wg_mem_uncharge(sc, WG_MEM_PEERS,
+		    WG_SERIAL_RING_SIZE(ring->sr_mask + 1));
+		free(ring, M_WG);
+	}
+}
+
+static void
+wg_serial_deinit(struct wg_serial *serial, struct wg_softc *sc)
+{
+	struct wg_serial_ring *ring = serial->s_ring;
+
+	if (ring != NULL) {
+		for (; serial->s_tail != serial->s_head; serial->s_tail++)
+			wg_packet_free(ring->sr_pkts[serial->s_tail & ring->sr_mask]);
+		wg_serial_ring_free(ring, sc);
+	}
+	mtx_destroy(&serial->s_mtx);
+}
+
+/* Make room for one more packet after the len already queued. */
 static int
-wg_queue_both(struct wg_queue *parallel, struct wg_queue *serial, struct wg_packet *pkt)
+wg_serial_reserve(struct wg_serial *serial, struct wg_softc *sc, u_int len)
 {
-	pkt->p_state = WG_PACKET_UNCRYPTED;
+	struct wg_serial_ring *old = serial->s_ring, *ring;
+	u_int i, n;
+
+	mtx_assert(&serial->s_mtx, MA_OWNED);
+	if (old != NULL && len <= old->sr_mask)
+		return (0);
+	n = old == NULL ? WG_SERIAL_MIN_PKT : (old->sr_mask + 1) * 2;
+	if (wg_mem_charge(sc, WG_MEM_PEERS, WG_SERIAL_RING_SIZE(n)) != 0)
+		return (EDQUOT);
+	if ((ring = malloc(WG_SERIAL_RING_SIZE(n), M_WG, M_NOWAIT)) == NULL) {
+		wg_mem_uncharge(sc, WG_MEM_PEERS, WG_SERIAL_RING_SIZE(n));
+		return (ENOMEM);
+	}
+	ring->sr_old = old;
+	ring->sr_mask = n - 1;
+	if (old != NULL)
+		for (i = atomic_load_acq_int(&serial->s_tail); i != serial->s_head; i++)
+			ring->sr_pkts[i & ring->sr_mask] = old->sr_pkts[i & old->sr_mask];
+	atomic_store_rel_ptr((volatile uintptr_t *)&serial->s_ring, (uintptr_t)ring);
+	return (0);
+}
+
+/* Only called by the consumer, with the ring drained. */
+static void
+wg_serial_release(struct wg_serial *serial, struct wg_softc *sc)
+{
+	struct wg_serial_ring *ring = NULL;
+	sbintime_t ls;
+
+	WG_MTX_LOCK(&serial->s_mtx, WG_LOCK_QUEUE, ls);
+	if (serial->s_release && serial->s_tail == serial->s_head) {
+		ring = serial->s_ring;
+		serial->s_ring = NULL;
+		serial->s_release = false;
+	}
+	WG_MTX_UNLOCK(&serial->s_mtx, WG_LOCK_QUEUE, ls);
+	wg_serial_ring_free(ring, sc);
+}
+
+static int
+wg_queue_both(struct wg_queue *parallel, struct wg_serial *serial, struct wg_packet *pkt)
+{
+	struct wg_serial_ring *ring;
+	sbintime_t ls;
+	u_int head, len;
 
-	mtx_lock(&serial->q_mtx);
-	if (serial->q_len < MAX_QUEUED_PKT) {
-		serial->q_len++;
-		STAILQ_INSERT_TAIL(&serial->q_queue, pkt, p_serial);
+	pkt->p_state = WG_PACKET_UNCRYPTED;
+	WG_PACKET_STAMP(pkt, WG_STAMP_QUEUED);
+	WG_TRACE4(queue, parallel, serial, pkt,
+	    serial->s_head - serial->s_tail);
+
+	WG_MTX_LOCK(&serial->s_mtx, WG_LOCK_QUEUE, ls);
+	head = serial->s_head;
+	len = head - atomic_load_acq_int(&serial->s_tail);
+	if (len == 0)
+		serial->s_release = ticks - serial->s_last > hz;
+	serial->s_last = ticks;
+	if (len < MAX_QUEUED_PKT &&
+	    wg_serial_reserve(serial, pkt->p_sc, len) == 0) {
+		ring = serial->s_ring;
+		ring->sr_pkts[head & ring->sr_mask] = pkt;
+		atomic_store_rel_int(&serial->s_head, head + 1);
+		if (++len > serial->s_max)
+			serial->s_max = len;
 	} else {
-		mtx_unlock(&serial->q_mtx);
+		serial->s_drops++;
+		WG_MTX_UNLOCK(&serial->s_mtx, WG_LOCK_QUEUE, ls);
+		WG_TRACE3(queue__drop, parallel, serial, pkt);
 		wg_packet_free(pkt);
 		return (ENOBUFS);
 	}
-	mtx_unlock(&serial->q_mtx);
+	WG_MTX_UNLOCK(&serial->s_mtx, WG_LOCK_QUEUE, ls);
 
-	mtx_lock(&parallel->q_mtx);
+	WG_MTX_LOCK(&parallel->q_mtx, WG_LOCK_QUEUE, ls);
 	if (parallel->q_len < MAX_QUEUED_PKT) {
-		parallel->q_len++;
+		if (++parallel->q_len > parallel->q_max)
+			parallel->q_max = parallel->q_len;
 		STAILQ_INSERT_TAIL(&parallel->q_queue, pkt, p_parallel);
 	} else {
-		mtx_unlock(&parallel->q_mtx);
-		pkt->p_state = WG_PACKET_DEAD;
+		parallel->q_drops++;
+		WG_MTX_UNLOCK(&parallel->q_mtx, WG_LOCK_QUEUE, ls);
+		WG_TRACE3(queue__drop, parallel, serial, pkt);
+		atomic_store_rel_int(&pkt->p_state, WG_PACKET_DEAD);
 		return (ENOBUFS);
 	}
-	mtx_unlock(&parallel->q_mtx);
+	WG_MTX_UNLOCK(&parallel->q_mtx, WG_LOCK_QUEUE, ls);
 
 	return (0);
 }
 
+/*
+ * Only called by the peer's delivery task, see struct wg_serial. Rings retired
+ * by a grow are freed here, before the current ring is read, when this task
+ * no longer holds a pointer into them.
+ */
 static struct wg_packet *
-wg_queue_dequeue_serial(struct wg_queue *serial)
+wg_queue_dequeue_serial(struct wg_serial *serial, struct wg_softc *sc)
 {
-	struct wg_packet *pkt = NULL;
-	mtx_lock(&serial->q_mtx);
-	if (serial->q_len > 0 && STAILQ_FIRST(&serial->q_queue)->p_state != WG_PACKET_UNCRYPTED) {
-		serial->q_len--;
-		pkt = STAILQ_FIRST(&serial->q_queue);
-		STAILQ_REMOVE_HEAD(&serial->q_queue, p_serial);
+	struct wg_serial_ring *ring;
+	struct wg_packet *pkt;
+	u_int tail = serial->s_tail;
+
+	if (tail == atomic_load_acq_int(&serial->s_head)) {
+		if (serial->s_release)
+			wg_serial_release(serial, sc);
+		return (NULL);
+	}
+	ring = (struct wg_serial_ring *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&serial->s_ring);
+	if (ring->sr_old != NULL) {
+		wg_serial_ring_free(ring->sr_old, sc);
+		ring->sr_old = NULL;
 	}
-	mtx_unlock(&serial->q_mtx);
+	pkt = ring->sr_pkts[tail & ring->sr_mask];
+	if (atomic_load_acq_int(&pkt->p_state) == WG_PACKET_UNCRYPTED)
+		return (NULL);
+	atomic_store_rel_int(&serial->s_tail, tail + 1);
 	return (pkt);
 }
 
@@ -1933,16 +3156,40 @@ static struct wg_packet *
 wg_queue_dequeue_parallel(struct wg_queue *parallel)
 {
 	struct wg_packet *pkt = NULL;
-	mtx_lock(&parallel->q_mtx);
+	sbintime_t ls;
+	WG_MTX_LOCK(&parallel->q_mtx, WG_LOCK_QUEUE, ls);
 	if (parallel->q_len > 0) {
 		parallel->q_len--;
 		pkt = STAILQ_FIRST(&parallel->q_queue);
 		STAILQ_REMOVE_HEAD(&parallel->q_queue, p_parallel);
 	}
-	mtx_unlock(&parallel->q_mtx);
+	WG_MTX_UNLOCK(&parallel->q_mtx, WG_LOCK_QUEUE, ls);
 	return (pkt);
 }
 
+/*
+ * Whether to queue a data packet from this source for decryption, after
+ * sources that send packets failing to authenticate have been throttled by
+ * cookie_auth_failed. The peer's current endpoint is never throttled, so that
+ * forging packets from the peer's own address cannot cut it off. The table is
+ * only consulted for keypairs that have seen a failure, so packets on clean
+ * keypairs skip the hash and the lock. The price is that a throttled source
+ * gets one forgery through on each keypair that has not seen one yet.
+ */
+static bool
+wg_input_auth_allow(struct wg_softc *sc, struct wg_peer *peer,
+    struct noise_keypair *kp, struct wg_endpoint *e)
+{
+	struct wg_endpoint peer_e;
+
+	if (__predict_true(!noise_keypair_auth_suspect(kp)))
+		return (true);
+	if (cookie_auth_allow(&e->e_remote.r_sa, sc->sc_ifp->if_vnet) == 0)
+		return (true);
+	wg_peer_get_endpoint(peer, &peer_e);
+	return (memcmp(&peer_e.e_remote, &e->e_remote, sizeof(e->e_remote)) == 0);
+}
+
 static bool
 wg_input(struct mbuf *m, int offset, struct inpcb *inpcb,
     const struct sockaddr *sa, void *_sc)
@@ -1955,6 +3202,9 @@ wg_input(struct mbuf *m, int offset, struct inpcb *inpcb,
 	struct wg_peer			*peer;
 	struct wg_softc			*sc = _sc;
 	struct mbuf			*defragged;
+	u_int				 domain;
+
+	WG_TRACE3(input, sc, m, sa);
 
 	defragged = m_defrag(m, M_NOWAIT);
 	if (defragged)
@@ -1962,6 +3212,7 @@ wg_input(struct mbuf *m, int offset, struct inpcb *inpcb,
 	m = m_unshare(m, M_NOWAIT);
 	if (!m) {
 		if_inc_counter(sc->sc_ifp, IFCOUNTER_IQDROPS, 1);
+		wg_drop(sc, NULL, WG_DROP_NOMEM);
 		return true;
 	}
 
@@ -1971,14 +3222,16 @@ wg_input(struct mbuf *m, int offset, struct inpcb *inpcb,
 	/* Pullup enough to read packet type */
 	if ((m = m_pullup(m, sizeof(uint32_t))) == NULL) {
 		if_inc_counter(sc->sc_ifp, IFCOUNTER_IQDROPS, 1);
+		wg_drop(sc, NULL, WG_DROP_INVALID);
 		return true;
 	}
 
-	if ((pkt = wg_packet_alloc(m)) == NULL) {
+	if ((pkt = wg_packet_alloc(sc, m)) == NULL) {
 		if_inc_counter(sc->sc_ifp, IFCOUNTER_IQDROPS, 1);
 		m_freem(m);
 		return true;
 	}
+	WG_PACKET_STAMP_INIT(sc, pkt);
 
 	/* Save send/recv address and port for later. */
 	if (sa->sa_family == AF_INET) {
@@ -1990,7 +3243,7 @@ wg_input(struct mbuf *m, int offset, struct inpcb *inpcb,
 		pkt->p_endpoint.e_remote.r_sin6 = sin6[0];
 		pkt->p_endpoint.e_local.l_in6 = sin6[1].sin6_addr;
 	} else
-		goto error;
+		goto error_invalid;
 
 	if ((m->m_pkthdr.len == sizeof(struct wg_pkt_initiation) &&
 		*mtod(m, uint32_t *) == WG_PKT_INITIATION) ||
@@ -2001,7 +3254,7 @@ wg_input(struct mbuf *m, int offset, struct inpcb *inpcb,
 
 		if (wg_queue_enqueue_handshake(&sc->sc_handshake_queue, pkt) != 0) {
 			if_inc_counter(sc->sc_ifp, IFCOUNTER_IQDROPS, 1);
-			DPRINTF(sc, "Dropping handshake packet\n");
+			WG_EVENT(sc, WG_EVENT_HANDSHAKE_QUEUE_FULL, NULL, 0);
 		}
 		GROUPTASK_ENQUEUE(&sc->sc_handshake);
 	} else if (m->m_pkthdr.len >= sizeof(struct wg_pkt_data) +
@@ -2009,62 +3262,223 @@ wg_input(struct mbuf *m, int offset, struct inpcb *inpcb,
 
 		/* Pullup whole header to read r_idx below. */
 		if ((pkt->p_mbuf = m_pullup(m, sizeof(struct wg_pkt_data))) == NULL)
-			goto error;
+			goto error_nomem;
 
 		data = mtod(pkt->p_mbuf, struct wg_pkt_data *);
-		if ((pkt->p_keypair = noise_keypair_lookup(sc->sc_local, data->r_idx)) == NULL)
+		if ((pkt->p_keypair = noise_keypair_lookup(sc->sc_local, data->r_idx)) == NULL) {
+			wg_drop(sc, NULL, WG_DROP_NO_KEYPAIR);
 			goto error;
+		}
 
 		remote = noise_keypair_remote(pkt->p_keypair);
 		peer = noise_remote_arg(remote);
-		if (wg_queue_both(&sc->sc_decrypt_parallel, &peer->p_decrypt_serial, pkt) != 0)
+		if (__predict_false(!wg_input_auth_allow(sc, peer,
+		    pkt->p_keypair, &pkt->p_endpoint))) {
+			wg_drop(sc, peer, WG_DROP_AUTH_THROTTLE);
+			noise_remote_put(remote);
+			goto error;
+		}
+		pkt->p_domain = domain = PCPU_GET(domain);
+		if (wg_queue_both(&sc->sc_domains[domain]->d_decrypt_parallel,
+		    &peer->p_decrypt_serial, pkt) != 0)
 			if_inc_counter(sc->sc_ifp, IFCOUNTER_IQDROPS, 1);
-		wg_decrypt_dispatch(sc);
+		wg_decrypt_dispatch(sc, domain);
 		noise_remote_put(remote);
 	} else {
-		goto error;
+		goto error_invalid;
 	}
 	return true;
+error_nomem:
+	wg_drop(sc, NULL, WG_DROP_NOMEM);
+	goto error;
+error_invalid:
+	wg_drop(sc, NULL, WG_DROP_INVALID);
 error:
 	if_inc_counter(sc->sc_ifp, IFCOUNTER_IERRORS, 1);
 	wg_packet_free(pkt);
 	return true;
 }
 
-static void
-wg_peer_send_staged(struct wg_peer *peer)
+/*
+ * Hand the peer's staged packets to the crypto queues of the domain, returning
+ * whether any were queued, in which case the caller must run
+ * wg_encrypt_dispatch for the domain.
+ */
+static bool
+wg_peer_queue_staged(struct wg_peer *peer, u_int domain)
 {
 	struct wg_packet_list	 list;
 	struct noise_keypair	*keypair;
 	struct wg_packet	*pkt, *tpkt;
 	struct wg_softc		*sc = peer->p_sc;
+	uint64_t		 nonce;
+	u_int			 len;
 
-	wg_queue_delist_staged(&peer->p_stage_queue, &list);
+	len = wg_queue_delist_staged(&peer->p_stage_queue, &list);
 
 	if (STAILQ_EMPTY(&list))
-		return;
+		return (false);
 
 	if ((keypair = noise_keypair_current(peer->p_remote)) == NULL)
 		goto error;
 
-	STAILQ_FOREACH(pkt, &list, p_parallel) {
-		if (noise_keypair_nonce_next(keypair, &pkt->p_nonce) != 0)
-			goto error_keypair;
-	}
+	if (noise_keypair_nonce_reserve(keypair, len, &nonce) != 0)
+		goto error_keypair;
 	STAILQ_FOREACH_SAFE(pkt, &list, p_parallel, tpkt) {
+		pkt->p_nonce = nonce++;
 		pkt->p_keypair = noise_keypair_ref(keypair);
-		if (wg_queue_both(&sc->sc_encrypt_parallel, &peer->p_encrypt_serial, pkt) != 0)
+		pkt->p_domain = domain;
+		if (wg_queue_both(&sc->sc_domains[domain]->d_encrypt_parallel,
+		    &peer->p_encrypt_serial, pkt) != 0)
 			if_inc_counter(sc->sc_ifp, IFCOUNTER_OQDROPS, 1);
 	}
-	wg_encrypt_dispatch(sc);
 	noise_keypair_put(keypair);
-	return;
+	return (true);
 
 error_keypair:
 	noise_keypair_put(keypair);
 error:
-	wg_queue_enlist_staged(&peer->p_stage_queue, &list);
+	wg_queue_enlist_staged(&peer->p_stage_queue, &list, len);
 	wg_timers_event_want_initiation(peer);
+	return (false);
+}
+
+static void
+wg_peer_send_staged(struct wg_peer *peer)
+{
+	u_int domain = PCPU_GET(domain);
+
+	if (wg_peer_queue_staged(peer, domain))
+		wg_encrypt_dispatch(peer->p_sc, domain);
+}
+
+/*
+ * Move slot i of st to its peer's p_stage_queue, filling the hole with the
+ * last slot, and release the peer's claim on st. The packets are enlisted
+ * before the stage lock is dropped, so a later slot of the same peer, on this
+ * stage or another, cannot reach p_stage_queue ahead of them.
+ */
+static struct wg_peer *
+wg_stage_take(struct wg_stage *st, u_int i)
+{
+	struct wg_stage_slot *slot = &st->st_slots[i];
+	struct wg_stage_slot *last = &st->st_slots[--st->st_nslots];
+	struct wg_peer *peer = slot->ss_peer;
+
+	mtx_assert(&st->st_mtx, MA_OWNED);
+	wg_queue_enlist_staged(&peer->p_stage_queue, &slot->ss_list, slot->ss_len);
+	ck_pr_store_ptr(&peer->p_stage, NULL);
+	if (slot != last) {
+		slot->ss_peer = last->ss_peer;
+		slot->ss_len = last->ss_len;
+		STAILQ_INIT(&slot->ss_list);
+		STAILQ_CONCAT(&slot->ss_list, &last->ss_list);
+	}
+	return (peer);
+}
+
+static void
+wg_stage_send(struct wg_peer *peer)
+{
+	wg_peer_send_staged(peer);
+	noise_remote_put(peer->p_remote);
+}
+
+/*
+ * A peer's packets are staged on at most one stage at a time, the one in
+ * p_stage, which is set with the stage lock held when the peer's slot is made
+ * and cleared when it is taken. A thread that finds the peer staged elsewhere
+ * follows it there instead of using its own CPU's stage, so that packets of
+ * one peer are never split over two stages that flush independently, which
+ * would reorder them, whether the thread migrated or another thread sends to
+ * the same peer.
+ */
+static void
+wg_stage_push(struct wg_softc *sc, struct wg_peer *peer, struct wg_packet *pkt)
+{
+	struct wg_stage_slot *slot;
+	struct wg_stage *st;
+	struct wg_peer *send[2];
+	u_int i, nsend = 0;
+	bool dispatch = false;
+	sbintime_t ls;
+
+	sched_pin();
+	for (;;) {
+		if ((st = ck_pr_load_ptr(&peer->p_stage)) == NULL)
+			st = &sc->sc_stage[curcpu];
+		WG_MTX_LOCK(&st->st_mtx, WG_LOCK_STAGE, ls);
+		if (ck_pr_load_ptr(&peer->p_stage) == st ||
+		    ck_pr_cas_ptr(&peer->p_stage, NULL, st))
+			break;
+		WG_MTX_UNLOCK(&st->st_mtx, WG_LOCK_STAGE, ls);
+	}
+	sched_unpin();
+
+	for (i = 0; i < st->st_nslots; i++)
+		if (st->st_slots[i].ss_peer == peer)
+			break;
+	if (i == st->st_nslots) {
+		if (st->st_nslots == WG_STAGE_PEERS)
+			send[nsend++] = wg_stage_take(st, 0);
+		i = st->st_nslots++;
+		slot = &st->st_slots[i];
+		slot->ss_peer = peer;
+		slot->ss_len = 0;
+		STAILQ_INIT(&slot->ss_list);
+		noise_remote_ref(peer->p_remote);
+	}
+	slot = &st->st_slots[i];
+	STAILQ_INSERT_TAIL(&slot->ss_list, pkt, p_parallel);
+	if (++slot->ss_len >= WG_STAGE_BURST)
+		send[nsend++] = wg_stage_take(st, i);
+	if (st->st_nslots > 0 && !st->st_pending)
+		dispatch = st->st_pending = true;
+	WG_MTX_UNLOCK(&st->st_mtx, WG_LOCK_STAGE, ls);
+
+	for (i = 0; i < nsend; i++)
+		wg_stage_send(send[i]);
+	if (dispatch)
+		GROUPTASK_ENQUEUE(&sc->sc_encrypt[st - sc->sc_stage]);
+}
+
+static void
+wg_stage_flush(struct wg_stage *st)
+{
+	struct wg_peer *send[WG_STAGE_PEERS];
+	u_int i, nsend = 0;
+	sbintime_t ls;
+
+	WG_MTX_LOCK(&st->st_mtx, WG_LOCK_STAGE, ls);
+	st->st_pending = false;
+	while (st->st_nslots > 0)
+		send[nsend++] = wg_stage_take(st, 0);
+	WG_MTX_UNLOCK(&st->st_mtx, WG_LOCK_STAGE, ls);
+
+	for (i = 0; i < nsend; i++)
+		wg_stage_send(send[i]);
+}
+
+static void
+wg_stage_purge(struct wg_softc *sc)
+{
+	struct wg_stage_slot *slot;
+	struct wg_packet *pkt, *tpkt;
+	struct wg_stage *st;
+	int i;
+
+	CPU_FOREACH(i) {
+		st = &sc->sc_stage[i];
+		mtx_lock(&st->st_mtx);
+		while (st->st_nslots > 0) {
+			slot = &st->st_slots[--st->st_nslots];
+			STAILQ_FOREACH_SAFE(pkt, &slot->ss_list, p_parallel, tpkt)
+				wg_packet_free(pkt);
+			ck_pr_store_ptr(&slot->ss_peer->p_stage, NULL);
+			noise_remote_put(slot->ss_peer->p_remote);
+		}
+		mtx_unlock(&st->st_mtx);
+	}
 }
 
 static inline void
@@ -2103,7 +3517,7 @@ wg_xmit(struct ifnet *ifp, struct mbuf *m, sa_family_t af, uint32_t mtu)
 		goto err_xmit;
 	}
 
-	if ((pkt = wg_packet_alloc(m)) == NULL) {
+	if ((pkt = wg_packet_alloc(sc, m)) == NULL) {
 		rc = ENOBUFS;
 		goto err_xmit;
 	}
@@ -2115,6 +3529,7 @@ wg_xmit(struct ifnet *ifp, struct mbuf *m, sa_family_t af, uint32_t mtu)
 	} else if (af == AF_INET6) {
 		peer = wg_aip_lookup(sc, AF_INET6, &mtod(m, struct ip6_hdr *)->ip6_dst);
 	} else {
+		wg_drop(sc, NULL, WG_DROP_INVALID);
 		rc = EAFNOSUPPORT;
 		goto err_xmit;
 	}
@@ -2122,26 +3537,39 @@ wg_xmit(struct ifnet *ifp, struct mbuf *m, sa_family_t af, uint32_t mtu)
 	BPF_MTAP2_AF(ifp, m, pkt->p_af);
 
 	if (__predict_false(peer == NULL)) {
+		wg_drop(sc, NULL, WG_DROP_NO_PEER);
 		rc = ENOKEY;
 		goto err_xmit;
 	}
 
-	if (__predict_false(if_tunnel_check_nesting(ifp, m, MTAG_WGLOOP, MAX_LOOPS))) {
-		DPRINTF(sc, "Packet looped");
+	/*
+	 * Tag every pass: a looping packet may come back asynchronously, for
+	 * example through lo0, an epair or the netisr queue, with nothing but
+	 * its tags to say how many times it went through here.
+	 */
+	if (__predict_false(if_tunnel_check_nesting(ifp, m, MTAG_WGLOOP,
+	    MAX_LOOPS))) {
+		WG_EVENT(sc, WG_EVENT_LOOP, peer, 0);
+		wg_drop(sc, peer, WG_DROP_LOOP);
 		rc = ELOOP;
 		goto err_peer;
 	}
 
 	peer_af = peer->p_endpoint.e_remote.r_sa.sa_family;
 	if (__predict_false(peer_af != AF_INET && peer_af != AF_INET6)) {
-		DPRINTF(sc, "No valid endpoint has been configured or "
-			    "discovered for peer %" PRIu64 "\n", peer->p_id);
+		WG_EVENT(sc, WG_EVENT_NO_ENDPOINT, peer, 0);
+		wg_drop(sc, peer, WG_DROP_NO_ENDPOINT);
 		rc = EHOSTUNREACH;
 		goto err_peer;
 	}
 
-	wg_queue_push_staged(&peer->p_stage_queue, pkt);
-	wg_peer_send_staged(peer);
+	if (__predict_false(sc->sc_sample_rate != 0))
+		wg_sample(sc, peer, m, af, WG_SAMPLE_TX);
+
+	WG_PACKET_STAMP_INIT(sc, pkt);
+	WG_PACKET_STAMP(pkt, WG_STAMP_STAGED);
+	WG_TRACE3(xmit, sc, peer, pkt);
+	wg_stage_push(sc, peer, pkt);
 	noise_remote_put(peer->p_remote);
 	return (0);
 
@@ -2279,7 +3707,10 @@ wg_peer_add(struct wg_softc *sc, const nvlist_t *nvl)
 		wg_aip_remove_all(sc, peer);
 	}
 	if (peer == NULL) {
+		if ((err = wg_mem_charge(sc, WG_MEM_PEERS, wg_peer_memory())) != 0)
+			goto out;
 		if ((peer = wg_peer_alloc(sc, pub_key)) == NULL) {
+			wg_mem_uncharge(sc, WG_MEM_PEERS, wg_peer_memory());
 			err = ENOMEM;
 			goto out;
 		}
@@ -2346,6 +3777,7 @@ wg_peer_add(struct wg_softc *sc, const nvlist_t *nvl)
 			goto out;
 		TAILQ_INSERT_TAIL(&sc->sc_peers, peer, p_entry);
 		sc->sc_peers_num++;
+		wg_handoff_restore(sc, peer);
 		if (sc->sc_ifp->if_link_state == LINK_STATE_UP)
 			wg_timers_enable(peer);
 	}
@@ -2361,35 +3793,16 @@ out:
 }
 
 static int
-wgc_set(struct wg_softc *sc, struct wg_data_io *wgd)
+wgc_set_nvl(struct wg_softc *sc, const nvlist_t *nvl)
 {
 	uint8_t public[WG_KEY_SIZE], private[WG_KEY_SIZE];
 	struct ifnet *ifp;
-	void *nvlpacked;
-	nvlist_t *nvl;
-	ssize_t size;
-	int err;
+	size_t size;
+	int err = 0;
+	sbintime_t ls;
 
 	ifp = sc->sc_ifp;
-	if (wgd->wgd_size == 0 || wgd->wgd_data == NULL)
-		return (EFAULT);
-
-	/* Can nvlists be streamed in? It's not nice to impose arbitrary limits like that but
-	 * there needs to be _some_ limitation. */
-	if (wgd->wgd_size >= UINT32_MAX / 2)
-		return (E2BIG);
-
-	nvlpacked = malloc(wgd->wgd_size, M_TEMP, M_WAITOK | M_ZERO);
-
-	err = copyin(wgd->wgd_data, nvlpacked, wgd->wgd_size);
-	if (err)
-		goto out;
-	nvl = nvlist_unpack(nvlpacked, wgd->wgd_size, 0);
-	if (nvl == NULL) {
-		err = EBADMSG;
-		goto out;
-	}
-	sx_xlock(&sc->sc_lock);
+	WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	if (nvlist_exists_bool(nvl, "replace-peers") &&
 		nvlist_get_bool(nvl, "replace-peers"))
 		wg_peer_destroy_all(sc);
@@ -2464,44 +3877,172 @@ wgc_set(struct wg_softc *sc, struct wg_data_io *wgd)
 	}
 
 out_locked:
-	sx_xunlock(&sc->sc_lock);
-	nvlist_destroy(nvl);
-out:
-	explicit_bzero(nvlpacked, wgd->wgd_size);
-	free(nvlpacked, M_TEMP);
+	WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	return (err);
 }
 
 static int
-wgc_get(struct wg_softc *sc, struct wg_data_io *wgd)
+wgc_set(struct wg_softc *sc, struct wg_data_io *wgd)
 {
-	uint8_t public_key[WG_KEY_SIZE] = { 0 };
-	uint8_t private_key[WG_KEY_SIZE] = { 0 };
-	uint8_t preshared_key[NOISE_SYMMETRIC_KEY_LEN] = { 0 };
-	nvlist_t *nvl, *nvl_peer, *nvl_aip, **nvl_peers, **nvl_aips;
-	size_t size, peer_count, aip_count, i, j;
-	struct wg_timespec64 ts64;
-	struct wg_peer *peer;
-	struct wg_aip *aip;
-	void *packed;
-	int err = 0;
+	void *nvlpacked;
+	nvlist_t *nvl;
+	int err;
 
-	nvl = nvlist_create(0);
-	if (!nvl)
-		return (ENOMEM);
+	if (wgd->wgd_size == 0 || wgd->wgd_data == NULL)
+		return (EFAULT);
 
-	sx_slock(&sc->sc_lock);
+	/* Can nvlists be streamed in? It's not nice to impose arbitrary limits like that but
+	 * there needs to be _some_ limitation. */
+	if (wgd->wgd_size >= UINT32_MAX / 2)
+		return (E2BIG);
 
-	if (sc->sc_socket.so_port != 0)
-		nvlist_add_number(nvl, "listen-port", sc->sc_socket.so_port);
-	if (sc->sc_socket.so_user_cookie != 0)
-		nvlist_add_number(nvl, "user-cookie", sc->sc_socket.so_user_cookie);
-	if (noise_local_keys(sc->sc_local, public_key, private_key) == 0) {
-		nvlist_add_binary(nvl, "public-key", public_key, WG_KEY_SIZE);
-		if (wgc_privileged(sc))
+	nvlpacked = malloc(wgd->wgd_size, M_TEMP, M_WAITOK | M_ZERO);
+
+	err = copyin(wgd->wgd_data, nvlpacked, wgd->wgd_size);
+	if (err)
+		goto out;
+	nvl = nvlist_unpack(nvlpacked, wgd->wgd_size, 0);
+	if (nvl == NULL) {
+		err = EBADMSG;
+		goto out;
+	}
+	err = wgc_set_nvl(sc, nvl);
+	nvlist_destroy(nvl);
+out:
+	explicit_bzero(nvlpacked, wgd->wgd_size);
+	free(nvlpacked, M_TEMP);
+	return (err);
+}
+
+static nvlist_t *
+wgc_queue_stats(struct wg_queue *queue)
+{
+	nvlist_t *nvl = nvlist_create(0);
+
+	mtx_lock(&queue->q_mtx);
+	nvlist_add_number(nvl, "length", queue->q_len);
+	nvlist_add_number(nvl, "max-length", queue->q_max);
+	nvlist_add_number(nvl, "drops", queue->q_drops);
+	mtx_unlock(&queue->q_mtx);
+	return (nvl);
+}
+
+static nvlist_t *
+wgc_serial_stats(struct wg_serial *serial)
+{
+	nvlist_t *nvl = nvlist_create(0);
+
+	mtx_lock(&serial->s_mtx);
+	nvlist_add_number(nvl, "length", serial->s_head - serial->s_tail);
+	nvlist_add_number(nvl, "max-length", serial->s_max);
+	nvlist_add_number(nvl, "drops", serial->s_drops);
+	mtx_unlock(&serial->s_mtx);
+	return (nvl);
+}
+
+static nvlist_t *
+wgc_handshake_stats(struct wg_peer *peer)
+{
+	struct wg_handshake_stats hs;
+	nvlist_t *nvl = nvlist_create(0);
+	int retries;
+
+	mtx_lock(&peer->p_handshake_mtx);
+	hs = peer->p_handshake_stats;
+	retries = peer->p_handshake_retries;
+	mtx_unlock(&peer->p_handshake_mtx);
+
+	nvlist_add_number(nvl, "attempts", hs.hs_attempts);
+	nvlist_add_number(nvl, "retries", hs.hs_retries);
+	nvlist_add_number(nvl, "current-retries", retries);
+	nvlist_add_number(nvl, "completed", hs.hs_completed);
+	if (hs.hs_completed == 0)
+		return (nvl);
+	nvlist_add_number(nvl, "rtt-ns", sbttons(hs.hs_rtt));
+	nvlist_add_number(nvl, "srtt-ns", sbttons(hs.hs_srtt));
+	nvlist_add_number(nvl, "rttvar-ns", sbttons(hs.hs_rttvar));
+	nvlist_add_number(nvl, "latency-ns", sbttons(hs.hs_latency));
+	return (nvl);
+}
+
+static nvlist_t *
+wgc_peer_stats(struct wg_peer *peer)
+{
+	nvlist_t *nvl, *nvl_drops, *nvl_queues;
+	u_long drops;
+
+	nvl = nvlist_create(0);
+	nvlist_add_number(nvl, "id", peer->p_id);
+	nvlist_move_nvlist(nvl, "handshake", wgc_handshake_stats(peer));
+	nvl_drops = nvlist_create(0);
+	for (int i = 0; i < WG_DROP_MAX; i++)
+		if ((drops = peer->p_drops[i]) != 0)
+			nvlist_add_number(nvl_drops, wg_drop_names[i], drops);
+	nvlist_move_nvlist(nvl, "drops", nvl_drops);
+
+	nvl_queues = nvlist_create(0);
+	nvlist_move_nvlist(nvl_queues, "stage", wgc_queue_stats(&peer->p_stage_queue));
+	nvlist_move_nvlist(nvl_queues, "encrypt", wgc_serial_stats(&peer->p_encrypt_serial));
+	nvlist_move_nvlist(nvl_queues, "decrypt", wgc_serial_stats(&peer->p_decrypt_serial));
+	nvlist_move_nvlist(nvl, "queues", nvl_queues);
+	return (nvl);
+}
+
+static nvlist_t *
+wgc_softc_stats(struct wg_softc *sc)
+{
+	nvlist_t *nvl, *nvl_drops, *nvl_queues;
+	uint64_t drops;
+	char name[16];
+
+	nvl = nvlist_create(0);
+	nvl_drops = nvlist_create(0);
+	for (int i = 0; i < WG_DROP_MAX; i++)
+		if ((drops = counter_u64_fetch(sc->sc_drops[i])) != 0)
+			nvlist_add_number(nvl_drops, wg_drop_names[i], drops);
+	nvlist_move_nvlist(nvl, "drops", nvl_drops);
+
+	nvl_queues = nvlist_create(0);
+	nvlist_move_nvlist(nvl_queues, "handshake", wgc_queue_stats(&sc->sc_handshake_queue));
+	for (int d = 0; d < vm_ndomains; d++) {
+		wg_domain_name(name, sizeof(name), "encrypt", d);
+		nvlist_move_nvlist(nvl_queues, name,
+		    wgc_queue_stats(&sc->sc_domains[d]->d_encrypt_parallel));
+		wg_domain_name(name, sizeof(name), "decrypt", d);
+		nvlist_move_nvlist(nvl_queues, name,
+		    wgc_queue_stats(&sc->sc_domains[d]->d_decrypt_parallel));
+	}
+	nvlist_move_nvlist(nvl, "queues", nvl_queues);
+	return (nvl);
+}
+
+static int
+wgc_get_nvl(struct wg_softc *sc, nvlist_t *nvl)
+{
+	uint8_t public_key[WG_KEY_SIZE] = { 0 };
+	uint8_t private_key[WG_KEY_SIZE] = { 0 };
+	uint8_t preshared_key[NOISE_SYMMETRIC_KEY_LEN] = { 0 };
+	nvlist_t *nvl_peer, *nvl_aip, **nvl_peers, **nvl_aips;
+	size_t peer_count, aip_count, i, j;
+	struct wg_timespec64 ts64;
+	struct wg_peer *peer;
+	struct wg_aip *aip;
+	int err = 0;
+	sbintime_t ls;
+
+	WG_SX_SLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
+
+	if (sc->sc_socket.so_port != 0)
+		nvlist_add_number(nvl, "listen-port", sc->sc_socket.so_port);
+	if (sc->sc_socket.so_user_cookie != 0)
+		nvlist_add_number(nvl, "user-cookie", sc->sc_socket.so_user_cookie);
+	if (noise_local_keys(sc->sc_local, public_key, private_key) == 0) {
+		nvlist_add_binary(nvl, "public-key", public_key, WG_KEY_SIZE);
+		if (wgc_privileged(sc))
 			nvlist_add_binary(nvl, "private-key", private_key, WG_KEY_SIZE);
 		explicit_bzero(private_key, sizeof(private_key));
 	}
+	nvlist_move_nvlist(nvl, "stats", wgc_softc_stats(sc));
 	peer_count = sc->sc_peers_num;
 	if (peer_count) {
 		nvl_peers = mallocarray(peer_count, sizeof(void *), M_NVLIST, M_WAITOK | M_ZERO);
@@ -2530,6 +4071,7 @@ wgc_get(struct wg_softc *sc, struct wg_data_io *wgd)
 			nvlist_add_number(nvl_peer, "persistent-keepalive-interval", peer->p_persistent_keepalive_interval);
 			nvlist_add_number(nvl_peer, "rx-bytes", counter_u64_fetch(peer->p_rx_bytes));
 			nvlist_add_number(nvl_peer, "tx-bytes", counter_u64_fetch(peer->p_tx_bytes));
+			nvlist_move_nvlist(nvl_peer, "stats", wgc_peer_stats(peer));
 
 			aip_count = peer->p_aips_num;
 			if (aip_count) {
@@ -2569,12 +4111,25 @@ wgc_get(struct wg_softc *sc, struct wg_data_io *wgd)
 		for (i = 0; i < peer_count; ++i)
 			nvlist_destroy(nvl_peers[i]);
 		free(nvl_peers, M_NVLIST);
-		if (err) {
-			sx_sunlock(&sc->sc_lock);
-			goto err;
-		}
 	}
-	sx_sunlock(&sc->sc_lock);
+	WG_SX_SUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
+	return (err);
+}
+
+static int
+wgc_get(struct wg_softc *sc, struct wg_data_io *wgd)
+{
+	nvlist_t *nvl;
+	void *packed;
+	size_t size;
+	int err;
+
+	nvl = nvlist_create(0);
+	if (!nvl)
+		return (ENOMEM);
+
+	if ((err = wgc_get_nvl(sc, nvl)) != 0)
+		goto err;
 	packed = nvlist_pack(nvl, &size);
 	if (!packed) {
 		err = ENOMEM;
@@ -2606,6 +4161,7 @@ wg_ioctl(struct ifnet *ifp, u_long cmd, caddr_t data)
 	struct ifreq *ifr = (struct ifreq *)data;
 	struct wg_softc *sc;
 	int ret = 0;
+	sbintime_t ls;
 
 	sx_slock(&wg_sx);
 	sc = ifp->if_softc;
@@ -2631,6 +4187,8 @@ wg_ioctl(struct ifnet *ifp, u_long cmd, caddr_t data)
 		 */
 		break;
 	case SIOCSIFFLAGS:
+		if (ifp->if_flags & IFF_DEBUG)
+			wg_events_alloc(sc);
 		if (ifp->if_flags & IFF_UP)
 			ret = wg_up(sc);
 		else
@@ -2655,9 +4213,9 @@ wg_ioctl(struct ifnet *ifp, u_long cmd, caddr_t data)
 		ret = priv_check(curthread, PRIV_NET_SETIFFIB);
 		if (ret)
 			break;
-		sx_xlock(&sc->sc_lock);
+		WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 		ret = wg_socket_set_fibnum(sc, ifr->ifr_fib);
-		sx_xunlock(&sc->sc_lock);
+		WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 		break;
 	default:
 		ret = ENOTTY;
@@ -2674,8 +4232,9 @@ wg_up(struct wg_softc *sc)
 	struct ifnet *ifp = sc->sc_ifp;
 	struct wg_peer *peer;
 	int rc = EBUSY;
+	sbintime_t ls;
 
-	sx_xlock(&sc->sc_lock);
+	WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	/* Jail's being removed, no more wg_up(). */
 	if ((sc->sc_flags & WGF_DYING) != 0)
 		goto out;
@@ -2696,7 +4255,7 @@ wg_up(struct wg_softc *sc)
 		DPRINTF(sc, "Unable to initialize sockets: %d\n", rc);
 	}
 out:
-	sx_xunlock(&sc->sc_lock);
+	WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	return (rc);
 }
 
@@ -2705,14 +4264,16 @@ wg_down(struct wg_softc *sc)
 {
 	struct ifnet *ifp = sc->sc_ifp;
 	struct wg_peer *peer;
+	sbintime_t ls;
 
-	sx_xlock(&sc->sc_lock);
+	WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	if (!(ifp->if_drv_flags & IFF_DRV_RUNNING)) {
-		sx_xunlock(&sc->sc_lock);
+		WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 		return;
 	}
 	ifp->if_drv_flags &= ~IFF_DRV_RUNNING;
 
+	wg_stage_purge(sc);
 	TAILQ_FOREACH(peer, &sc->sc_peers, p_entry) {
 		wg_queue_purge(&peer->p_stage_queue);
 		wg_timers_disable(peer);
@@ -2728,7 +4289,566 @@ wg_down(struct wg_softc *sc)
 	if_link_state_change(sc->sc_ifp, LINK_STATE_DOWN);
 	wg_socket_uninit(sc);
 
+	WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
+}
+
+static const struct {
+	const char	*name;
+	const char	*descr;
+} wg_histogram_info[WG_HIST_MAX] = {
+	[WG_HIST_STAGE] = { "stage_queue",
+	    "Time spent in the per-peer staging queue" },
+	[WG_HIST_ENCRYPT_PARALLEL] = { "encrypt_queue",
+	    "Time spent waiting for an encryption worker" },
+	[WG_HIST_ENCRYPT] = { "encrypt",
+	    "Time spent encrypting a packet" },
+	[WG_HIST_ENCRYPT_SERIAL] = { "encrypt_serial_queue",
+	    "Time spent in the per-peer queue after encryption" },
+	[WG_HIST_DECRYPT_PARALLEL] = { "decrypt_queue",
+	    "Time spent waiting for a decryption worker" },
+	[WG_HIST_DECRYPT] = { "decrypt",
+	    "Time spent decrypting a packet" },
+	[WG_HIST_DECRYPT_SERIAL] = { "decrypt_serial_queue",
+	    "Time spent in the per-peer queue after decryption" },
+	[WG_HIST_HANDSHAKE] = { "handshake_queue",
+	    "Time spent in the handshake queue" },
+};
+
+static int
+wg_histogram_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_softc *sc = arg1;
+	counter_u64_t *hist = sc->sc_hist[arg2];
+	uint64_t buckets[WG_HIST_BUCKETS];
+	int error;
+
+	for (int i = 0; i < WG_HIST_BUCKETS; i++)
+		buckets[i] = counter_u64_fetch(hist[i]);
+	error = SYSCTL_OUT(req, buckets, sizeof(buckets));
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	/* Any write resets the histogram. */
+	COUNTER_ARRAY_ZERO(hist, WG_HIST_BUCKETS);
+	return (0);
+}
+
+enum wg_worker_stat {
+	WG_WORKER_PACKETS,
+	WG_WORKER_BYTES,
+	WG_WORKER_BUSY,
+	WG_WORKER_RUNS,
+	WG_WORKER_EMPTY,
+	WG_WORKER_MAX
+};
+
+static const struct {
+	const char	*name;
+	const char	*descr;
+} wg_worker_info[WG_WORKER_MAX] = {
+	[WG_WORKER_PACKETS] = { "packets", "Packets processed, per CPU" },
+	[WG_WORKER_BYTES] = { "bytes", "Bytes processed, per CPU" },
+	[WG_WORKER_BUSY] = { "busy_ns", "Time spent running, per CPU" },
+	[WG_WORKER_RUNS] = { "runs", "Number of times the worker ran, per CPU" },
+	[WG_WORKER_EMPTY] = { "empty_runs", "Runs that found no work, per CPU" },
+};
+
+static int
+wg_worker_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_worker_stats *ws = arg1;
+	uint64_t val;
+	int error = 0;
+
+	for (u_int cpu = 0; cpu <= mp_maxid && error == 0; cpu++) {
+		switch (arg2) {
+		case WG_WORKER_PACKETS:
+			val = ws[cpu].ws_packets;
+			break;
+		case WG_WORKER_BYTES:
+			val = ws[cpu].ws_bytes;
+			break;
+		case WG_WORKER_BUSY:
+			val = sbttons(ws[cpu].ws_busy);
+			break;
+		case WG_WORKER_RUNS:
+			val = ws[cpu].ws_runs;
+			break;
+		default:
+			val = ws[cpu].ws_empty;
+			break;
+		}
+		error = SYSCTL_OUT(req, &val, sizeof(val));
+	}
+	return (error);
+}
+
+static void
+wg_worker_sysctl_init(struct wg_softc *sc, struct sysctl_oid_list *parent,
+    const char *name, struct wg_worker_stats *ws)
+{
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(&sc->sc_sysctl_ctx, parent, OID_AUTO, name,
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0, "Crypto worker statistics");
+	if (node == NULL)
+		return;
+	for (int i = 0; i < WG_WORKER_MAX; i++)
+		SYSCTL_ADD_PROC(&sc->sc_sysctl_ctx, SYSCTL_CHILDREN(node),
+		    OID_AUTO, wg_worker_info[i].name,
+		    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, ws, i,
+		    wg_worker_sysctl, "QU", wg_worker_info[i].descr);
+}
+
+static int
+wg_queue_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_queue *queue = arg1;
+	uint64_t val[3];
+
+	mtx_lock(&queue->q_mtx);
+	val[0] = queue->q_len;
+	val[1] = queue->q_max;
+	val[2] = queue->q_drops;
+	mtx_unlock(&queue->q_mtx);
+	return (SYSCTL_OUT(req, val, sizeof(val)));
+}
+
+static int
+wg_sample_rate_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_softc *sc = arg1;
+	u_int rate = sc->sc_sample_rate;
+	int error;
+
+	error = sysctl_handle_int(oidp, &rate, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (rate > INT_MAX / 2)
+		return (EINVAL);
+
+	/* The rings are only allocated once sampling is first enabled. */
+	sx_xlock(&sc->sc_lock);
+	if (rate != 0 && sc->sc_samples == NULL)
+		sc->sc_samples = mallocarray(mp_maxid + 1,
+		    sizeof(struct wg_sample_ring), M_WG, M_WAITOK | M_ZERO);
+	atomic_store_rel_int(&sc->sc_sample_rate, rate);
+	sx_xunlock(&sc->sc_lock);
+	return (0);
+}
+
+/*
+ * Copy out the records published since the last read in per-CPU rings that
+ * start with a struct wg_ring, ringsize bytes apart, with nrecs records of
+ * recsize bytes each at recoff. They come out grouped by CPU. A size probe
+ * only returns an estimate, and a ring's tail only moves once its records
+ * have been copied out, so neither a probe nor a short buffer loses anything.
+ * The caller holds sc_lock.
+ */
+static int
+wg_ring_drain(struct sysctl_req *req, void *rings, size_t ringsize,
+    size_t recoff, size_t recsize, u_int nrecs, uint64_t *lost)
+{
+	struct wg_ring *r;
+	uint8_t *recs, *buf;
+	u_int head, tail, first, n, skip;
+	size_t len = 0;
+	int cpu, error = 0;
+
+	if (req->oldptr == NULL) {
+		CPU_FOREACH(cpu) {
+			r = (struct wg_ring *)((uint8_t *)rings + cpu * ringsize);
+			head = atomic_load_acq_int(&r->r_head);
+			len += MIN(head - r->r_tail, nrecs) * recsize;
+		}
+		return (SYSCTL_OUT(req, NULL, len));
+	}
+
+	buf = malloc(nrecs * recsize, M_TEMP, M_WAITOK);
+	CPU_FOREACH(cpu) {
+		r = (struct wg_ring *)((uint8_t *)rings + cpu * ringsize);
+		recs = (uint8_t *)r + recoff;
+		head = atomic_load_acq_int(&r->r_head);
+		tail = r->r_tail;
+		if (head - tail > nrecs)
+			tail = head - nrecs;
+		for (n = 0; tail + n != head; n++)
+			memcpy(buf + n * recsize,
+			    recs + ((tail + n) & (nrecs - 1)) * recsize, recsize);
+
+		/* Discard anything the owner may have overwritten by now. */
+		atomic_thread_fence_acq();
+		first = r->r_head - nrecs + 1;
+		skip = (int)(first - tail) > 0 ? MIN(first - tail, n) : 0;
+
+		error = SYSCTL_OUT(req, buf + skip * recsize, (n - skip) * recsize);
+		if (error != 0)
+			break;
+		*lost += (head - r->r_tail) - (n - skip);
+		r->r_tail = head;
+	}
+	free(buf, M_TEMP);
+	return (error);
+}
+
+/*
+ * Reading drains the samples recorded since the last read, as an array of
+ * struct wg_flow_sample, grouped by CPU. The samples show the addresses and
+ * ports inside the tunnel, so they take the same privilege as SIOCGWG.
+ */
+static int
+wg_samples_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_softc *sc = arg1;
+	int error;
+
+	if ((error = priv_check(req->td, PRIV_NET_WG)) != 0)
+		return (error);
+
+	sx_xlock(&sc->sc_lock);
+	if (sc->sc_samples != NULL)
+		error = wg_ring_drain(req, sc->sc_samples,
+		    sizeof(struct wg_sample_ring),
+		    offsetof(struct wg_sample_ring, sr_samples),
+		    sizeof(struct wg_flow_sample), WG_SAMPLE_RING,
+		    &sc->sc_samples_lost);
 	sx_xunlock(&sc->sc_lock);
+	return (error);
+}
+
+/* The rings are only allocated once IFF_DEBUG is first set. */
+static void
+wg_events_alloc(struct wg_softc *sc)
+{
+	struct wg_event_ring *er;
+
+	if (atomic_load_acq_ptr((uintptr_t *)&sc->sc_events) != 0)
+		return;
+	er = mallocarray(mp_maxid + 1, sizeof(*er), M_WG, M_WAITOK | M_ZERO);
+	sx_xlock(&sc->sc_lock);
+	if (sc->sc_events == NULL) {
+		atomic_store_rel_ptr((uintptr_t *)&sc->sc_events, (uintptr_t)er);
+		er = NULL;
+	}
+	sx_xunlock(&sc->sc_lock);
+	free(er, M_WG);
+}
+
+/*
+ * Reading drains the events recorded since the last read, as an array of
+ * struct wg_event, grouped by CPU. They name peers and show what they are
+ * doing, so they take the same privilege as the samples.
+ */
+static int
+wg_events_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_softc *sc = arg1;
+	int error;
+
+	if ((error = priv_check(req->td, PRIV_NET_WG)) != 0)
+		return (error);
+
+	sx_xlock(&sc->sc_lock);
+	if (sc->sc_events != NULL)
+		error = wg_ring_drain(req, sc->sc_events,
+		    sizeof(struct wg_event_ring),
+		    offsetof(struct wg_event_ring, er_events),
+		    sizeof(struct wg_event), WG_EVENT_RING,
+		    &sc->sc_events_lost);
+	sx_xunlock(&sc->sc_lock);
+	return (error);
+}
+
+static const char *const wg_mem_names[WG_MEM_MAX] = {
+	[WG_MEM_PEERS] = "peers",
+	[WG_MEM_AIPS] = "allowedips",
+	[WG_MEM_PACKETS] = "packets",
+};
+
+static int
+wg_mem_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_softc *sc = arg1;
+	size_t local, remote, keypair;
+	u_long val;
+
+	switch (arg2) {
+	case WG_MEM_MAX:
+		val = wg_mem_total(sc) + counter_u64_fetch(sc->sc_mem_packets);
+		break;
+	case WG_MEM_MAX + 1:
+		noise_object_sizes(&local, &remote, &keypair);
+		val = noise_local_keypairs(sc->sc_local) * keypair;
+		break;
+	case WG_MEM_PACKETS:
+		val = sc->sc_mem[arg2] + counter_u64_fetch(sc->sc_mem_packets);
+		break;
+	default:
+		val = sc->sc_mem[arg2];
+	}
+	return (sysctl_handle_long(oidp, &val, 0, req));
+}
+
+/*
+ * Per-interface statistics live under net.link.wg.<id>, where the id is
+ * handed out once per interface for the life of the module. Neither the unit
+ * nor the name would do, as wg0 may exist in several vnets at once and the
+ * sysctl tree is shared between them. The node's "ifname" and "jid" tell
+ * which interface it belongs to.
+ */
+static void
+wg_sysctl_init(struct wg_softc *sc)
+{
+	struct sysctl_ctx_list *ctx = &sc->sc_sysctl_ctx;
+	struct sysctl_oid_list *child;
+	struct sysctl_oid *node;
+	char name[16];
+
+	sysctl_ctx_init(ctx);
+	snprintf(name, sizeof(name), "%u",
+	    atomic_fetchadd_int(&wg_sysctl_counter, 1));
+	sc->sc_sysctl_tree = SYSCTL_ADD_NODE(ctx,
+	    SYSCTL_STATIC_CHILDREN(_net_link_wg), OID_AUTO, name,
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0, "WireGuard interface");
+	if (sc->sc_sysctl_tree == NULL)
+		return;
+	child = SYSCTL_CHILDREN(sc->sc_sysctl_tree);
+
+	SYSCTL_ADD_STRING(ctx, child, OID_AUTO, "ifname", CTLFLAG_RD,
+	    sc->sc_ifp->if_xname, 0, "Interface name");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "jid", CTLFLAG_RD,
+	    &sc->sc_jid, 0, "Jail that created the interface");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "histograms", CTLFLAG_RW,
+	    &sc->sc_histograms, 0, "Record latency histograms");
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "latency",
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+	    "Latency histograms, log2 nanosecond buckets");
+	if (node == NULL)
+		return;
+	for (int i = 0; i < WG_HIST_MAX; i++)
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    wg_histogram_info[i].name,
+		    CTLTYPE_U64 | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, i,
+		    wg_histogram_sysctl, "QU", wg_histogram_info[i].descr);
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "workers",
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0, "Crypto workers, indexed by CPU");
+	if (node == NULL)
+		return;
+	wg_worker_sysctl_init(sc, SYSCTL_CHILDREN(node), "encrypt",
+	    sc->sc_encrypt_stats);
+	wg_worker_sysctl_init(sc, SYSCTL_CHILDREN(node), "decrypt",
+	    sc->sc_decrypt_stats);
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "drops",
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0, "Dropped packets by reason");
+	if (node == NULL)
+		return;
+	for (int i = 0; i < WG_DROP_MAX; i++)
+		SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    wg_drop_names[i], CTLFLAG_RD, &sc->sc_drops[i], NULL);
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "queues",
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+	    "Queue length, high water mark and drops");
+	if (node == NULL)
+		return;
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO, "handshake",
+	    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, &sc->sc_handshake_queue,
+	    0, wg_queue_sysctl, "QU", "Handshake queue");
+	for (int d = 0; d < vm_ndomains; d++) {
+		wg_domain_name(name, sizeof(name), "encrypt", d);
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO, name,
+		    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE,
+		    &sc->sc_domains[d]->d_encrypt_parallel,
+		    0, wg_queue_sysctl, "QU", "Parallel encryption queue");
+		wg_domain_name(name, sizeof(name), "decrypt", d);
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO, name,
+		    CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE,
+		    &sc->sc_domains[d]->d_decrypt_parallel,
+		    0, wg_queue_sysctl, "QU", "Parallel decryption queue");
+	}
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "cross_domain",
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+	    "Packets crypted outside the NUMA domain they were queued in");
+	if (node == NULL)
+		return;
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(node), OID_AUTO, "encrypt",
+	    CTLFLAG_RD, &sc->sc_cross_domain[0], NULL);
+	SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(node), OID_AUTO, "decrypt",
+	    CTLFLAG_RD, &sc->sc_cross_domain[1], NULL);
+
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "tryforward", CTLFLAG_RW,
+	    &sc->sc_tryforward, 0,
+	    "Forward transit packets directly instead of through netisr");
+	SYSCTL_ADD_COUNTER_U64(ctx, child, OID_AUTO, "tryforwarded", CTLFLAG_RD,
+	    &sc->sc_tryforwarded,
+	    "Packets consumed by the direct path, forwarded or dropped there");
+
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "sample_rate",
+	    CTLTYPE_UINT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+	    wg_sample_rate_sysctl, "IU",
+	    "Sample one in this many tunnelled packets, 0 to disable");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "samples",
+	    CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_MPSAFE, sc, 0,
+	    wg_samples_sysctl, "S,wg_flow_sample",
+	    "Drain the packet samples, see struct wg_flow_sample");
+	SYSCTL_ADD_U64(ctx, child, OID_AUTO, "samples_lost", CTLFLAG_RD,
+	    &sc->sc_samples_lost, 0, "Samples overwritten before being read");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "events",
+	    CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_MPSAFE, sc, 0,
+	    wg_events_sysctl, "S,wg_event",
+	    "Drain the debug events, see struct wg_event");
+	SYSCTL_ADD_U64(ctx, child, OID_AUTO, "events_lost", CTLFLAG_RD,
+	    &sc->sc_events_lost, 0, "Debug events overwritten before being read");
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "memory",
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, 0, "Kernel memory in use, in bytes");
+	if (node == NULL)
+		return;
+	SYSCTL_ADD_ULONG(ctx, SYSCTL_CHILDREN(node), OID_AUTO, "limit",
+	    CTLFLAG_RW, &sc->sc_mem_limit,
+	    "Refuse new peers, allowed IPs and packets above this, 0 for none");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO, "total",
+	    CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE, sc, WG_MEM_MAX,
+	    wg_mem_sysctl, "LU", "Total");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO, "keypairs",
+	    CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE, sc, WG_MEM_MAX + 1,
+	    wg_mem_sysctl, "LU", "Session keypairs");
+	for (int i = 0; i < WG_MEM_MAX; i++)
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    wg_mem_names[i], CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE,
+		    sc, i, wg_mem_sysctl, "LU", "Charged to the interface");
+}
+
+/* Lock statistics, see wg_lockstat.h */
+struct wg_lockstat {
+	counter_u64_t	ls_acquired;
+	counter_u64_t	ls_contended;
+	counter_u64_t	ls_hold[WG_LOCKSTAT_BUCKETS];
+};
+
+static const struct {
+	const char *name;
+	const char *descr;
+} wg_lockstat_info[WG_LOCK_MAX] = {
+	[WG_LOCK_SOFTC] = { "softc", "Interface configuration locks" },
+	[WG_LOCK_QUEUE] = { "queue", "Packet queue locks" },
+	[WG_LOCK_ENDPOINT] = { "endpoint", "Peer endpoint locks" },
+	[WG_LOCK_NONCE] = { "nonce", "Keypair nonce locks" },
+	[WG_LOCK_KEYPAIR] = { "keypair", "Peer keypair locks" },
+	[WG_LOCK_INDEX] = { "index", "Noise index table locks" },
+	[WG_LOCK_RATELIMIT] = { "ratelimit", "Handshake rate limiter locks" },
+	[WG_LOCK_COOKIE_SECRET] = { "cookie_secret", "Cookie secret locks" },
+	[WG_LOCK_STAGE] = { "stage", "Per-CPU transmit staging locks" },
+};
+
+int wg_lockstat_enabled = 0;
+static struct wg_lockstat wg_lockstats[WG_LOCK_MAX];
+static struct sysctl_ctx_list wg_lockstat_ctx;
+
+void
+wg_lockstat_contended(enum wg_lock_class cls)
+{
+	counter_u64_add(wg_lockstats[cls].ls_contended, 1);
+}
+
+sbintime_t
+wg_lockstat_acquired(enum wg_lock_class cls)
+{
+	counter_u64_add(wg_lockstats[cls].ls_acquired, 1);
+	return (sbinuptime());
+}
+
+void
+wg_lockstat_released(enum wg_lock_class cls, sbintime_t start)
+{
+	sbintime_t end = sbinuptime();
+	uint64_t ns;
+	int bucket = 0;
+
+	if (end > start && (ns = sbttons(end - start)) != 0)
+		bucket = min(flsll(ns) - 1, WG_LOCKSTAT_BUCKETS - 1);
+	counter_u64_add(wg_lockstats[cls].ls_hold[bucket], 1);
+}
+
+static int
+wg_lockstat_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_lockstat *ls = &wg_lockstats[arg2];
+	uint64_t buckets[WG_LOCKSTAT_BUCKETS];
+	int error;
+
+	for (int i = 0; i < WG_LOCKSTAT_BUCKETS; i++)
+		buckets[i] = counter_u64_fetch(ls->ls_hold[i]);
+	error = SYSCTL_OUT(req, buckets, sizeof(buckets));
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	/* Any write resets all statistics of the lock class. */
+	counter_u64_zero(ls->ls_acquired);
+	counter_u64_zero(ls->ls_contended);
+	COUNTER_ARRAY_ZERO(ls->ls_hold, WG_LOCKSTAT_BUCKETS);
+	return (0);
+}
+
+/*
+ * The lock statistics live under net.link.wg.lockstat. The nodes are added
+ * only once the counters exist, so they cannot be enabled before then.
+ */
+void
+wg_lockstat_init(void)
+{
+	struct sysctl_ctx_list *ctx = &wg_lockstat_ctx;
+	struct sysctl_oid_list *child;
+	struct sysctl_oid *node;
+
+	for (int i = 0; i < WG_LOCK_MAX; i++) {
+		wg_lockstats[i].ls_acquired = counter_u64_alloc(M_WAITOK);
+		wg_lockstats[i].ls_contended = counter_u64_alloc(M_WAITOK);
+		COUNTER_ARRAY_ALLOC(wg_lockstats[i].ls_hold,
+		    WG_LOCKSTAT_BUCKETS, M_WAITOK);
+	}
+
+	sysctl_ctx_init(ctx);
+	node = SYSCTL_ADD_NODE(ctx, SYSCTL_STATIC_CHILDREN(_net_link_wg),
+	    OID_AUTO, "lockstat", CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+	    "Lock statistics");
+	if (node == NULL)
+		return;
+	child = SYSCTL_CHILDREN(node);
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "enable", CTLFLAG_RW,
+	    &wg_lockstat_enabled, 0,
+	    "Record lock acquisitions, contention and hold times");
+	for (int i = 0; i < WG_LOCK_MAX; i++) {
+		node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO,
+		    wg_lockstat_info[i].name, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+		    wg_lockstat_info[i].descr);
+		if (node == NULL)
+			continue;
+		SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "acquired", CTLFLAG_RD, &wg_lockstats[i].ls_acquired,
+		    "Acquisitions");
+		SYSCTL_ADD_COUNTER_U64(ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+		    "contended", CTLFLAG_RD, &wg_lockstats[i].ls_contended,
+		    "Acquisitions that had to wait for the lock");
+		SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(node), OID_AUTO, "hold",
+		    CTLTYPE_U64 | CTLFLAG_RW | CTLFLAG_MPSAFE, NULL, i,
+		    wg_lockstat_sysctl, "QU",
+		    "Hold times, log2 nanosecond buckets");
+	}
+}
+
+void
+wg_lockstat_deinit(void)
+{
+	wg_lockstat_enabled = 0;
+	sysctl_ctx_free(&wg_lockstat_ctx);
+	for (int i = 0; i < WG_LOCK_MAX; i++) {
+		counter_u64_free(wg_lockstats[i].ls_acquired);
+		counter_u64_free(wg_lockstats[i].ls_contended);
+		COUNTER_ARRAY_FREE(wg_lockstats[i].ls_hold,
+		    WG_LOCKSTAT_BUCKETS);
+	}
 }
 
 static int
@@ -2736,14 +4856,21 @@ wg_clone_create(struct if_clone *ifc, int unit, caddr_t params)
 {
 	struct wg_softc *sc;
 	struct ifnet *ifp;
+	int i;
 
 	sc = malloc(sizeof(*sc), M_WG, M_WAITOK | M_ZERO);
 
 	sc->sc_local = noise_local_alloc(sc);
 
-	sc->sc_encrypt = mallocarray(sizeof(struct grouptask), mp_ncpus, M_WG, M_WAITOK | M_ZERO);
+	sc->sc_encrypt = mallocarray(sizeof(struct grouptask), mp_maxid + 1, M_WG, M_WAITOK | M_ZERO);
+
+	sc->sc_decrypt = mallocarray(sizeof(struct grouptask), mp_maxid + 1, M_WG, M_WAITOK | M_ZERO);
 
-	sc->sc_decrypt = mallocarray(sizeof(struct grouptask), mp_ncpus, M_WG, M_WAITOK | M_ZERO);
+	sc->sc_stage = mallocarray(sizeof(struct wg_stage), mp_maxid + 1, M_WG, M_WAITOK | M_ZERO);
+
+	sc->sc_encrypt_stats = mallocarray(sizeof(struct wg_worker_stats), mp_maxid + 1, M_WG, M_WAITOK | M_ZERO);
+
+	sc->sc_decrypt_stats = mallocarray(sizeof(struct wg_worker_stats), mp_maxid + 1, M_WG, M_WAITOK | M_ZERO);
 
 	if (!rn_inithead((void **)&sc->sc_aip4, offsetof(struct aip_addr, in) * NBBY))
 		goto free_decrypt;
@@ -2754,7 +4881,14 @@ wg_clone_create(struct if_clone *ifc, int unit, caddr_t params)
 	atomic_add_int(&clone_count, 1);
 	ifp = sc->sc_ifp = if_alloc(IFT_WIREGUARD);
 
+	for (i = 0; i < WG_HIST_MAX; i++)
+		COUNTER_ARRAY_ALLOC(sc->sc_hist[i], WG_HIST_BUCKETS, M_WAITOK);
+	COUNTER_ARRAY_ALLOC(sc->sc_drops, WG_DROP_MAX, M_WAITOK);
+	sc->sc_tryforwarded = counter_u64_alloc(M_WAITOK);
+	sc->sc_mem_packets = counter_u64_alloc(M_WAITOK);
+
 	sc->sc_ucred = crhold(curthread->td_ucred);
+	sc->sc_jid = sc->sc_ucred->cr_prison->pr_id;
 	sc->sc_socket.so_fibnum = curthread->td_proc->p_fibnum;
 	sc->sc_socket.so_port = 0;
 
@@ -2770,17 +4904,23 @@ wg_clone_create(struct if_clone *ifc, int unit, caddr_t params)
 	taskqgroup_attach(qgroup_wg_tqg, &sc->sc_handshake, sc, NULL, NULL, "wg tx initiation");
 	wg_queue_init(&sc->sc_handshake_queue, "hsq");
 
-	for (int i = 0; i < mp_ncpus; i++) {
+	mtx_init(&sc->sc_keepalive_mtx, "wg keepalive", NULL, MTX_DEF);
+	callout_init(&sc->sc_keepalive_callout, true);
+	for (i = 0; i < WG_KEEPALIVE_SLOTS; i++)
+		LIST_INIT(&sc->sc_keepalive_wheel[i]);
+
+	CPU_FOREACH(i) {
+		mtx_init(&sc->sc_stage[i].st_mtx, "wg stage", NULL, MTX_DEF);
+		sc->sc_stage[i].st_sc = sc;
 		GROUPTASK_INIT(&sc->sc_encrypt[i], 0,
-		     (gtask_fn_t *)wg_softc_encrypt, sc);
+		     (gtask_fn_t *)wg_softc_encrypt, &sc->sc_stage[i]);
 		taskqgroup_attach_cpu(qgroup_wg_tqg, &sc->sc_encrypt[i], sc, i, NULL, NULL, "wg encrypt");
 		GROUPTASK_INIT(&sc->sc_decrypt[i], 0,
 		    (gtask_fn_t *)wg_softc_decrypt, sc);
 		taskqgroup_attach_cpu(qgroup_wg_tqg, &sc->sc_decrypt[i], sc, i, NULL, NULL, "wg decrypt");
 	}
 
-	wg_queue_init(&sc->sc_encrypt_parallel, "encp");
-	wg_queue_init(&sc->sc_decrypt_parallel, "decp");
+	wg_domains_init(sc);
 
 	sx_init(&sc->sc_lock, "wg softc lock");
 
@@ -2802,6 +4942,7 @@ wg_clone_create(struct if_clone *ifc, int unit, caddr_t params)
 	ND_IFINFO(ifp)->flags &= ~ND6_IFF_AUTO_LINKLOCAL;
 	ND_IFINFO(ifp)->flags |= ND6_IFF_NO_DAD;
 #endif
+	wg_sysctl_init(sc);
 	sx_xlock(&wg_sx);
 	LIST_INSERT_HEAD(&wg_list, sc, sc_entry);
 	sx_xunlock(&wg_sx);
@@ -2810,6 +4951,9 @@ free_aip4:
 	RADIX_NODE_HEAD_DESTROY(sc->sc_aip4);
 	free(sc->sc_aip4, M_RTABLE);
 free_decrypt:
+	free(sc->sc_decrypt_stats, M_WG);
+	free(sc->sc_encrypt_stats, M_WG);
+	free(sc->sc_stage, M_WG);
 	free(sc->sc_decrypt, M_WG);
 	free(sc->sc_encrypt, M_WG);
 	noise_local_free(sc->sc_local, NULL);
@@ -2831,25 +4975,35 @@ wg_clone_destroy(struct ifnet *ifp)
 {
 	struct wg_softc *sc = ifp->if_softc;
 	struct ucred *cred;
+	sbintime_t ls;
+	int i;
 
 	sx_xlock(&wg_sx);
 	ifp->if_softc = NULL;
-	sx_xlock(&sc->sc_lock);
+	WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	sc->sc_flags |= WGF_DYING;
 	cred = sc->sc_ucred;
 	sc->sc_ucred = NULL;
-	sx_xunlock(&sc->sc_lock);
+	WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	LIST_REMOVE(sc, sc_entry);
 	sx_xunlock(&wg_sx);
 
+	sysctl_ctx_free(&sc->sc_sysctl_ctx);
 	if_link_state_change(sc->sc_ifp, LINK_STATE_DOWN);
 	CURVNET_SET(sc->sc_ifp->if_vnet);
 	if_purgeaddrs(sc->sc_ifp);
 	CURVNET_RESTORE();
 
-	sx_xlock(&sc->sc_lock);
+	WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	wg_socket_uninit(sc);
-	sx_xunlock(&sc->sc_lock);
+	WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
+
+	/*
+	 * The keepalive wheel queues packets for encryption, so it must stop
+	 * before the crypto queues are drained. A tick running now cannot
+	 * reschedule itself once the drain has started.
+	 */
+	callout_drain(&sc->sc_keepalive_callout);
 
 	/*
 	 * No guarantees that all traffic have passed until the epoch has
@@ -2858,21 +5012,31 @@ wg_clone_destroy(struct ifnet *ifp)
 	NET_EPOCH_WAIT();
 
 	taskqgroup_drain_all(qgroup_wg_tqg);
-	sx_xlock(&sc->sc_lock);
+	wg_aead_drain(&sc->sc_aead_inflight);
+	taskqgroup_drain_all(qgroup_wg_tqg);
+	wg_stage_purge(sc);
+	WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
+	wg_handoff_save(sc);
 	wg_peer_destroy_all(sc);
 	epoch_drain_callbacks(net_epoch_preempt);
-	sx_xunlock(&sc->sc_lock);
+	WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	sx_destroy(&sc->sc_lock);
+	mtx_destroy(&sc->sc_keepalive_mtx);
 	taskqgroup_detach(qgroup_wg_tqg, &sc->sc_handshake);
-	for (int i = 0; i < mp_ncpus; i++) {
+	CPU_FOREACH(i) {
 		taskqgroup_detach(qgroup_wg_tqg, &sc->sc_encrypt[i]);
 		taskqgroup_detach(qgroup_wg_tqg, &sc->sc_decrypt[i]);
+		mtx_destroy(&sc->sc_stage[i].st_mtx);
 	}
 	free(sc->sc_encrypt, M_WG);
 	free(sc->sc_decrypt, M_WG);
+	free(sc->sc_stage, M_WG);
+	free(sc->sc_encrypt_stats, M_WG);
+	free(sc->sc_decrypt_stats, M_WG);
+	free(sc->sc_samples, M_WG);
+	free(sc->sc_events, M_WG);
 	wg_queue_deinit(&sc->sc_handshake_queue);
-	wg_queue_deinit(&sc->sc_encrypt_parallel);
-	wg_queue_deinit(&sc->sc_decrypt_parallel);
+	wg_domains_free(sc);
 
 	RADIX_NODE_HEAD_DESTROY(sc->sc_aip4);
 	RADIX_NODE_HEAD_DESTROY(sc->sc_aip6);
@@ -2881,6 +5045,12 @@ wg_clone_destroy(struct ifnet *ifp)
 
 	cookie_checker_free(&sc->sc_cookie);
 
+	for (i = 0; i < WG_HIST_MAX; i++)
+		COUNTER_ARRAY_FREE(sc->sc_hist[i], WG_HIST_BUCKETS);
+	COUNTER_ARRAY_FREE(sc->sc_drops, WG_DROP_MAX);
+	counter_u64_free(sc->sc_tryforwarded);
+	counter_u64_free(sc->sc_mem_packets);
+
 	if (cred != NULL)
 		crfree(cred);
 	if_detach(sc->sc_ifp);
@@ -2949,6 +5119,7 @@ wg_prison_remove(void *obj, void *data __unused)
 {
 	const struct prison *pr = obj;
 	struct wg_softc *sc;
+	sbintime_t ls;
 
 	/*
 	 * Do a pass through all if_wg interfaces and release creds on any from
@@ -2957,7 +5128,7 @@ wg_prison_remove(void *obj, void *data __unused)
 	 */
 	sx_slock(&wg_sx);
 	LIST_FOREACH(sc, &wg_list, sc_entry) {
-		sx_xlock(&sc->sc_lock);
+		WG_SX_XLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 		if (!(sc->sc_flags & WGF_DYING) && sc->sc_ucred && sc->sc_ucred->cr_prison == pr) {
 			struct ucred *cred = sc->sc_ucred;
 			DPRINTF(sc, "Creating jail exiting\n");
@@ -2967,25 +5138,436 @@ wg_prison_remove(void *obj, void *data __unused)
 			crfree(cred);
 			sc->sc_flags |= WGF_DYING;
 		}
-		sx_xunlock(&sc->sc_lock);
+		WG_SX_XUNLOCK(&sc->sc_lock, WG_LOCK_SOFTC, ls);
 	}
 	sx_sunlock(&wg_sx);
 
 	return (0);
 }
 
+/*
+ * Session handoff. With net.link.wg.handoff set, unloading the module saves
+ * the sessions of every peer, and the next load of the module gives each
+ * session back to the peer with the same keys when that peer is configured
+ * again, so that an upgrade does not cost a handshake per peer.
+ *
+ * Nothing of this module survives the unload, so the records are left with
+ * the wg_handoff module, which stays loaded while it holds them and wipes them
+ * once the keys in them would have expired anyway. They are tagged with a hash
+ * of their layout, which the next load must match before it reads them. It
+ * then keeps them in a hash table keyed by the local and remote public keys
+ * until their peers are configured again, or until they expire.
+ */
+#define WG_HANDOFF_VERSION	3
+#define WG_HANDOFF_LIFETIME	(REJECT_AFTER_TIME * hz)
+
+/* One per peer, cut short after the live keypairs in hp_state. */
+struct wg_handoff_peer {
+	uint8_t				 hp_local[WG_KEY_SIZE];
+	uint8_t				 hp_remote[WG_KEY_SIZE];
+	uint8_t				 hp_psk[WG_KEY_SIZE];
+	struct wg_endpoint		 hp_endpoint;
+	struct timespec			 hp_handshake_complete;
+	uint64_t			 hp_tx_bytes;
+	uint64_t			 hp_rx_bytes;
+	struct noise_remote_state	 hp_state;	/* must stay last */
+};
+
+#define WG_HANDOFF_PEER_LEN(n) \
+	(offsetof(struct wg_handoff_peer, hp_state) + NOISE_REMOTE_STATE_LEN(n))
+
+struct wg_handoff_entry {
+	LIST_ENTRY(wg_handoff_entry)	 he_entry;
+	size_t				 he_len;
+	struct wg_handoff_peer		 he_peer;	/* must stay last */
+};
+
+LIST_HEAD(wg_handoff_bucket, wg_handoff_entry);
+
+static int wg_handoff_enable = 0;
+SYSCTL_INT(_net_link_wg, OID_AUTO, handoff, CTLFLAG_RWTUN,
+    &wg_handoff_enable, 0,
+    "Hand the sessions over to the next load of the module when unloaded");
+
+/* Filled by wg_clone_destroy while unloading */
+static struct handoff *wg_handoff_out;
+static struct wg_handoff_peer *wg_handoff_rec;
+
+/* Received from the previous module */
+static struct mtx wg_handoff_mtx;
+MTX_SYSINIT(wg_handoff_mtx, &wg_handoff_mtx, "wg handoff", MTX_DEF);
+static struct wg_handoff_bucket *wg_handoff_table;
+static u_long wg_handoff_mask;
+static u_int wg_handoff_num;
+static uint8_t wg_handoff_hash_key[SIPHASH_KEY_LENGTH];
+static struct callout wg_handoff_callout;
+
+/* Both modules must agree on this before the records are read. */
+static uint64_t
+wg_handoff_layout(void)
+{
+	static const uint8_t key[SIPHASH_KEY_LENGTH];
+	static const size_t layout[] = {
+		WG_HANDOFF_VERSION,
+		sizeof(struct wg_handoff_peer),
+		offsetof(struct wg_handoff_peer, hp_remote),
+		offsetof(struct wg_handoff_peer, hp_psk),
+		offsetof(struct wg_handoff_peer, hp_endpoint),
+		offsetof(struct wg_handoff_peer, hp_handshake_complete),
+		offsetof(struct wg_handoff_peer, hp_tx_bytes),
+		offsetof(struct wg_handoff_peer, hp_rx_bytes),
+		offsetof(struct wg_handoff_peer, hp_state),
+		sizeof(struct wg_endpoint),
+		offsetof(struct wg_endpoint, e_local),
+		sizeof(struct noise_remote_state),
+		offsetof(struct noise_remote_state, rs_last_sent),
+		offsetof(struct noise_remote_state, rs_last_init_recv),
+		offsetof(struct noise_remote_state, rs_nkeypairs),
+		offsetof(struct noise_remote_state, rs_keypairs),
+		sizeof(struct noise_keypair_state),
+		offsetof(struct noise_keypair_state, ks_can_send),
+		offsetof(struct noise_keypair_state, ks_is_initiator),
+		offsetof(struct noise_keypair_state, ks_local_index),
+		offsetof(struct noise_keypair_state, ks_remote_index),
+		offsetof(struct noise_keypair_state, ks_birthdate),
+		offsetof(struct noise_keypair_state, ks_nonce_send),
+		offsetof(struct noise_keypair_state, ks_nonce_recv),
+		offsetof(struct noise_keypair_state, ks_send),
+		offsetof(struct noise_keypair_state, ks_recv),
+		offsetof(struct noise_keypair_state, ks_backtrack),
+		NOISE_KEYPAIR_SLOTS,
+	};
+	SIPHASH_CTX ctx;
+
+	SipHash24_Init(&ctx);
+	SipHash_SetKey(&ctx, key);
+	SipHash_Update(&ctx, layout, sizeof(layout));
+	return (SipHash_End(&ctx));
+}
+
+static void
+wg_handoff_alloc(void)
+{
+	if (!wg_handoff_enable)
+		return;
+	wg_handoff_out = handoff_create(wg_handoff_layout());
+	wg_handoff_rec = malloc(sizeof(*wg_handoff_rec), M_WG, M_WAITOK | M_ZERO);
+}
+
+/*
+ * Save the sessions of an interface that is being destroyed by the unload.
+ * The socket is closed and the crypto drained by now, and stopping the timers
+ * leaves nothing that could take a send nonce after it has been saved. Peers
+ * without a live keypair have nothing worth handing over.
+ */
+static void
+wg_handoff_save(struct wg_softc *sc)
+{
+	struct wg_handoff_peer *hp = wg_handoff_rec;
+	struct wg_peer *peer;
+	uint8_t public[WG_KEY_SIZE];
+
+	sx_assert(&sc->sc_lock, SX_XLOCKED);
+	if (wg_handoff_out == NULL ||
+	    noise_local_keys(sc->sc_local, public, NULL) != 0)
+		return;
+
+	TAILQ_FOREACH(peer, &sc->sc_peers, p_entry) {
+		wg_timers_disable(peer);
+		noise_remote_save(peer->p_remote, &hp->hp_state);
+		if (hp->hp_state.rs_nkeypairs == 0)
+			continue;
+		memcpy(hp->hp_local, public, WG_KEY_SIZE);
+		noise_remote_keys(peer->p_remote, hp->hp_remote, hp->hp_psk);
+		wg_peer_get_endpoint(peer, &hp->hp_endpoint);
+		mtx_lock(&peer->p_handshake_mtx);
+		hp->hp_handshake_complete = peer->p_handshake_complete;
+		mtx_unlock(&peer->p_handshake_mtx);
+		hp->hp_tx_bytes = counter_u64_fetch(peer->p_tx_bytes);
+		hp->hp_rx_bytes = counter_u64_fetch(peer->p_rx_bytes);
+		handoff_add(wg_handoff_out, hp,
+		    WG_HANDOFF_PEER_LEN(hp->hp_state.rs_nkeypairs));
+	}
+	explicit_bzero(hp, sizeof(*hp));
+}
+
+/* Leave the saved sessions for the next load, or drop them if there are none. */
+static void
+wg_handoff_publish(void)
+{
+	struct handoff *h = wg_handoff_out;
+	u_int num;
+
+	if (h == NULL)
+		return;
+	wg_handoff_out = NULL;
+	free(wg_handoff_rec, M_WG);
+	wg_handoff_rec = NULL;
+	if ((num = handoff_count(h)) == 0) {
+		handoff_destroy(h);
+		return;
+	}
+	handoff_publish(h, WG_HANDOFF_LIFETIME);
+	printf("wg: %u peers handed over\n", num);
+}
+
+static void
+wg_handoff_entry_free(struct wg_handoff_entry *he)
+{
+	size_t len = he->he_len;
+
+	explicit_bzero(he, len);
+	free(he, M_WG);
+}
+
+static uint64_t
+wg_handoff_hash(const uint8_t local[WG_KEY_SIZE],
+    const uint8_t remote[WG_KEY_SIZE])
+{
+	SIPHASH_CTX ctx;
+
+	SipHash24_Init(&ctx);
+	SipHash_SetKey(&ctx, wg_handoff_hash_key);
+	SipHash_Update(&ctx, local, WG_KEY_SIZE);
+	SipHash_Update(&ctx, remote, WG_KEY_SIZE);
+	return (SipHash_End(&ctx));
+}
+
+static void
+wg_handoff_free(void)
+{
+	struct wg_handoff_entry *he;
+	u_long i;
+
+	mtx_assert(&wg_handoff_mtx, MA_OWNED);
+	if (wg_handoff_table == NULL)
+		return;
+	if (wg_handoff_num != 0)
+		printf("wg: %u handed over peers not claimed\n", wg_handoff_num);
+	for (i = 0; i <= wg_handoff_mask; i++) {
+		while ((he = LIST_FIRST(&wg_handoff_table[i])) != NULL) {
+			LIST_REMOVE(he, he_entry);
+			wg_handoff_entry_free(he);
+		}
+	}
+	hashdestroy(wg_handoff_table, M_WG, wg_handoff_mask);
+	wg_handoff_table = NULL;
+	wg_handoff_num = 0;
+	callout_stop(&wg_handoff_callout);
+}
+
+static void
+wg_handoff_expire(void *arg __unused)
+{
+	wg_handoff_free();
+}
+
+/* Take the sessions left by the previous module, if they are sound. */
+static void
+wg_handoff_receive(void)
+{
+	struct wg_handoff_bucket *table;
+	struct wg_handoff_entry *he;
+	const struct wg_handoff_peer *hp;
+	struct handoff *h;
+	u_long mask;
+	size_t len;
+	u_int num = 0;
+	int ret;
+
+	callout_init_mtx(&wg_handoff_callout, &wg_handoff_mtx, 0);
+	if ((ret = handoff_take(wg_handoff_layout(), &h)) != 0) {
+		if (ret == EINVAL)
+			printf("wg: handed over sessions from an incompatible "
+			    "module, ignored\n");
+		return;
+	}
+
+	arc4random_buf(wg_handoff_hash_key, sizeof(wg_handoff_hash_key));
+	table = hashinit(handoff_count(h), M_WG, &mask);
+	for (hp = handoff_next(h, NULL, &len); hp != NULL;
+	    hp = handoff_next(h, hp, &len)) {
+		if (len < WG_HANDOFF_PEER_LEN(0) ||
+		    hp->hp_state.rs_nkeypairs == 0 ||
+		    hp->hp_state.rs_nkeypairs > NOISE_KEYPAIR_SLOTS ||
+		    len != WG_HANDOFF_PEER_LEN(hp->hp_state.rs_nkeypairs))
+			continue;
+		he = malloc(offsetof(struct wg_handoff_entry, he_peer) + len,
+		    M_WG, M_WAITOK);
+		he->he_len = offsetof(struct wg_handoff_entry, he_peer) + len;
+		memcpy(&he->he_peer, hp, len);
+		LIST_INSERT_HEAD(&table[wg_handoff_hash(hp->hp_local,
+		    hp->hp_remote) & mask], he, he_entry);
+		num++;
+	}
+	handoff_destroy(h);
+
+	mtx_lock(&wg_handoff_mtx);
+	wg_handoff_table = table;
+	wg_handoff_mask = mask;
+	wg_handoff_num = num;
+	callout_reset(&wg_handoff_callout, WG_HANDOFF_LIFETIME,
+	    wg_handoff_expire, NULL);
+	if (num == 0)
+		wg_handoff_free();
+	mtx_unlock(&wg_handoff_mtx);
+}
+
+/*
+ * Give a newly configured peer the session it had before the reload. The
+ * sessions were derived from the preshared key the peer had then, so they are
+ * dropped if it has changed since.
+ */
+static void
+wg_handoff_restore(struct wg_softc *sc, struct wg_peer *peer)
+{
+	struct wg_handoff_entry *he;
+	struct wg_handoff_peer *hp;
+	uint8_t local[WG_KEY_SIZE], remote[WG_KEY_SIZE], psk[WG_KEY_SIZE];
+
+	if (ck_pr_load_ptr(&wg_handoff_table) == NULL ||
+	    noise_local_keys(sc->sc_local, local, NULL) != 0)
+		return;
+	noise_remote_keys(peer->p_remote, remote, psk);
+
+	mtx_lock(&wg_handoff_mtx);
+	if (wg_handoff_table == NULL) {
+		mtx_unlock(&wg_handoff_mtx);
+		goto out;
+	}
+	LIST_FOREACH(he, &wg_handoff_table[wg_handoff_hash(local, remote) &
+	    wg_handoff_mask], he_entry)
+		if (memcmp(he->he_peer.hp_local, local, WG_KEY_SIZE) == 0 &&
+		    memcmp(he->he_peer.hp_remote, remote, WG_KEY_SIZE) == 0)
+			break;
+	if (he != NULL) {
+		LIST_REMOVE(he, he_entry);
+		if (--wg_handoff_num == 0)
+			wg_handoff_free();
+	}
+	mtx_unlock(&wg_handoff_mtx);
+	if (he == NULL)
+		goto out;
+
+	hp = &he->he_peer;
+	if (timingsafe_bcmp(hp->hp_psk, psk, WG_KEY_SIZE) != 0) {
+		DPRINTF(sc, "Peer %" PRIu64 " preshared key changed, "
+		    "session not handed over\n", peer->p_id);
+	} else if (noise_remote_restore(peer->p_remote, &hp->hp_state) == 0) {
+		if (hp->hp_endpoint.e_remote.r_sa.sa_family != 0)
+			wg_peer_set_endpoint(peer, &hp->hp_endpoint);
+		mtx_lock(&peer->p_handshake_mtx);
+		peer->p_handshake_complete = hp->hp_handshake_complete;
+		mtx_unlock(&peer->p_handshake_mtx);
+		counter_u64_add(peer->p_tx_bytes, hp->hp_tx_bytes);
+		counter_u64_add(peer->p_rx_bytes, hp->hp_rx_bytes);
+		DPRINTF(sc, "Peer %" PRIu64 " session handed over\n",
+		    peer->p_id);
+	}
+	wg_handoff_entry_free(he);
+out:
+	explicit_bzero(psk, sizeof(psk));
+}
+
 #ifdef SELFTESTS
 #include "selftest/allowedips.c"
+#include "selftest/config.c"
 static bool wg_run_selftests(void)
 {
 	bool ret = true;
 	ret &= wg_allowedips_selftest();
 	ret &= noise_counter_selftest();
+	ret &= noise_session_selftest();
 	ret &= cookie_selftest();
+	ret &= crypto_selftest();
+	ret &= wg_aead_selftest();
 	return ret;
 }
+
+/*
+ * Self-tests and benchmarks are run on demand by writing a non-zero value to
+ * net.link.wg.selftest.<name>, which fails with EIO if the test fails. Reading
+ * the node returns the duration of the last run in nanoseconds. Set the
+ * net.link.wg.selftest.on_load tunable to also run the regular self-tests
+ * when the module is loaded, failing the load if they do not pass.
+ */
+struct wg_selftest {
+	bool		(*st_run)(void);
+	uint64_t	 st_nsec;
+};
+
+static struct sx wg_selftest_sx;
+SX_SYSINIT(wg_selftest_sx, &wg_selftest_sx, "wg_selftest_sx");
+
+static int wg_selftest_on_load = 0;
+
+static SYSCTL_NODE(_net_link_wg, OID_AUTO, selftest, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "WireGuard self-tests and benchmarks");
+SYSCTL_INT(_net_link_wg_selftest, OID_AUTO, on_load, CTLFLAG_RDTUN,
+    &wg_selftest_on_load, 0, "Run the self-tests when the module is loaded");
+SYSCTL_UINT(_net_link_wg_selftest, OID_AUTO, config_peers, CTLFLAG_RW,
+    &config_benchmark_npeers, 0,
+    "Number of peers for the config benchmark, 0 for 1k to 1M");
+SYSCTL_UINT(_net_link_wg_selftest, OID_AUTO, config_allowedips, CTLFLAG_RW,
+    &config_benchmark_naips, 0, "Allowed IPs per peer for the config benchmark");
+
+static int
+wg_selftest_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct wg_selftest *st = arg1;
+	uint64_t val;
+	sbintime_t start;
+	bool ok;
+	int error;
+
+	sx_slock(&wg_selftest_sx);
+	val = st->st_nsec;
+	sx_sunlock(&wg_selftest_sx);
+
+	error = sysctl_handle_64(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL || val == 0)
+		return (error);
+
+	sx_xlock(&wg_selftest_sx);
+	start = sbinuptime();
+	ok = st->st_run();
+	st->st_nsec = sbttons(sbinuptime() - start);
+	sx_xunlock(&wg_selftest_sx);
+	return (ok ? 0 : EIO);
+}
+
+#define WG_SELFTEST(name, fn, descr)					\
+	static struct wg_selftest wg_selftest_##name = { .st_run = fn };\
+	SYSCTL_PROC(_net_link_wg_selftest, OID_AUTO, name,		\
+	    CTLTYPE_U64 | CTLFLAG_RW | CTLFLAG_MPSAFE,			\
+	    &wg_selftest_##name, 0, wg_selftest_sysctl, "QU", descr)
+
+WG_SELFTEST(all, wg_run_selftests, "Run all regular self-tests");
+WG_SELFTEST(allowedips, wg_allowedips_selftest, "Allowed IPs self-test");
+#ifdef WG_ALLOWEDIPS_RANDOMIZED_TEST
+WG_SELFTEST(allowedips_random, randomized_test,
+    "Randomized allowed IPs test against a reference implementation");
+#endif
+WG_SELFTEST(counter, noise_counter_selftest, "Nonce counter self-test");
+WG_SELFTEST(session, noise_session_selftest, "Session save and restore self-test");
+WG_SELFTEST(cookie, cookie_selftest, "Cookie and ratelimit self-test");
+WG_SELFTEST(crypto, crypto_selftest, "ChaCha20-Poly1305 self-test");
+WG_SELFTEST(aead, wg_aead_selftest, "AEAD backend self-test");
+WG_SELFTEST(crypto_benchmark, crypto_benchmark,
+    "ChaCha20-Poly1305 mbuf throughput benchmark");
+WG_SELFTEST(keypair_benchmark, noise_keypair_benchmark,
+    "Keypair nonce contention benchmark between two CPUs");
+WG_SELFTEST(config, wg_config_benchmark,
+    "Configuration benchmark with config_peers and config_allowedips");
+
+#undef WG_SELFTEST
+
+static bool wg_run_selftests_on_load(void)
+{
+	return (wg_selftest_on_load ? wg_run_selftests() : true);
+}
 #else
-static inline bool wg_run_selftests(void) { return true; }
+static inline bool wg_run_selftests_on_load(void) { return true; }
 #endif
 
 static int
@@ -2997,24 +5579,39 @@ wg_module_init(void)
 		[PR_METHOD_REMOVE] = wg_prison_remove,
 	};
 
+	/* Packets come from the domain of the CPU that takes them from the NIC. */
 	if ((wg_packet_zone = uma_zcreate("wg packet", sizeof(struct wg_packet),
-	     NULL, NULL, NULL, NULL, 0, 0)) == NULL)
+	     NULL, NULL, NULL, NULL, 0, UMA_ZONE_FIRSTTOUCH)) == NULL)
 		goto free_none;
+	if ((wg_peer_zone = uma_zcreate("wg peer", sizeof(struct wg_peer),
+	     NULL, NULL, NULL, NULL, UMA_ALIGN_CACHE, 0)) == NULL)
+		goto free_packet_zone;
+	if (noise_init() != 0)
+		goto free_peer_zone;
 	if (cookie_init() != 0)
-		goto free_zone;
+		goto free_noise;
 
+	wg_aead_init();
+	wg_lockstat_init();
 	wg_osd_jail_slot = osd_jail_register(NULL, methods);
 
 	ret = ENOTRECOVERABLE;
-	if (!wg_run_selftests())
+	if (!wg_run_selftests_on_load())
 		goto free_all;
 
+	wg_handoff_receive();
 	return (0);
 
 free_all:
 	osd_jail_deregister(wg_osd_jail_slot);
+	wg_lockstat_deinit();
+	wg_aead_deinit();
 	cookie_deinit();
-free_zone:
+free_noise:
+	noise_deinit();
+free_peer_zone:
+	uma_zdestroy(wg_peer_zone);
+free_packet_zone:
 	uma_zdestroy(wg_packet_zone);
 free_none:
 	return (ret);
@@ -3024,6 +5621,8 @@ static void
 wg_module_deinit(void)
 {
 	VNET_ITERATOR_DECL(vnet_iter);
+
+	wg_handoff_alloc();
 	VNET_LIST_RLOCK();
 	VNET_FOREACH(vnet_iter) {
 		struct if_clone *clone = VNET_VNET(vnet_iter, wg_cloner);
@@ -3035,8 +5634,17 @@ wg_module_deinit(void)
 	VNET_LIST_RUNLOCK();
 	NET_EPOCH_WAIT();
 	MPASS(LIST_EMPTY(&wg_list));
+	wg_handoff_publish();
+	mtx_lock(&wg_handoff_mtx);
+	wg_handoff_free();
+	mtx_unlock(&wg_handoff_mtx);
+	callout_drain(&wg_handoff_callout);
 	osd_jail_deregister(wg_osd_jail_slot);
+	wg_lockstat_deinit();
+	wg_aead_deinit();
 	cookie_deinit();
+	noise_deinit();
+	uma_zdestroy(wg_peer_zone);
 	uma_zdestroy(wg_packet_zone);
 }
 
@@ -3064,3 +5672,5 @@ static moduledata_t wg_moduledata = {
 DECLARE_MODULE(wg, wg_moduledata, SI_SUB_PSEUDO, SI_ORDER_ANY);
 MODULE_VERSION(wg, WIREGUARD_VERSION);
 MODULE_DEPEND(wg, crypto, 1, 1, 1);
+MODULE_DEPEND(wg, wg_handoff, HANDOFF_VERSION, HANDOFF_VERSION,
+    HANDOFF_VERSION);
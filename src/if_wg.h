@@ -34,4 +34,74 @@ struct wg_data_io {
 #define SIOCSWG _IOWR('i', 210, struct wg_data_io)
 #define SIOCGWG _IOWR('i', 211, struct wg_data_io)
 
+/*
+ * Sampled inner packets, read from sysctl net.link.wg.<unit>.samples. On
+ * average one in net.link.wg.<unit>.sample_rate packets entering or leaving
+ * the tunnel is recorded. Addresses and ports are in network byte order, an
+ * IPv4 address occupies the first 4 bytes. fs_peer matches the "id" in the
+ * peer's "stats" nvlist.
+ */
+#define WG_SAMPLE_TX	0
+#define WG_SAMPLE_RX	1
+
+struct wg_flow_sample {
+	uint64_t	fs_time;	/* uptime in ns */
+	uint64_t	fs_peer;
+	uint8_t		fs_src[16];
+	uint8_t		fs_dst[16];
+	uint16_t	fs_sport;
+	uint16_t	fs_dport;
+	uint16_t	fs_len;		/* inner packet length */
+	uint8_t		fs_af;
+	uint8_t		fs_proto;
+	uint8_t		fs_dir;		/* WG_SAMPLE_TX or WG_SAMPLE_RX */
+	uint8_t		fs_pad[7];
+};
+
+/*
+ * Debug events, recorded while the interface has IFF_DEBUG set and read from
+ * sysctl net.link.wg.<unit>.events. Reading drains the events recorded since
+ * the last read, grouped by CPU and in order within a CPU. ev_peer matches
+ * the "id" in the peer's "stats" nvlist, or is WG_EVENT_NO_PEER.
+ */
+enum wg_event_id {
+	WG_EVENT_SEND_FAILED,		/* ev_arg: errno */
+	WG_EVENT_HANDSHAKE_RETRY,	/* ev_arg: try */
+	WG_EVENT_HANDSHAKE_GIVE_UP,	/* ev_arg: tries */
+	WG_EVENT_HANDSHAKE_STALE,	/* ev_arg: seconds without a reply */
+	WG_EVENT_KEYS_ZEROED,
+	WG_EVENT_SEND_INITIATION,
+	WG_EVENT_SEND_RESPONSE,
+	WG_EVENT_SEND_COOKIE,
+	WG_EVENT_SEND_KEEPALIVE,
+	WG_EVENT_INITIATION_BAD_MAC,
+	WG_EVENT_INITIATION_RATELIMITED,
+	WG_EVENT_INITIATION_REPLAY,
+	WG_EVENT_INITIATION_INVALID,
+	WG_EVENT_RECV_INITIATION,
+	WG_EVENT_RESPONSE_BAD_MAC,
+	WG_EVENT_RESPONSE_RATELIMITED,
+	WG_EVENT_RESPONSE_INVALID,
+	WG_EVENT_RECV_RESPONSE,
+	WG_EVENT_COOKIE_UNKNOWN_INDEX,
+	WG_EVENT_COOKIE_INVALID,
+	WG_EVENT_RECV_COOKIE,
+	WG_EVENT_HANDSHAKE_QUEUE_FULL,
+	WG_EVENT_VERIFY_FIRST,
+	WG_EVENT_RECV_KEEPALIVE,
+	WG_EVENT_NOT_IP,
+	WG_EVENT_UNALLOWED_SRC,
+	WG_EVENT_LOOP,
+	WG_EVENT_NO_ENDPOINT,
+};
+
+#define WG_EVENT_NO_PEER	UINT64_MAX
+
+struct wg_event {
+	uint64_t	ev_time;	/* uptime in ns */
+	uint64_t	ev_peer;
+	uint32_t	ev_id;		/* enum wg_event_id */
+	int32_t		ev_arg;
+};
+
 #endif /* __IF_WG_H__ */
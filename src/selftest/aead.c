@@ -0,0 +1,138 @@
+/* SPDX-License-Identifier: ISC
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+/*
+ * Checks every AEAD backend against the inline software one: what a backend
+ * seals must open in software and the other way around, and a flipped bit must
+ * not open, whether the backend completes inline or from its callback. Every
+ * other length opens with the verify-first hint set. The ocf backend is
+ * skipped when crypto(9) has no ChaCha20-Poly1305 driver.
+ */
+
+#define AEAD_TEST_MAXLEN	1500
+
+static const size_t aead_test_lens[] = { 0, 1, 16, 63, 64, 65, 1420, AEAD_TEST_MAXLEN };
+
+struct aead_test {
+	struct wg_aead_req	at_req;
+	volatile u_int		at_inflight;
+	int			at_error;
+};
+
+static void
+aead_test_done(struct wg_aead_req *req, int error)
+{
+	struct aead_test *at = req->ar_arg;
+
+	at->at_error = error;
+}
+
+static int
+aead_test_crypt(const struct wg_aead *aead, void *session, const uint8_t *key,
+    struct mbuf *m, uint64_t nonce, bool encrypt, bool verify_first)
+{
+	struct aead_test at = {
+		.at_req = {
+			.ar_done = aead_test_done,
+			.ar_m = m,
+			.ar_key = key,
+			.ar_nonce = nonce,
+			.ar_encrypt = encrypt,
+			.ar_verify_first = verify_first,
+		},
+	};
+	int ret;
+
+	at.at_req.ar_arg = &at;
+	at.at_req.ar_inflight = &at.at_inflight;
+	if ((ret = aead->a_crypt(session, &at.at_req)) != EINPROGRESS)
+		return (ret);
+	wg_aead_drain(&at.at_inflight);
+	return (at.at_error);
+}
+
+static bool
+aead_test_backend(const struct wg_aead *aead, uint8_t *plain, uint8_t *out)
+{
+	uint8_t key[CHACHA20POLY1305_KEY_SIZE];
+	struct mbuf *m = NULL;
+	void *session = NULL;
+	uint64_t nonce;
+	size_t i, len;
+	bool ret = false, vf;
+
+	arc4random_buf(key, sizeof(key));
+	if (aead->a_session_new != NULL && aead->a_session_new(&session, key) != 0) {
+		printf("aead self-test %s: no session, skipped\n", aead->a_name);
+		return (true);
+	}
+
+	for (i = 0; i < nitems(aead_test_lens); i++) {
+		len = aead_test_lens[i];
+		vf = i % 2 == 1;
+		arc4random_buf(&nonce, sizeof(nonce));
+		arc4random_buf(plain, len);
+
+		m = m_gethdr(M_WAITOK, MT_DATA);
+		if (len && !m_append(m, len, plain))
+			goto fail;
+		if (aead_test_crypt(aead, session, key, m, nonce, true, false) != 0 ||
+		    m->m_pkthdr.len != len + CHACHA20POLY1305_AUTHTAG_SIZE ||
+		    chacha20poly1305_decrypt_mbuf(m, nonce, key) != 0 ||
+		    m->m_pkthdr.len != len)
+			goto fail;
+		m_copydata(m, 0, len, out);
+		if (memcmp(out, plain, len) != 0)
+			goto fail;
+
+		if (chacha20poly1305_encrypt_mbuf(m, nonce, key) != 0 ||
+		    aead_test_crypt(aead, session, key, m, nonce, false, vf) != 0 ||
+		    m->m_pkthdr.len != len)
+			goto fail;
+		m_copydata(m, 0, len, out);
+		if (memcmp(out, plain, len) != 0)
+			goto fail;
+
+		if (chacha20poly1305_encrypt_mbuf(m, nonce, key) != 0)
+			goto fail;
+		m_copydata(m, 0, m->m_pkthdr.len, out);
+		out[arc4random_uniform(len + CHACHA20POLY1305_AUTHTAG_SIZE)] ^= 1;
+		m_copyback(m, 0, len + CHACHA20POLY1305_AUTHTAG_SIZE, out);
+		if (aead_test_crypt(aead, session, key, m, nonce, false, vf) == 0)
+			goto fail;
+		m_freem(m);
+		m = NULL;
+	}
+	ret = true;
+	goto cleanup;
+fail:
+	printf("aead self-test %s %zu: FAIL\n", aead->a_name, len);
+cleanup:
+	if (m != NULL)
+		m_freem(m);
+	if (session != NULL)
+		aead->a_session_free(session);
+	explicit_bzero(key, sizeof(key));
+	return (ret);
+}
+
+bool
+wg_aead_selftest(void)
+{
+	uint8_t *plain, *out;
+	bool ret = true;
+
+	plain = malloc(AEAD_TEST_MAXLEN, M_TEMP, M_WAITOK);
+	out = malloc(AEAD_TEST_MAXLEN + CHACHA20POLY1305_AUTHTAG_SIZE, M_TEMP, M_WAITOK);
+	for (size_t i = 0; i < nitems(wg_aeads); i++)
+		ret &= aead_test_backend(wg_aeads[i], plain, out);
+	free(plain, M_TEMP);
+	free(out, M_TEMP);
+	if (ret)
+		printf("aead self-tests: pass\n");
+	return (ret);
+}
+
+#undef AEAD_TEST_MAXLEN
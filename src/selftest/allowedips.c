@@ -594,11 +594,6 @@ static bool wg_allowedips_selftest(void)
 	test_boolean(found_e);
 	test_boolean(!found_other);
 
-#ifdef WG_ALLOWEDIPS_RANDOMIZED_TEST
-	if (success)
-		success = randomized_test();
-#endif
-
 	if (success)
 		printf("allowedips self-tests: pass\n");
 
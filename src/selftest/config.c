@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+/*
+ * Configuration scale benchmark. This drives wgc_set_nvl/wgc_get_nvl with
+ * synthetic configurations of N peers, each with M allowed IPs, and reports
+ * the wall time of each configuration operation along with an estimate of
+ * the per-peer kernel memory, broken down by structure. It is far too slow
+ * and memory hungry to be part of the regular self-tests, so it is only run
+ * on request through net.link.wg.selftest.config. The numbers are meant to
+ * be compared between builds on the same machine, not across machines.
+ */
+
+#ifndef WG_CONFIG_BENCHMARK_AIPS
+#define WG_CONFIG_BENCHMARK_AIPS 1
+#endif
+
+static const size_t config_benchmark_peers[] = { 1000, 10000, 100000, 1000000 };
+
+/* Overrides the peer ladder above when set, see net.link.wg.selftest. */
+static u_int config_benchmark_npeers;
+static u_int config_benchmark_naips = WG_CONFIG_BENCHMARK_AIPS;
+
+#define T_FAILED(test) do {				\
+	printf("%s %s: FAIL\n", __func__, test);	\
+	goto cleanup;					\
+} while (0)
+
+static void
+config_benchmark_aip(nvlist_t *nvl_aip, size_t idx, size_t total)
+{
+	if (total <= (1 << 24)) {
+		struct in_addr in;
+
+		in.s_addr = htonl(0x0a000000 | (uint32_t)idx);
+		nvlist_add_binary(nvl_aip, "ipv4", &in, sizeof(in));
+		nvlist_add_number(nvl_aip, "cidr", 32);
+	} else {
+		struct in6_addr in6 = { .s6_addr = { 0xfd } };
+
+		be64enc(&in6.s6_addr[8], idx);
+		nvlist_add_binary(nvl_aip, "ipv6", &in6, sizeof(in6));
+		nvlist_add_number(nvl_aip, "cidr", 128);
+	}
+}
+
+static nvlist_t *
+config_benchmark_nvl(size_t npeers, size_t naips)
+{
+	uint8_t key[WG_KEY_SIZE];
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_port = htons(51820),
+	};
+	nvlist_t *nvl, **nvl_peers, **nvl_aips;
+	size_t i, j;
+
+	nvl = nvlist_create(0);
+	curve25519_generate_secret(key);
+	nvlist_add_binary(nvl, "private-key", key, sizeof(key));
+	explicit_bzero(key, sizeof(key));
+
+	nvl_peers = mallocarray(npeers, sizeof(void *), M_NVLIST, M_WAITOK | M_ZERO);
+	for (i = 0; i < npeers; i++) {
+		nvl_peers[i] = nvlist_create(0);
+		arc4random_buf(key, sizeof(key));
+		nvlist_add_binary(nvl_peers[i], "public-key", key, sizeof(key));
+		sin.sin_addr.s_addr = htonl(0xc6120000 | (uint32_t)(i & 0xffff));
+		nvlist_add_binary(nvl_peers[i], "endpoint", &sin, sizeof(sin));
+		if (naips == 0)
+			continue;
+		nvl_aips = mallocarray(naips, sizeof(void *), M_NVLIST, M_WAITOK | M_ZERO);
+		for (j = 0; j < naips; j++) {
+			nvl_aips[j] = nvlist_create(0);
+			config_benchmark_aip(nvl_aips[j], i * naips + j, npeers * naips);
+		}
+		nvlist_move_nvlist_array(nvl_peers[i], "allowed-ips", nvl_aips, naips);
+	}
+	nvlist_move_nvlist_array(nvl, "peers", nvl_peers, npeers);
+
+	if (nvlist_error(nvl) != 0) {
+		nvlist_destroy(nvl);
+		return (NULL);
+	}
+	return (nvl);
+}
+
+static void
+config_benchmark_memory(struct wg_softc *sc)
+{
+#define PEER_MEMBER_SIZE(m) sizeof(((struct wg_peer *)0)->m)
+	size_t local_size, remote_size, keypair_size, aips = 0;
+	size_t callouts = PEER_MEMBER_SIZE(p_new_handshake) +
+	    PEER_MEMBER_SIZE(p_send_keepalive) +
+	    PEER_MEMBER_SIZE(p_retry_handshake) +
+	    PEER_MEMBER_SIZE(p_zero_key_material);
+	size_t grouptasks = PEER_MEMBER_SIZE(p_send) + PEER_MEMBER_SIZE(p_recv);
+#undef PEER_MEMBER_SIZE
+	struct wg_peer *peer;
+
+	noise_object_sizes(&local_size, &remote_size, &keypair_size);
+
+	sx_slock(&sc->sc_lock);
+	TAILQ_FOREACH(peer, &sc->sc_peers, p_entry)
+		aips += peer->p_aips_num;
+	sx_sunlock(&sc->sc_lock);
+
+	printf("config benchmark: per peer bytes: wg_peer %zu (of which callouts "
+	    "%zu, grouptasks %zu), counters %zu, noise_remote %zu, "
+	    "keypairs %zu (up to 3 once established), allowedips %zu "
+	    "(%zu total), softc %zu, noise_local %zu\n",
+	    sizeof(struct wg_peer), callouts, grouptasks,
+	    2 * sizeof(uint64_t) * mp_ncpus,
+	    remote_size, 3 * keypair_size,
+	    sc->sc_peers_num ? aips * sizeof(struct wg_aip) / sc->sc_peers_num : 0,
+	    aips, sizeof(struct wg_softc), local_size);
+}
+
+static bool
+config_benchmark_run(size_t npeers, size_t naips)
+{
+	char name[IFNAMSIZ];
+	uint8_t key[WG_KEY_SIZE];
+	struct ifnet *ifp = NULL;
+	struct wg_softc *sc;
+	nvlist_t *nvl = NULL, *nvl_get = NULL, *nvl_key = NULL;
+	sbintime_t start, set, get, replace, rekey, destroy;
+	void *packed;
+	size_t size;
+	bool ret = false;
+
+	if ((nvl = config_benchmark_nvl(npeers, naips)) == NULL)
+		T_FAILED("nvlist");
+	nvl_key = nvlist_create(0);
+	curve25519_generate_secret(key);
+	nvlist_add_binary(nvl_key, "private-key", key, sizeof(key));
+	explicit_bzero(key, sizeof(key));
+
+	strlcpy(name, wgname, sizeof(name));
+	if (if_clone_create(name, sizeof(name), NULL) != 0)
+		T_FAILED("create");
+	if ((ifp = ifunit_ref(name)) == NULL) {
+		if_clone_destroy(name);
+		T_FAILED("create");
+	}
+	sc = ifp->if_softc;
+
+	start = sbinuptime();
+	if (wgc_set_nvl(sc, nvl) != 0 || sc->sc_peers_num != npeers)
+		T_FAILED("set");
+	set = sbinuptime() - start;
+
+	config_benchmark_memory(sc);
+
+	start = sbinuptime();
+	nvl_get = nvlist_create(0);
+	if (wgc_get_nvl(sc, nvl_get) != 0)
+		T_FAILED("get");
+	if ((packed = nvlist_pack(nvl_get, &size)) == NULL)
+		T_FAILED("pack");
+	get = sbinuptime() - start;
+	explicit_bzero(packed, size);
+	free(packed, M_NVLIST);
+
+	nvlist_free_binary(nvl, "private-key");
+	nvlist_add_bool(nvl, "replace-peers", true);
+	start = sbinuptime();
+	if (wgc_set_nvl(sc, nvl) != 0 || sc->sc_peers_num != npeers)
+		T_FAILED("replace-peers");
+	replace = sbinuptime() - start;
+
+	start = sbinuptime();
+	if (wgc_set_nvl(sc, nvl_key) != 0)
+		T_FAILED("private-key");
+	rekey = sbinuptime() - start;
+
+	if_rele(ifp);
+	ifp = NULL;
+	start = sbinuptime();
+	if (if_clone_destroy(name) != 0)
+		T_FAILED("destroy");
+	destroy = sbinuptime() - start;
+
+	printf("config benchmark: %zu peers, %zu allowedips/peer, %zu bytes "
+	    "packed: set %ju us, get %ju us, replace-peers %ju us, "
+	    "private-key %ju us, destroy %ju us\n", npeers, naips, size,
+	    (uintmax_t)sbttous(set), (uintmax_t)sbttous(get),
+	    (uintmax_t)sbttous(replace), (uintmax_t)sbttous(rekey),
+	    (uintmax_t)sbttous(destroy));
+	ret = true;
+cleanup:
+	if (ifp != NULL) {
+		if_rele(ifp);
+		if_clone_destroy(name);
+	}
+	if (nvl_get != NULL)
+		nvlist_destroy(nvl_get);
+	if (nvl_key != NULL)
+		nvlist_destroy(nvl_key);
+	if (nvl != NULL)
+		nvlist_destroy(nvl);
+	return (ret);
+}
+
+static bool wg_config_benchmark(void)
+{
+	bool ret = true;
+
+	CURVNET_SET(TD_TO_VNET(curthread));
+	if (config_benchmark_npeers != 0)
+		ret = config_benchmark_run(config_benchmark_npeers,
+		    config_benchmark_naips);
+	else
+		for (size_t i = 0; i < nitems(config_benchmark_peers); i++)
+			ret &= config_benchmark_run(config_benchmark_peers[i],
+			    config_benchmark_naips);
+	CURVNET_RESTORE();
+	if (ret)
+		printf("config benchmark: pass\n");
+	return (ret);
+}
+
+#undef T_FAILED
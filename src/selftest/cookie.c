@@ -41,7 +41,7 @@ cookie_ratelimit_timings_test(void)
 	int i;
 
 	bzero(&rl, sizeof(rl));
-	ratelimit_init(&rl);
+	ratelimit_init(&rl, INITIATION_COST, TOKEN_MAX);
 
 	sin.sin_family = AF_INET;
 #ifdef INET6
@@ -106,7 +106,7 @@ cookie_ratelimit_capacity_test(void)
 	bool ret = false;
 
 	bzero(&rl, sizeof(rl));
-	ratelimit_init(&rl);
+	ratelimit_init(&rl, INITIATION_COST, TOKEN_MAX);
 
 	sin.sin_family = AF_INET;
 	sin.sin_port = 1234;
@@ -138,7 +138,7 @@ cookie_ratelimit_gc_test(void)
 	bool ret = false;
 
 	bzero(&rl, sizeof(rl));
-	ratelimit_init(&rl);
+	ratelimit_init(&rl, INITIATION_COST, TOKEN_MAX);
 
 	sin.sin_family = AF_INET;
 	sin.sin_port = 1234;
@@ -178,6 +178,53 @@ cleanup:
 	return ret;
 }
 
+static bool
+cookie_ratelimit_check_test(void)
+{
+	struct sockaddr_in sin;
+	int i;
+	bool ret = false;
+
+	bzero(&rl, sizeof(rl));
+	ratelimit_init(&rl, AUTH_FAILURE_COST, AUTH_FAILURE_TOKEN_MAX);
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = 1234;
+	sin.sin_addr.s_addr = 0x01020304;
+
+	/* Checking never adds an entry, or takes a token. */
+	for (i = 0; i < AUTH_FAILURES_BURSTABLE * 2; i++)
+		if (ratelimit_check(&rl, sintosa(&sin), NULL) != 0)
+			T_FAILED_ITER("empty");
+	if (rl.rl_table_num != 0)
+		T_FAILED("check inserted");
+
+	for (i = 0; i < AUTH_FAILURES_BURSTABLE; i++) {
+		if (ratelimit_check(&rl, sintosa(&sin), NULL) != 0)
+			T_FAILED_ITER("charge");
+		ratelimit_allow(&rl, sintosa(&sin), NULL);
+	}
+	if (ratelimit_check(&rl, sintosa(&sin), NULL) != ECONNREFUSED)
+		T_FAILED("exhausted");
+
+	sin.sin_addr.s_addr++;
+	if (ratelimit_check(&rl, sintosa(&sin), NULL) != 0)
+		T_FAILED("other address");
+	sin.sin_addr.s_addr--;
+
+	/* The entry must outlive the GC, or the bucket would reset to full. */
+	tsleep_sbt(&rl, PWAIT, "rl", ELEMENT_TIMEOUT * SBT_1S * 2, 0, 0);
+	if (rl.rl_table_num != 1)
+		T_FAILED("gc");
+	if (ratelimit_check(&rl, sintosa(&sin), NULL) != 0)
+		T_FAILED("refill");
+	T_PASSED;
+	ret = true;
+cleanup:
+	ratelimit_deinit(&rl);
+	return ret;
+}
+
 static bool
 cookie_mac_test(void)
 {
@@ -304,6 +351,7 @@ cookie_selftest(void)
 	ret &= cookie_ratelimit_timings_test();
 	ret &= cookie_ratelimit_capacity_test();
 	ret &= cookie_ratelimit_gc_test();
+	ret &= cookie_ratelimit_check_test();
 	ret &= cookie_mac_test();
 	return ret;
 }
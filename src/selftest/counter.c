@@ -21,6 +21,7 @@ noise_counter_selftest(void)
 {
 	struct noise_keypair kp;
 	unsigned int i;
+	uint64_t nonce;
 	bool success = true;
 
 	T_INIT;
@@ -93,6 +94,24 @@ noise_counter_selftest(void)
 	T(48, 0, 0);
 	T(49, COUNTER_WINDOW_SIZE + 1, 0);
 
+	/* The counters cross 32 bits whole, with or without 64 bit atomics. */
+	T_INIT;
+	kp.kp_can_send = true;
+	kp.kp_nonce_send = UINT32_MAX - 1;
+	if (noise_keypair_nonce_reserve(&kp, 4, &nonce) != 0 ||
+	    nonce != UINT32_MAX - 1 ||
+	    noise_nonce_load(&kp, &kp.kp_nonce_send) != UINT32_MAX + 3ull) {
+		printf("nonce counter self-test 50: FAIL\n");
+		success = false;
+	}
+	T(51, UINT32_MAX + 5ull, 0);
+	if (noise_nonce_load(&kp, &kp.kp_nonce_recv) != UINT32_MAX + 6ull) {
+		printf("nonce counter self-test 52: FAIL\n");
+		success = false;
+	}
+	T(53, UINT32_MAX + 5ull, EEXIST);
+	T(54, UINT32_MAX - 1, 0);
+
 	if (success)
 		printf("nonce counter self-test: pass\n");
 	return success;
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#define CRYPTO_TEST_MAXLEN	2048
+#define CRYPTO_BENCHMARK_LEN	1420
+#define CRYPTO_BENCHMARK_ITERS	100000
+
+static const size_t crypto_test_lens[] = {
+	0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 129, 255, 256, 511, 1280, 1420,
+	1500, CRYPTO_TEST_MAXLEN
+};
+
+static struct mbuf *
+crypto_test_mbuf(const uint8_t *data, size_t len)
+{
+	struct mbuf *m;
+
+	/* Small mbufs, so that the chain crosses many chacha20 blocks. */
+	if ((m = m_gethdr(M_WAITOK, MT_DATA)) == NULL)
+		return (NULL);
+	if (len && !m_append(m, len, data)) {
+		m_freem(m);
+		return (NULL);
+	}
+	return (m);
+}
+
+bool
+crypto_selftest(void)
+{
+	uint8_t key[CHACHA20POLY1305_KEY_SIZE], *plain, *ref, *out;
+	struct mbuf *m = NULL;
+	uint64_t nonce;
+	size_t i, len;
+	bool ret = false;
+
+	plain = malloc(CRYPTO_TEST_MAXLEN, M_TEMP, M_WAITOK);
+	ref = malloc(CRYPTO_TEST_MAXLEN + CHACHA20POLY1305_AUTHTAG_SIZE, M_TEMP, M_WAITOK);
+	out = malloc(CRYPTO_TEST_MAXLEN + CHACHA20POLY1305_AUTHTAG_SIZE, M_TEMP, M_WAITOK);
+
+	for (i = 0; i < nitems(crypto_test_lens); i++) {
+		len = crypto_test_lens[i];
+		arc4random_buf(key, sizeof(key));
+		arc4random_buf(&nonce, sizeof(nonce));
+		arc4random_buf(plain, len);
+
+		chacha20poly1305_encrypt(ref, plain, len, NULL, 0, nonce, key);
+		if (!chacha20poly1305_decrypt(out, ref, len + CHACHA20POLY1305_AUTHTAG_SIZE,
+		    NULL, 0, nonce, key) || memcmp(out, plain, len) != 0) {
+			printf("crypto self-test flat %zu: FAIL\n", len);
+			goto cleanup;
+		}
+
+		if ((m = crypto_test_mbuf(plain, len)) == NULL) {
+			printf("crypto self-test malloc: FAIL\n");
+			goto cleanup;
+		}
+		if (chacha20poly1305_encrypt_mbuf(m, nonce, key) != 0 ||
+		    m->m_pkthdr.len != len + CHACHA20POLY1305_AUTHTAG_SIZE) {
+			printf("crypto self-test mbuf encrypt %zu: FAIL\n", len);
+			goto cleanup;
+		}
+		m_copydata(m, 0, m->m_pkthdr.len, out);
+		if (memcmp(out, ref, len + CHACHA20POLY1305_AUTHTAG_SIZE) != 0) {
+			printf("crypto self-test mbuf encrypt %zu: FAIL\n", len);
+			goto cleanup;
+		}
+		if (chacha20poly1305_decrypt_mbuf(m, nonce, key) != 0 ||
+		    m->m_pkthdr.len != len) {
+			printf("crypto self-test mbuf decrypt %zu: FAIL\n", len);
+			goto cleanup;
+		}
+		m_copydata(m, 0, len, out);
+		if (memcmp(out, plain, len) != 0) {
+			printf("crypto self-test mbuf decrypt %zu: FAIL\n", len);
+			goto cleanup;
+		}
+		m_freem(m);
+
+		/* Flip one bit of the ciphertext or tag, it must not verify. */
+		ref[arc4random_uniform(len + CHACHA20POLY1305_AUTHTAG_SIZE)] ^= 1;
+		if ((m = crypto_test_mbuf(ref, len + CHACHA20POLY1305_AUTHTAG_SIZE)) == NULL) {
+			printf("crypto self-test malloc: FAIL\n");
+			goto cleanup;
+		}
+		if (chacha20poly1305_decrypt_mbuf(m, nonce, key) != EBADMSG) {
+			printf("crypto self-test mbuf forgery %zu: FAIL\n", len);
+			goto cleanup;
+		}
+		m_freem(m);
+		m = NULL;
+	}
+	printf("crypto self-tests: pass\n");
+	ret = true;
+cleanup:
+	if (m != NULL)
+		m_freem(m);
+	explicit_bzero(key, sizeof(key));
+	free(plain, M_TEMP);
+	free(ref, M_TEMP);
+	free(out, M_TEMP);
+	return (ret);
+}
+
+bool
+crypto_benchmark(void)
+{
+	uint8_t key[CHACHA20POLY1305_KEY_SIZE];
+	sbintime_t start, elapsed;
+	struct mbuf *m;
+	uint64_t nonce;
+
+	if ((m = m_getjcl(M_WAITOK, MT_DATA, M_PKTHDR, MJUMPAGESIZE)) == NULL)
+		return (false);
+	m->m_len = m->m_pkthdr.len = CRYPTO_BENCHMARK_LEN;
+	arc4random_buf(mtod(m, void *), CRYPTO_BENCHMARK_LEN);
+	arc4random_buf(key, sizeof(key));
+
+	start = sbinuptime();
+	for (nonce = 0; nonce < CRYPTO_BENCHMARK_ITERS; nonce++) {
+		if (chacha20poly1305_encrypt_mbuf(m, nonce, key) != 0 ||
+		    chacha20poly1305_decrypt_mbuf(m, nonce, key) != 0) {
+			printf("crypto benchmark: FAIL\n");
+			m_freem(m);
+			return (false);
+		}
+	}
+	elapsed = sbinuptime() - start;
+	m_freem(m);
+	explicit_bzero(key, sizeof(key));
+
+	printf("crypto benchmark: %d x %d byte encrypt+decrypt in %ju us, "
+	    "%ju ns/packet\n", CRYPTO_BENCHMARK_ITERS, CRYPTO_BENCHMARK_LEN,
+	    (uintmax_t)sbttous(elapsed),
+	    (uintmax_t)(sbttons(elapsed) / CRYPTO_BENCHMARK_ITERS));
+	return (true);
+}
+
+#undef CRYPTO_TEST_MAXLEN
+#undef CRYPTO_BENCHMARK_LEN
+#undef CRYPTO_BENCHMARK_ITERS
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+/*
+ * Keypair contention benchmark. One thread takes transmit nonces with
+ * noise_keypair_nonce_next while another, bound to a different CPU, feeds the
+ * replay window with noise_keypair_nonce_check, and both take and drop a
+ * reference per operation like the data path does. Each side is timed alone
+ * and then with the other running, once on separate keypairs and once on the
+ * same keypair. On separate keypairs the two sides share nothing, so the
+ * slowdown of the same keypair run over it is what the two sides still share
+ * in the current struct noise_keypair layout: kp_refcnt, which both take, and
+ * any other line written by one side and touched by the other. The file only
+ * uses the keypair fields initialised below, so it can also be built against
+ * an older layout to compare the two. It needs at least two CPUs.
+ */
+
+#define KEYPAIR_BENCHMARK_ITERS	10000000
+
+struct keypair_bench {
+	struct noise_keypair	*kb_kp;
+	int			 kb_cpu;
+	bool			 kb_tx;
+	volatile int		*kb_go;
+	volatile int		*kb_done;
+	sbintime_t		 kb_elapsed;
+	bool			 kb_ok;
+};
+
+static void
+keypair_bench_thread(void *arg)
+{
+	struct keypair_bench *kb = arg;
+	struct noise_keypair *kp = kb->kb_kp;
+	sbintime_t start;
+	uint64_t i, nonce;
+
+	thread_lock(curthread);
+	sched_bind(curthread, kb->kb_cpu);
+	thread_unlock(curthread);
+
+	while (atomic_load_acq_int(kb->kb_go) == 0)
+		cpu_spinwait();
+
+	kb->kb_ok = true;
+	start = sbinuptime();
+	for (i = 0; i < KEYPAIR_BENCHMARK_ITERS; i++) {
+		noise_keypair_ref(kp);
+		if (kb->kb_tx)
+			kb->kb_ok &= noise_keypair_nonce_next(kp, &nonce) == 0;
+		else
+			kb->kb_ok &= noise_keypair_nonce_check(kp, i) == 0;
+		refcount_release(&kp->kp_refcnt);
+	}
+	kb->kb_elapsed = sbinuptime() - start;
+
+	thread_lock(curthread);
+	sched_unbind(curthread);
+	thread_unlock(curthread);
+	atomic_add_rel_int(kb->kb_done, 1);
+	kthread_exit();
+}
+
+static bool
+keypair_bench_run(struct keypair_bench *kb, int n, bool shared)
+{
+	struct noise_keypair kp[2];
+	volatile int go = 0, done = 0;
+	int i, j;
+
+	MPASS(n <= nitems(kp));
+	bzero(kp, sizeof(kp));
+	for (i = 0; i < nitems(kp); i++) {
+		refcount_init(&kp[i].kp_refcnt, 1);
+		kp[i].kp_can_send = true;
+		rw_init(&kp[i].kp_nonce_lock, "keypair benchmark");
+	}
+
+	for (i = 0; i < n; i++) {
+		kb[i].kb_kp = shared ? &kp[0] : &kp[i];
+		kb[i].kb_go = &go;
+		kb[i].kb_done = &done;
+		if (kthread_add(keypair_bench_thread, &kb[i], NULL, NULL, 0, 0,
+		    "wg keypair bench %d", i) != 0)
+			break;
+	}
+	atomic_store_rel_int(&go, 1);
+	while (atomic_load_acq_int(&done) < i)
+		pause("wgbench", hz / 10);
+	for (j = 0; j < nitems(kp); j++)
+		rw_destroy(&kp[j].kp_nonce_lock);
+	if (i != n)
+		return (false);
+	for (i = 0; i < n; i++)
+		if (!kb[i].kb_ok)
+			return (false);
+	return (true);
+}
+
+bool
+noise_keypair_benchmark(void)
+{
+	struct keypair_bench kb[2] = {
+		{ .kb_tx = true, .kb_cpu = CPU_FIRST() },
+		{ .kb_tx = false, .kb_cpu = CPU_NEXT(CPU_FIRST()) },
+	};
+	sbintime_t solo[2], apart[2];
+
+	if (mp_ncpus < 2) {
+		printf("keypair benchmark: needs 2 CPUs, skipped\n");
+		return (true);
+	}
+
+	if (!keypair_bench_run(&kb[0], 1, true) ||
+	    !keypair_bench_run(&kb[1], 1, true))
+		goto fail;
+	solo[0] = kb[0].kb_elapsed;
+	solo[1] = kb[1].kb_elapsed;
+	if (!keypair_bench_run(kb, 2, false))
+		goto fail;
+	apart[0] = kb[0].kb_elapsed;
+	apart[1] = kb[1].kb_elapsed;
+	if (!keypair_bench_run(kb, 2, true))
+		goto fail;
+
+#define NS_PER_OP(t)	((uintmax_t)(sbttons(t) / KEYPAIR_BENCHMARK_ITERS))
+	printf("keypair benchmark: %d iterations, CPUs %d and %d, ns/op "
+	    "alone, concurrent on separate keypairs, concurrent on one: "
+	    "tx %ju %ju %ju; rx %ju %ju %ju\n",
+	    KEYPAIR_BENCHMARK_ITERS, kb[0].kb_cpu, kb[1].kb_cpu,
+	    NS_PER_OP(solo[0]), NS_PER_OP(apart[0]), NS_PER_OP(kb[0].kb_elapsed),
+	    NS_PER_OP(solo[1]), NS_PER_OP(apart[1]), NS_PER_OP(kb[1].kb_elapsed));
+#undef NS_PER_OP
+	return (true);
+fail:
+	printf("keypair benchmark: FAIL\n");
+	return (false);
+}
+
+#undef KEYPAIR_BENCHMARK_ITERS
@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: MIT
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+/*
+ * Session save and restore, as across a reload of the module. A remote with a
+ * live and an expired keypair is saved and restored into a remote of a new
+ * local with the same keys. Only the live keypair must come back, under its
+ * old index, with SAVE_NONCE_SKIP send nonces skipped and its replay window
+ * intact. Restoring the same state again must fail on the index that is now
+ * taken, and restoring it once the keypair has expired must fail too.
+ */
+
+#define T(num, cond) do {						\
+	if (!(cond)) {							\
+		printf("session self-test %u: FAIL\n", num);		\
+		success = false;					\
+		goto cleanup;						\
+	}								\
+} while (0)
+
+/* Stand in for a completed handshake. */
+static struct noise_keypair *
+session_test_begin(struct noise_remote *r, enum noise_handshake_state state)
+{
+	struct noise_keypair *kp = NULL;
+
+	rw_wlock(&r->r_handshake_lock);
+	noise_remote_index_insert(r->r_local, r);
+	r->r_handshake_state = state;
+	arc4random_buf(r->r_handshake.hs_ck, NOISE_HASH_LEN);
+	if (noise_begin_session(r) == 0)
+		kp = state == HANDSHAKE_INITIATOR ?
+		    ck_pr_load_ptr(&r->r_current) : ck_pr_load_ptr(&r->r_next);
+	rw_wunlock(&r->r_handshake_lock);
+	return (kp);
+}
+
+bool
+noise_session_selftest(void)
+{
+	uint8_t private[NOISE_PUBLIC_KEY_LEN], public[NOISE_PUBLIC_KEY_LEN];
+	struct noise_local *l1 = NULL, *l2 = NULL;
+	struct noise_remote *r1 = NULL, *r2 = NULL, *r3 = NULL;
+	struct noise_keypair *old, *kp, *kp2;
+	struct noise_remote_state *rs;
+	uint64_t nonce, saved;
+	uint32_t idx;
+	int i;
+	bool success = true;
+
+	rs = malloc(sizeof(*rs), M_TEMP, M_WAITOK);
+	arc4random_buf(private, sizeof(private));
+	arc4random_buf(public, sizeof(public));
+
+	l1 = noise_local_alloc(NULL);
+	noise_local_private(l1, private);
+	T(1, (r1 = noise_remote_alloc(l1, NULL, public)) != NULL);
+
+	T(2, (old = session_test_begin(r1, HANDSHAKE_INITIATOR)) != NULL);
+	old->kp_birthdate -= (REJECT_AFTER_TIME + 1) * SBT_1S;
+	T(3, (kp = session_test_begin(r1, HANDSHAKE_INITIATOR)) != NULL);
+	T(4, ck_pr_load_ptr(&r1->r_previous) == old);
+	for (i = 0; i < 3; i++)
+		T(5, noise_keypair_nonce_next(kp, &nonce) == 0);
+	for (i = 0; i < 10; i++)
+		T(6, noise_keypair_nonce_check(kp, i) == 0);
+	saved = nonce + 1;
+	idx = kp->kp_index.i_local_index;
+
+	/* The expired keypair is left out, the live one stops sending. */
+	noise_remote_save(r1, rs);
+	T(7, rs->rs_nkeypairs == 1);
+	T(8, rs->rs_keypairs[0].ks_slot == NOISE_KEYPAIR_CURRENT);
+	T(9, rs->rs_keypairs[0].ks_local_index == idx);
+	T(10, noise_keypair_nonce_next(kp, &nonce) != 0);
+
+	l2 = noise_local_alloc(NULL);
+	noise_local_private(l2, private);
+	T(11, (r2 = noise_remote_alloc(l2, NULL, public)) != NULL);
+	T(12, noise_remote_restore(r2, rs) == 0);
+	T(13, ck_pr_load_ptr(&r2->r_previous) == NULL &&
+	    ck_pr_load_ptr(&r2->r_next) == NULL);
+	T(14, (kp2 = noise_keypair_lookup(l2, idx)) != NULL);
+	noise_keypair_put(kp2);
+	T(15, kp2 == ck_pr_load_ptr(&r2->r_current));
+	T(16, memcmp(kp2->kp_send, kp->kp_send, NOISE_SYMMETRIC_KEY_LEN) == 0 &&
+	    memcmp(kp2->kp_recv, kp->kp_recv, NOISE_SYMMETRIC_KEY_LEN) == 0);
+	T(17, noise_keypair_nonce_next(kp2, &nonce) == 0);
+	T(18, nonce == saved + SAVE_NONCE_SKIP);
+	T(19, noise_keypair_nonce_check(kp2, 5) == EEXIST);
+	T(20, noise_keypair_nonce_check(kp2, 10) == 0);
+
+	/* The index is taken by r2's keypair now. */
+	T(21, (r3 = noise_remote_alloc(l2, NULL, public)) != NULL);
+	T(22, noise_remote_restore(r3, rs) == ENOENT);
+	T(23, ck_pr_load_ptr(&r3->r_current) == NULL);
+	T(24, (kp2 = noise_keypair_lookup(l2, idx)) != NULL);
+	noise_keypair_put(kp2);
+	T(25, kp2 == ck_pr_load_ptr(&r2->r_current));
+
+	/* Expired since it was saved. */
+	noise_remote_keypairs_clear(r2);
+	rs->rs_keypairs[0].ks_birthdate -= (REJECT_AFTER_TIME + 1) * SBT_1S;
+	T(26, noise_remote_restore(r3, rs) == ENOENT);
+	T(27, noise_keypair_lookup(l2, idx) == NULL);
+
+	printf("session self-test: pass\n");
+cleanup:
+	if (r3 != NULL)
+		noise_remote_free(r3, NULL);
+	if (r2 != NULL)
+		noise_remote_free(r2, NULL);
+	if (r1 != NULL)
+		noise_remote_free(r1, NULL);
+	if (l2 != NULL)
+		noise_local_free(l2, NULL);
+	if (l1 != NULL)
+		noise_local_free(l1, NULL);
+	explicit_bzero(rs, sizeof(*rs));
+	free(rs, M_TEMP);
+	explicit_bzero(private, sizeof(private));
+	return (success);
+}
+
+#undef T
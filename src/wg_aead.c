@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: ISC
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
+#include <sys/endian.h>
+#include <sys/errno.h>
+#include <sys/priority.h>
+#include <sys/smp.h>
+#include <sys/taskqueue.h>
+#include <machine/atomic.h>
+#include <opencrypto/cryptodev.h>
+
+#include "wg_aead.h"
+
+static struct taskqueue *wg_aead_tq;
+
+static void
+wg_aead_complete(struct wg_aead_req *req, int error)
+{
+	volatile u_int *inflight = req->ar_inflight;
+
+	/* The request may be freed by ar_done, so it must not be touched. */
+	req->ar_done(req, error);
+	atomic_subtract_rel_int(inflight, 1);
+}
+
+/* Inline software crypto, the default. */
+static int
+wg_aead_software_crypt(void *session __unused, struct wg_aead_req *req)
+{
+	if (req->ar_encrypt)
+		return (chacha20poly1305_encrypt_mbuf(req->ar_m, req->ar_nonce,
+		    req->ar_key));
+	if (req->ar_verify_first)
+		return (chacha20poly1305_verify_decrypt_mbuf(req->ar_m,
+		    req->ar_nonce, req->ar_key));
+	return (chacha20poly1305_decrypt_mbuf(req->ar_m, req->ar_nonce,
+	    req->ar_key));
+}
+
+static const struct wg_aead wg_aead_software = {
+	.a_name = "software",
+	.a_crypt = wg_aead_software_crypt,
+};
+
+/*
+ * Software crypto completed from a taskqueue, so that the asynchronous
+ * completion path can be exercised without a crypto(9) driver.
+ */
+static void
+wg_aead_async_task(void *arg, int pending __unused)
+{
+	struct wg_aead_req *req = arg;
+
+	wg_aead_complete(req, wg_aead_software_crypt(NULL, req));
+}
+
+static int
+wg_aead_async_crypt(void *session __unused, struct wg_aead_req *req)
+{
+	TASK_INIT(&req->ar_task, 0, wg_aead_async_task, req);
+	atomic_add_int(req->ar_inflight, 1);
+	taskqueue_enqueue(wg_aead_tq, &req->ar_task);
+	return (EINPROGRESS);
+}
+
+static const struct wg_aead wg_aead_async = {
+	.a_name = "async",
+	.a_crypt = wg_aead_async_crypt,
+};
+
+#ifdef CRYPTO_CHACHA20_POLY1305
+/*
+ * crypto(9), which picks a hardware driver for the session if there is one
+ * and falls back to the software one otherwise.
+ */
+static int
+wg_aead_ocf_session_new(void **session, const uint8_t key[CHACHA20POLY1305_KEY_SIZE])
+{
+	struct crypto_session_params csp = {
+		.csp_mode = CSP_MODE_AEAD,
+		.csp_cipher_alg = CRYPTO_CHACHA20_POLY1305,
+		.csp_cipher_klen = CHACHA20POLY1305_KEY_SIZE,
+		.csp_cipher_key = key,
+		.csp_ivlen = CHACHA20_POLY1305_IV_LEN,
+		.csp_auth_mlen = CHACHA20POLY1305_AUTHTAG_SIZE,
+	};
+	crypto_session_t cses;
+	int ret;
+
+	ret = crypto_newsession(&cses, &csp,
+	    CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE);
+	if (ret == 0)
+		*session = cses;
+	return (ret);
+}
+
+static void
+wg_aead_ocf_session_free(void *session)
+{
+	crypto_freesession(session);
+}
+
+static int
+wg_aead_ocf_done(struct cryptop *crp)
+{
+	struct wg_aead_req *req = crp->crp_opaque;
+	int error = crp->crp_etype;
+
+	/* The session moved to another driver, try again. */
+	if (error == EAGAIN) {
+		crypto_dispatch(crp);
+		return (0);
+	}
+	crypto_freereq(crp);
+	if (error == 0 && !req->ar_encrypt)
+		m_adj(req->ar_m, -CHACHA20POLY1305_AUTHTAG_SIZE);
+	wg_aead_complete(req, error);
+	return (0);
+}
+
+static int
+wg_aead_ocf_crypt(void *session, struct wg_aead_req *req)
+{
+	static const uint8_t tag[CHACHA20POLY1305_AUTHTAG_SIZE] = { 0 };
+	struct mbuf *m = req->ar_m;
+	struct cryptop *crp;
+	int len, ret;
+
+	len = m->m_pkthdr.len;
+	if (req->ar_encrypt) {
+		if (!m_append(m, sizeof(tag), tag))
+			return (ENOMEM);
+	} else {
+		if (len < CHACHA20POLY1305_AUTHTAG_SIZE)
+			return (EMSGSIZE);
+		len -= CHACHA20POLY1305_AUTHTAG_SIZE;
+	}
+
+	if ((crp = crypto_getreq(session, M_NOWAIT)) == NULL)
+		return (ENOMEM);
+	crp->crp_op = req->ar_encrypt ?
+	    CRYPTO_OP_ENCRYPT | CRYPTO_OP_COMPUTE_DIGEST :
+	    CRYPTO_OP_DECRYPT | CRYPTO_OP_VERIFY_DIGEST;
+	crp->crp_flags = CRYPTO_F_IV_SEPARATE | CRYPTO_F_CBIMM;
+	crypto_use_mbuf(crp, m);
+	crp->crp_payload_start = 0;
+	crp->crp_payload_length = len;
+	crp->crp_digest_start = len;
+	/* The 96 bit nonce is 32 zero bits followed by the counter. */
+	memset(crp->crp_iv, 0, 4);
+	le64enc(crp->crp_iv + 4, req->ar_nonce);
+	crp->crp_callback = wg_aead_ocf_done;
+	crp->crp_opaque = req;
+
+	atomic_add_int(req->ar_inflight, 1);
+	if ((ret = crypto_dispatch(crp)) != 0) {
+		atomic_subtract_int(req->ar_inflight, 1);
+		crypto_freereq(crp);
+		return (ret);
+	}
+	return (EINPROGRESS);
+}
+
+static const struct wg_aead wg_aead_ocf = {
+	.a_name = "ocf",
+	.a_session_new = wg_aead_ocf_session_new,
+	.a_session_free = wg_aead_ocf_session_free,
+	.a_crypt = wg_aead_ocf_crypt,
+};
+#endif
+
+static const struct wg_aead *wg_aeads[] = {
+	&wg_aead_software,
+	&wg_aead_async,
+#ifdef CRYPTO_CHACHA20_POLY1305
+	&wg_aead_ocf,
+#endif
+};
+
+/* Backend for new keypairs, existing keypairs keep theirs. */
+static const struct wg_aead *volatile wg_aead_selected = &wg_aead_software;
+
+const struct wg_aead *
+wg_aead_lookup(const char *name)
+{
+	for (size_t i = 0; i < nitems(wg_aeads); i++)
+		if (strcmp(wg_aeads[i]->a_name, name) == 0)
+			return (wg_aeads[i]);
+	return (NULL);
+}
+
+const struct wg_aead *
+wg_aead_current(void)
+{
+	return (wg_aead_selected);
+}
+
+void
+wg_aead_select(const struct wg_aead *aead)
+{
+	wg_aead_selected = aead;
+}
+
+/* Wait for the requests counted in inflight to call ar_done. */
+void
+wg_aead_drain(volatile u_int *inflight)
+{
+	while (atomic_load_acq_int(inflight) != 0)
+		pause("wgaead", 1);
+}
+
+void
+wg_aead_init(void)
+{
+	wg_aead_tq = taskqueue_create("wg aead", M_WAITOK,
+	    taskqueue_thread_enqueue, &wg_aead_tq);
+	taskqueue_start_threads(&wg_aead_tq, mp_ncpus, PI_NET, "wg aead");
+}
+
+void
+wg_aead_deinit(void)
+{
+	/* Every owner has drained its requests, only the threads are left. */
+	taskqueue_free(wg_aead_tq);
+}
+
+#ifdef SELFTESTS
+#include "selftest/aead.c"
+#endif /* SELFTESTS */
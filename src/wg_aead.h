@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: ISC
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef _WG_AEAD_H_
+#define _WG_AEAD_H_
+
+#include <sys/types.h>
+#include <sys/mbuf.h>
+#include <sys/taskqueue.h>
+
+#include "crypto.h"
+
+/*
+ * Data packet AEAD backends. A backend seals or opens an mbuf in place with
+ * ChaCha20-Poly1305, appending or stripping the tag, either before returning
+ * or later from a completion callback. Backends that need per-key state keep
+ * it in a session that noise creates for each direction of a keypair on first
+ * use, from a crypto worker that may sleep.
+ *
+ * a_crypt returns EINPROGRESS when it will call ar_done with the result, and
+ * otherwise returns the result directly without calling ar_done. Until then the
+ * request is counted in *ar_inflight, which belongs to the caller and outlives
+ * the request, so that the caller can wait for its own requests with
+ * wg_aead_drain.
+ */
+struct wg_aead_req;
+typedef void wg_aead_done_t(struct wg_aead_req *, int);
+
+struct wg_aead_req {
+	wg_aead_done_t		*ar_done;
+	void			*ar_arg;
+	volatile u_int		*ar_inflight;
+
+	/* Filled in by noise, private to the backend from then on */
+	struct mbuf		*ar_m;
+	const uint8_t		*ar_key;
+	uint64_t		 ar_nonce;
+	bool			 ar_encrypt;
+	bool			 ar_verify_first;	/* a hint, when opening */
+	struct task		 ar_task;
+};
+
+struct wg_aead {
+	const char	*a_name;
+	int		(*a_session_new)(void **, const uint8_t [CHACHA20POLY1305_KEY_SIZE]);
+	void		(*a_session_free)(void *);
+	int		(*a_crypt)(void *, struct wg_aead_req *);
+};
+
+const struct wg_aead	*wg_aead_lookup(const char *);
+const struct wg_aead	*wg_aead_current(void);
+void			 wg_aead_select(const struct wg_aead *);
+void			 wg_aead_drain(volatile u_int *);
+void			 wg_aead_init(void);
+void			 wg_aead_deinit(void);
+
+#ifdef SELFTESTS
+bool	wg_aead_selftest(void);
+#endif /* SELFTESTS */
+
+#endif /* _WG_AEAD_H_ */
@@ -15,6 +15,7 @@
 
 #include "support.h"
 #include "wg_cookie.h"
+#include "wg_lockstat.h"
 
 #define COOKIE_MAC1_KEY_LABEL	"mac1----"
 #define COOKIE_COOKIE_KEY_LABEL	"cookie--"
@@ -30,6 +31,12 @@
 #define INITIATION_COST		(SBT_1S / INITIATIONS_PER_SECOND)
 #define TOKEN_MAX		(INITIATION_COST * INITIATIONS_BURSTABLE)
 #define ELEMENT_TIMEOUT		1
+
+/* Constants for data packet authentication failure throttling */
+#define AUTH_FAILURES_PER_SECOND	8
+#define AUTH_FAILURES_BURSTABLE		32
+#define AUTH_FAILURE_COST	(SBT_1S / AUTH_FAILURES_PER_SECOND)
+#define AUTH_FAILURE_TOKEN_MAX	(AUTH_FAILURE_COST * AUTH_FAILURES_BURSTABLE)
 #define IPV4_MASK_SIZE		4 /* Use all 4 bytes of IPv4 address */
 #define IPV6_MASK_SIZE		8 /* Use top 8 bytes (/64) of IPv6 address */
 
@@ -51,6 +58,9 @@ struct ratelimit {
 	struct callout			rl_gc;
 	LIST_HEAD(, ratelimit_entry)	rl_table[RATELIMIT_SIZE];
 	size_t				rl_table_num;
+	uint64_t			rl_cost;
+	uint64_t			rl_token_max;
+	sbintime_t			rl_timeout;
 };
 
 static void	precompute_key(uint8_t *,
@@ -62,18 +72,25 @@ static void	macs_mac2(struct cookie_macs *, const void *, size_t,
 static int	timer_expired(sbintime_t, uint32_t, uint32_t);
 static void	make_cookie(struct cookie_checker *,
 			uint8_t[COOKIE_COOKIE_SIZE], struct sockaddr *);
-static void	ratelimit_init(struct ratelimit *);
+static void	ratelimit_init(struct ratelimit *, uint64_t, uint64_t);
 static void	ratelimit_deinit(struct ratelimit *);
 static void	ratelimit_gc_callout(void *);
 static void	ratelimit_gc_schedule(struct ratelimit *);
 static void	ratelimit_gc(struct ratelimit *, bool);
+static size_t	ratelimit_key_init(struct ratelimit_key *, struct sockaddr *,
+		    struct vnet *);
 static int	ratelimit_allow(struct ratelimit *, struct sockaddr *, struct vnet *);
+static int	ratelimit_check(struct ratelimit *, struct sockaddr *, struct vnet *);
 static uint64_t siphash13(const uint8_t [SIPHASH_KEY_LENGTH], const void *, size_t);
 
 static struct ratelimit ratelimit_v4;
 #ifdef INET6
 static struct ratelimit ratelimit_v6;
 #endif
+static struct ratelimit authfail_v4;
+#ifdef INET6
+static struct ratelimit authfail_v6;
+#endif
 static uma_zone_t ratelimit_zone;
 
 /* Public Functions */
@@ -84,9 +101,13 @@ cookie_init(void)
 	    sizeof(struct ratelimit_entry), NULL, NULL, NULL, NULL, 0, 0)) == NULL)
 		return ENOMEM;
 
-	ratelimit_init(&ratelimit_v4);
+	ratelimit_init(&ratelimit_v4, INITIATION_COST, TOKEN_MAX);
+#ifdef INET6
+	ratelimit_init(&ratelimit_v6, INITIATION_COST, TOKEN_MAX);
+#endif
+	ratelimit_init(&authfail_v4, AUTH_FAILURE_COST, AUTH_FAILURE_TOKEN_MAX);
 #ifdef INET6
-	ratelimit_init(&ratelimit_v6);
+	ratelimit_init(&authfail_v6, AUTH_FAILURE_COST, AUTH_FAILURE_TOKEN_MAX);
 #endif
 	return (0);
 }
@@ -97,10 +118,55 @@ cookie_deinit(void)
 	ratelimit_deinit(&ratelimit_v4);
 #ifdef INET6
 	ratelimit_deinit(&ratelimit_v6);
+#endif
+	ratelimit_deinit(&authfail_v4);
+#ifdef INET6
+	ratelimit_deinit(&authfail_v6);
 #endif
 	uma_zdestroy(ratelimit_zone);
 }
 
+size_t
+cookie_ratelimit_memory(void)
+{
+	size_t entries = ratelimit_v4.rl_table_num + authfail_v4.rl_table_num;
+#ifdef INET6
+	entries += ratelimit_v6.rl_table_num + authfail_v6.rl_table_num;
+#endif
+	return (entries * sizeof(struct ratelimit_entry));
+}
+
+/*
+ * Data packets are cheap to forge for anyone who has seen a receiver index,
+ * and each forgery costs a decryption and a slot in the peer's decrypt queue.
+ * Each address that sends packets which fail to authenticate is charged a
+ * token per failure, and once it runs out, cookie_auth_allow refuses its
+ * data packets until the bucket refills. The addresses are masked as for
+ * initiations.
+ */
+void
+cookie_auth_failed(struct sockaddr *sa, struct vnet *vnet)
+{
+	if (sa->sa_family == AF_INET)
+		ratelimit_allow(&authfail_v4, sa, vnet);
+#ifdef INET6
+	else if (sa->sa_family == AF_INET6)
+		ratelimit_allow(&authfail_v6, sa, vnet);
+#endif
+}
+
+int
+cookie_auth_allow(struct sockaddr *sa, struct vnet *vnet)
+{
+	if (sa->sa_family == AF_INET)
+		return (ratelimit_check(&authfail_v4, sa, vnet));
+#ifdef INET6
+	else if (sa->sa_family == AF_INET6)
+		return (ratelimit_check(&authfail_v6, sa, vnet));
+#endif
+	return (0);
+}
+
 void
 cookie_checker_init(struct cookie_checker *cc)
 {
@@ -306,8 +372,9 @@ make_cookie(struct cookie_checker *cc, uint8_t cookie[COOKIE_COOKIE_SIZE],
     struct sockaddr *sa)
 {
 	struct blake2s_state state;
+	sbintime_t ls;
 
-	mtx_lock(&cc->cc_secret_mtx);
+	WG_MTX_LOCK(&cc->cc_secret_mtx, WG_LOCK_COOKIE_SECRET, ls);
 	if (timer_expired(cc->cc_secret_birthdate,
 	    COOKIE_SECRET_MAX_AGE, 0)) {
 		arc4random_buf(cc->cc_secret, COOKIE_SECRET_SIZE);
@@ -315,7 +382,7 @@ make_cookie(struct cookie_checker *cc, uint8_t cookie[COOKIE_COOKIE_SIZE],
 	}
 	blake2s_init_key(&state, COOKIE_COOKIE_SIZE, cc->cc_secret,
 	    COOKIE_SECRET_SIZE);
-	mtx_unlock(&cc->cc_secret_mtx);
+	WG_MTX_UNLOCK(&cc->cc_secret_mtx, WG_LOCK_COOKIE_SECRET, ls);
 
 	if (sa->sa_family == AF_INET) {
 		blake2s_update(&state, (uint8_t *)&satosin(sa)->sin_addr,
@@ -337,7 +404,7 @@ make_cookie(struct cookie_checker *cc, uint8_t cookie[COOKIE_COOKIE_SIZE],
 }
 
 static void
-ratelimit_init(struct ratelimit *rl)
+ratelimit_init(struct ratelimit *rl, uint64_t cost, uint64_t token_max)
 {
 	size_t i;
 	mtx_init(&rl->rl_mtx, "ratelimit_lock", NULL, MTX_DEF);
@@ -346,6 +413,10 @@ ratelimit_init(struct ratelimit *rl)
 	for (i = 0; i < RATELIMIT_SIZE; i++)
 		LIST_INIT(&rl->rl_table[i]);
 	rl->rl_table_num = 0;
+	rl->rl_cost = cost;
+	rl->rl_token_max = token_max;
+	/* An entry must not be collected before its bucket could refill. */
+	rl->rl_timeout = MAX(ELEMENT_TIMEOUT * SBT_1S, token_max);
 }
 
 static void
@@ -391,7 +462,7 @@ ratelimit_gc(struct ratelimit *rl, bool force)
 	if (rl->rl_table_num == 0)
 		return;
 
-	expiry = getsbinuptime() - ELEMENT_TIMEOUT * SBT_1S;
+	expiry = getsbinuptime() - rl->rl_timeout;
 
 	for (i = 0; i < RATELIMIT_SIZE; i++) {
 		LIST_FOREACH_SAFE(r, &rl->rl_table[i], r_entry, tr) {
@@ -406,29 +477,43 @@ ratelimit_gc(struct ratelimit *rl, bool force)
 	ratelimit_gc_schedule(rl);
 }
 
-static int
-ratelimit_allow(struct ratelimit *rl, struct sockaddr *sa, struct vnet *vnet)
+/* Returns the length of the key to compare, or 0 for other families. */
+static size_t
+ratelimit_key_init(struct ratelimit_key *key, struct sockaddr *sa,
+    struct vnet *vnet)
 {
-	uint64_t bucket, tokens;
-	sbintime_t diff, now;
-	struct ratelimit_entry *r;
-	int ret = ECONNREFUSED;
-	struct ratelimit_key key = { .vnet = vnet };
-	size_t len = sizeof(key);
+	size_t len = sizeof(*key);
 
+	bzero(key, sizeof(*key));
+	key->vnet = vnet;
 	if (sa->sa_family == AF_INET) {
-		memcpy(key.ip, &satosin(sa)->sin_addr, IPV4_MASK_SIZE);
+		memcpy(key->ip, &satosin(sa)->sin_addr, IPV4_MASK_SIZE);
 		len -= IPV6_MASK_SIZE - IPV4_MASK_SIZE;
 	}
 #ifdef INET6
 	else if (sa->sa_family == AF_INET6)
-		memcpy(key.ip, &satosin6(sa)->sin6_addr, IPV6_MASK_SIZE);
+		memcpy(key->ip, &satosin6(sa)->sin6_addr, IPV6_MASK_SIZE);
 #endif
 	else
+		len = 0;
+	return (len);
+}
+
+static int
+ratelimit_allow(struct ratelimit *rl, struct sockaddr *sa, struct vnet *vnet)
+{
+	uint64_t bucket, tokens;
+	sbintime_t diff, now, ls;
+	struct ratelimit_entry *r;
+	int ret = ECONNREFUSED;
+	struct ratelimit_key key;
+	size_t len;
+
+	if ((len = ratelimit_key_init(&key, sa, vnet)) == 0)
 		return ret;
 
 	bucket = siphash13(rl->rl_secret, &key, len) & RATELIMIT_MASK;
-	mtx_lock(&rl->rl_mtx);
+	WG_MTX_LOCK(&rl->rl_mtx, WG_LOCK_RATELIMIT, ls);
 
 	LIST_FOREACH(r, &rl->rl_table[bucket], r_entry) {
 		if (bcmp(&r->r_key, &key, len) != 0)
@@ -437,21 +522,20 @@ ratelimit_allow(struct ratelimit *rl, struct sockaddr *sa, struct vnet *vnet)
 		/* If we get to here, we've found an entry for the endpoint.
 		 * We apply standard token bucket, by calculating the time
 		 * lapsed since our last_time, adding that, ensuring that we
-		 * cap the tokens at TOKEN_MAX. If the endpoint has no tokens
-		 * left (that is tokens <= INITIATION_COST) then we block the
-		 * request, otherwise we subtract the INITITIATION_COST and
-		 * return OK. */
+		 * cap the tokens at rl_token_max. If the endpoint has no tokens
+		 * left (that is tokens <= rl_cost) then we block the request,
+		 * otherwise we subtract rl_cost and return OK. */
 		now = getsbinuptime();
 		diff = now - r->r_last_time;
 		r->r_last_time = now;
 
 		tokens = r->r_tokens + diff;
 
-		if (tokens > TOKEN_MAX)
-			tokens = TOKEN_MAX;
+		if (tokens > rl->rl_token_max)
+			tokens = rl->rl_token_max;
 
-		if (tokens >= INITIATION_COST) {
-			r->r_tokens = tokens - INITIATION_COST;
+		if (tokens >= rl->rl_cost) {
+			r->r_tokens = tokens - rl->rl_cost;
 			goto ok;
 		} else {
 			r->r_tokens = tokens;
@@ -474,14 +558,47 @@ ratelimit_allow(struct ratelimit *rl, struct sockaddr *sa, struct vnet *vnet)
 	LIST_INSERT_HEAD(&rl->rl_table[bucket], r, r_entry);
 	r->r_key = key;
 	r->r_last_time = getsbinuptime();
-	r->r_tokens = TOKEN_MAX - INITIATION_COST;
+	r->r_tokens = rl->rl_token_max - rl->rl_cost;
 
 	/* If we've added a new entry, let's trigger GC. */
 	ratelimit_gc_schedule(rl);
 ok:
 	ret = 0;
 error:
-	mtx_unlock(&rl->rl_mtx);
+	WG_MTX_UNLOCK(&rl->rl_mtx, WG_LOCK_RATELIMIT, ls);
+	return ret;
+}
+
+/*
+ * Like ratelimit_allow, but without taking a token or adding an entry. It is
+ * called for data packets on keypairs that have seen forgeries, so the case
+ * of an empty table is still decided without the lock.
+ */
+static int
+ratelimit_check(struct ratelimit *rl, struct sockaddr *sa, struct vnet *vnet)
+{
+	uint64_t bucket;
+	sbintime_t ls;
+	struct ratelimit_entry *r;
+	int ret = 0;
+	struct ratelimit_key key;
+	size_t len;
+
+	if (rl->rl_table_num == 0)
+		return ret;
+	if ((len = ratelimit_key_init(&key, sa, vnet)) == 0)
+		return ret;
+
+	bucket = siphash13(rl->rl_secret, &key, len) & RATELIMIT_MASK;
+	WG_MTX_LOCK(&rl->rl_mtx, WG_LOCK_RATELIMIT, ls);
+	LIST_FOREACH(r, &rl->rl_table[bucket], r_entry) {
+		if (bcmp(&r->r_key, &key, len) != 0)
+			continue;
+		if (r->r_tokens + (getsbinuptime() - r->r_last_time) < rl->rl_cost)
+			ret = ECONNREFUSED;
+		break;
+	}
+	WG_MTX_UNLOCK(&rl->rl_mtx, WG_LOCK_RATELIMIT, ls);
 	return ret;
 }
 
@@ -52,6 +52,9 @@ struct cookie_checker {
 
 int	cookie_init(void);
 void	cookie_deinit(void);
+size_t	cookie_ratelimit_memory(void);
+void	cookie_auth_failed(struct sockaddr *, struct vnet *);
+int	cookie_auth_allow(struct sockaddr *, struct vnet *);
 void	cookie_checker_init(struct cookie_checker *);
 void	cookie_checker_free(struct cookie_checker *);
 void	cookie_checker_update(struct cookie_checker *,
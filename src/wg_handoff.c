@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: ISC
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/callout.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/module.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+
+#include "wg_handoff.h"
+
+struct handoff_rec {
+	STAILQ_ENTRY(handoff_rec)	 hr_entry;
+	size_t				 hr_len;
+	uint8_t				 hr_data[];
+};
+
+struct handoff {
+	uint64_t			 h_tag;
+	u_int				 h_num;
+	STAILQ_HEAD(, handoff_rec)	 h_recs;
+};
+
+static struct mtx handoff_mtx;
+MTX_SYSINIT(handoff_mtx, &handoff_mtx, "wg handoff", MTX_DEF);
+static struct handoff *handoff_held;
+static struct callout handoff_callout;
+
+struct handoff *
+handoff_create(uint64_t tag)
+{
+	struct handoff *h;
+
+	h = malloc(sizeof(*h), M_TEMP, M_WAITOK | M_ZERO);
+	h->h_tag = tag;
+	STAILQ_INIT(&h->h_recs);
+	return (h);
+}
+
+void
+handoff_add(struct handoff *h, const void *p, size_t len)
+{
+	struct handoff_rec *hr;
+
+	hr = malloc(sizeof(*hr) + len, M_TEMP, M_WAITOK);
+	hr->hr_len = len;
+	memcpy(hr->hr_data, p, len);
+	STAILQ_INSERT_TAIL(&h->h_recs, hr, hr_entry);
+	h->h_num++;
+}
+
+u_int
+handoff_count(struct handoff *h)
+{
+	return (h->h_num);
+}
+
+/* Return the record after prev, or the first one if prev is NULL. */
+const void *
+handoff_next(struct handoff *h, const void *prev, size_t *len)
+{
+	struct handoff_rec *hr;
+
+	if (prev == NULL)
+		hr = STAILQ_FIRST(&h->h_recs);
+	else
+		hr = STAILQ_NEXT(__containerof(prev, struct handoff_rec,
+		    hr_data[0]), hr_entry);
+	if (hr == NULL)
+		return (NULL);
+	*len = hr->hr_len;
+	return (hr->hr_data);
+}
+
+void
+handoff_destroy(struct handoff *h)
+{
+	struct handoff_rec *hr;
+
+	while ((hr = STAILQ_FIRST(&h->h_recs)) != NULL) {
+		STAILQ_REMOVE_HEAD(&h->h_recs, hr_entry);
+		explicit_bzero(hr, sizeof(*hr) + hr->hr_len);
+		free(hr, M_TEMP);
+	}
+	explicit_bzero(h, sizeof(*h));
+	free(h, M_TEMP);
+}
+
+static void
+handoff_expire(void *arg __unused)
+{
+	struct handoff *h;
+
+	mtx_assert(&handoff_mtx, MA_OWNED);
+	if ((h = handoff_held) == NULL)
+		return;
+	handoff_held = NULL;
+	printf("wg: %u handed over peers expired\n", h->h_num);
+	handoff_destroy(h);
+}
+
+/* Hold h, which is ours from now on, for timo ticks. */
+void
+handoff_publish(struct handoff *h, int timo)
+{
+	struct handoff *old;
+
+	mtx_lock(&handoff_mtx);
+	old = handoff_held;
+	handoff_held = h;
+	callout_reset(&handoff_callout, timo, handoff_expire, NULL);
+	mtx_unlock(&handoff_mtx);
+	if (old != NULL)
+		handoff_destroy(old);
+}
+
+/*
+ * Take the handoff that is held, which is the caller's from then on. Returns
+ * ENOENT if there is none, and EINVAL if its tag does not match, in which case
+ * it is dropped.
+ */
+int
+handoff_take(uint64_t tag, struct handoff **hp)
+{
+	struct handoff *h;
+
+	mtx_lock(&handoff_mtx);
+	h = handoff_held;
+	handoff_held = NULL;
+	callout_stop(&handoff_callout);
+	mtx_unlock(&handoff_mtx);
+	if (h == NULL)
+		return (ENOENT);
+	if (h->h_tag != tag) {
+		handoff_destroy(h);
+		return (EINVAL);
+	}
+	*hp = h;
+	return (0);
+}
+
+static int
+handoff_modevent(module_t mod, int type, void *data)
+{
+	int ret = 0;
+
+	switch (type) {
+	case MOD_LOAD:
+		callout_init_mtx(&handoff_callout, &handoff_mtx, 0);
+		break;
+	case MOD_QUIESCE:
+	case MOD_UNLOAD:
+		/* Stay loaded, when if_wg unloads, until the handoff is gone. */
+		mtx_lock(&handoff_mtx);
+		if (handoff_held != NULL)
+			ret = EBUSY;
+		mtx_unlock(&handoff_mtx);
+		if (ret == 0 && type == MOD_UNLOAD)
+			callout_drain(&handoff_callout);
+		break;
+	default:
+		ret = EOPNOTSUPP;
+	}
+	return (ret);
+}
+
+static moduledata_t handoff_moduledata = {
+	"wg_handoff",
+	handoff_modevent,
+	0
+};
+
+DECLARE_MODULE(wg_handoff, handoff_moduledata, SI_SUB_PSEUDO, SI_ORDER_ANY);
+MODULE_VERSION(wg_handoff, HANDOFF_VERSION);
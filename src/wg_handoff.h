@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: ISC
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef _WG_HANDOFF_H_
+#define _WG_HANDOFF_H_
+
+#include <sys/types.h>
+
+/*
+ * Holds the sessions that an unload of if_wg hands over to the next load. It
+ * is a module of its own, which if_wg depends on and which refuses to unload
+ * while it holds a handoff, so that the records outlive if_wg and are still
+ * wiped and freed when their lifetime runs out, even if if_wg never comes back.
+ *
+ * A handoff is a list of opaque records tagged by the caller. handoff_publish
+ * gives it to the module, which drops any handoff published before it, and
+ * handoff_take gives it back, if its tag matches, or drops it if not.
+ */
+#define HANDOFF_VERSION	1
+
+struct handoff;
+
+struct handoff	*handoff_create(uint64_t);
+void		 handoff_add(struct handoff *, const void *, size_t);
+u_int		 handoff_count(struct handoff *);
+const void	*handoff_next(struct handoff *, const void *, size_t *);
+void		 handoff_publish(struct handoff *, int);
+int		 handoff_take(uint64_t, struct handoff **);
+void		 handoff_destroy(struct handoff *);
+
+#endif /* _WG_HANDOFF_H_ */
@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: ISC
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef _WG_LOCKSTAT_H_
+#define _WG_LOCKSTAT_H_
+
+#include <sys/types.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/rwlock.h>
+#include <sys/sx.h>
+
+/*
+ * Lightweight lock statistics, enabled at runtime with
+ * net.link.wg.lockstat.enable. For each lock class this counts acquisitions,
+ * acquisitions that had to wait, and a log2 nanosecond histogram of hold
+ * times. Contention is detected by trying the lock first, and the hold time
+ * is measured from a timestamp the caller keeps in a local variable between
+ * the lock and unlock wrappers. When disabled, the wrappers cost one load and
+ * branch in addition to the plain lock operation.
+ */
+enum wg_lock_class {
+	WG_LOCK_SOFTC,		/* wg_softc sc_lock */
+	WG_LOCK_QUEUE,		/* wg_queue q_mtx */
+	WG_LOCK_ENDPOINT,	/* wg_peer p_endpoint_lock */
+	WG_LOCK_NONCE,		/* noise_keypair kp_nonce_lock */
+	WG_LOCK_KEYPAIR,	/* noise_remote r_keypair_mtx */
+	WG_LOCK_INDEX,		/* noise_local l_index_mtx */
+	WG_LOCK_RATELIMIT,	/* ratelimit rl_mtx */
+	WG_LOCK_COOKIE_SECRET,	/* cookie_checker cc_secret_mtx */
+	WG_LOCK_STAGE,		/* wg_stage st_mtx */
+	WG_LOCK_MAX
+};
+
+#define WG_LOCKSTAT_BUCKETS	32
+
+extern int wg_lockstat_enabled;
+
+void		wg_lockstat_contended(enum wg_lock_class);
+sbintime_t	wg_lockstat_acquired(enum wg_lock_class);
+void		wg_lockstat_released(enum wg_lock_class, sbintime_t);
+void		wg_lockstat_init(void);
+void		wg_lockstat_deinit(void);
+
+#define WG_LOCKSTAT_LOCK(trylock, lock, cls, ls) do {			\
+	(ls) = 0;							\
+	if (__predict_false(wg_lockstat_enabled)) {			\
+		if (!trylock) {						\
+			wg_lockstat_contended(cls);			\
+			lock;						\
+		}							\
+		(ls) = wg_lockstat_acquired(cls);			\
+	} else								\
+		lock;							\
+} while (0)
+
+#define WG_LOCKSTAT_UNLOCK(unlock, cls, ls) do {			\
+	if (__predict_false((ls) != 0))					\
+		wg_lockstat_released(cls, ls);				\
+	unlock;								\
+} while (0)
+
+#define WG_MTX_LOCK(m, cls, ls)						\
+	WG_LOCKSTAT_LOCK(mtx_trylock(m), mtx_lock(m), cls, ls)
+#define WG_MTX_UNLOCK(m, cls, ls)					\
+	WG_LOCKSTAT_UNLOCK(mtx_unlock(m), cls, ls)
+#define WG_RW_RLOCK(rw, cls, ls)					\
+	WG_LOCKSTAT_LOCK(rw_try_rlock(rw), rw_rlock(rw), cls, ls)
+#define WG_RW_RUNLOCK(rw, cls, ls)					\
+	WG_LOCKSTAT_UNLOCK(rw_runlock(rw), cls, ls)
+#define WG_RW_WLOCK(rw, cls, ls)					\
+	WG_LOCKSTAT_LOCK(rw_try_wlock(rw), rw_wlock(rw), cls, ls)
+#define WG_RW_WUNLOCK(rw, cls, ls)					\
+	WG_LOCKSTAT_UNLOCK(rw_wunlock(rw), cls, ls)
+#define WG_SX_SLOCK(sx, cls, ls)					\
+	WG_LOCKSTAT_LOCK(sx_try_slock(sx), sx_slock(sx), cls, ls)
+#define WG_SX_SUNLOCK(sx, cls, ls)					\
+	WG_LOCKSTAT_UNLOCK(sx_sunlock(sx), cls, ls)
+#define WG_SX_XLOCK(sx, cls, ls)					\
+	WG_LOCKSTAT_LOCK(sx_try_xlock(sx), sx_xlock(sx), cls, ls)
+#define WG_SX_XUNLOCK(sx, cls, ls)					\
+	WG_LOCKSTAT_UNLOCK(sx_xunlock(sx), cls, ls)
+
+#endif /* _WG_LOCKSTAT_H_ */
@@ -14,10 +14,19 @@
 #include <sys/epoch.h>
 #include <sys/ck.h>
 #include <sys/endian.h>
+#include <vm/uma.h>
+#include <machine/atomic.h>
+#ifdef SELFTESTS
+#include <sys/kthread.h>
+#include <sys/proc.h>
+#include <sys/sched.h>
+#endif
 #include <crypto/siphash/siphash.h>
 
 #include "crypto.h"
+#include "wg_aead.h"
 #include "wg_noise.h"
+#include "wg_lockstat.h"
 #include "support.h"
 
 /* Protocol string constants */
@@ -36,6 +45,25 @@
 #define COUNTER_REDUNDANT_BITS	COUNTER_BITS
 #define COUNTER_WINDOW_SIZE	(COUNTER_BITS_TOTAL - COUNTER_REDUNDANT_BITS)
 
+/*
+ * The 64 bit nonce counters are read and bumped without kp_nonce_lock where
+ * the platform has 64 bit atomics, which is LP64, i386 (cmpxchg8b) and armv6
+ * and up (ldrexd/strexd). Elsewhere a counter is only changed under the write
+ * lock, and read without it through kp_nonce_seqc.
+ */
+#if !defined(__LP64__) && (defined(__i386__) || \
+    (defined(__arm__) && __ARM_ARCH >= 6))
+#define NONCE_ATOMIC64
+#endif
+
+#if !defined(__LP64__) && !defined(NONCE_ATOMIC64)
+#if __FreeBSD_version < 1300000
+#include <sys/seq.h>	/* see compat.h */
+#else
+#include <sys/seqc.h>
+#endif
+#endif
+
 /* Constants for the keypair */
 #define REKEY_AFTER_MESSAGES	(1ull << 60)
 #define REJECT_AFTER_MESSAGES	(UINT64_MAX - COUNTER_WINDOW_SIZE - 1)
@@ -44,6 +72,7 @@
 #define REJECT_INTERVAL		(1000000000 / 50) /* fifty times per sec */
 /* 24 = floor(log2(REJECT_INTERVAL)) */
 #define REJECT_INTERVAL_MASK	(~((1ull<<24)-1))
+#define AUTH_FAILURE_RATE	64 /* per second, then verify before decrypting */
 #define TIMER_RESET		(SBT_1S * -(REKEY_TIMEOUT+1))
 
 #define HT_INDEX_SIZE		(1 << 13)
@@ -51,6 +80,16 @@
 #define HT_REMOTE_SIZE		(1 << 11)
 #define HT_REMOTE_MASK		(HT_REMOTE_SIZE - 1)
 #define MAX_REMOTE_PER_LOCAL	(1 << 20)
+#define HT_REPLAY_SIZE		(1 << 8)
+#define HT_REPLAY_MASK		(HT_REPLAY_SIZE - 1)
+
+/*
+ * Send nonces skipped by a saved keypair, for senders that saw kp_can_send
+ * before noise_remote_save cleared it and take their nonces afterwards.
+ */
+#define SAVE_NONCE_SKIP		(1 << 16)
+
+CTASSERT(COUNTER_BITS_TOTAL / NBBY == NOISE_REPLAY_WINDOW_LEN);
 
 struct noise_index {
 	CK_LIST_ENTRY(noise_index)	 i_entry;
@@ -59,9 +98,16 @@ struct noise_index {
 	int				 i_is_keypair;
 };
 
+/*
+ * The keypair is laid out so that the transmit path, which bumps
+ * kp_nonce_send on every packet, and the receive path, which updates the
+ * replay window, do not write to the cache lines holding each other's state
+ * or the read-mostly keys. kp_refcnt is taken by both directions for each
+ * packet, so it gets a line of its own.
+ */
 struct noise_keypair {
+	/* Read mostly */
 	struct noise_index		 kp_index;
-	u_int				 kp_refcnt;
 	bool				 kp_can_send;
 	bool				 kp_is_initiator;
 	sbintime_t			 kp_birthdate; /* sbinuptime */
@@ -70,15 +116,38 @@ struct noise_keypair {
 	uint8_t				 kp_send[NOISE_SYMMETRIC_KEY_LEN];
 	uint8_t				 kp_recv[NOISE_SYMMETRIC_KEY_LEN];
 
-	/* Counter elements */
-	struct rwlock			 kp_nonce_lock;
-	uint64_t			 kp_nonce_send;
+	/* Backend chosen at creation, sessions created on first use */
+	const struct wg_aead		*kp_aead;
+	void				*kp_session_send;
+	void				*kp_session_recv;
+
+	struct epoch_context		 kp_smr;
+
+	u_int				 kp_refcnt __aligned(CACHE_LINE_SIZE);
+
+	/* Counter elements, transmit */
+	uint64_t			 kp_nonce_send __aligned(CACHE_LINE_SIZE);
+
+	/* Counter elements, receive */
+	struct rwlock			 kp_nonce_lock __aligned(CACHE_LINE_SIZE);
 	uint64_t			 kp_nonce_recv;
+#if !defined(__LP64__) && !defined(NONCE_ATOMIC64)
+	seqc_t				 kp_nonce_seqc;
+#endif
 	unsigned long			 kp_backtrack[COUNTER_BITS_TOTAL / COUNTER_BITS];
 
-	struct epoch_context		 kp_smr;
+	/* Authentication failures, see noise_keypair_auth_failed */
+	bool				 kp_verify_first;
+	u_int				 kp_auth_failures;
+	sbintime_t			 kp_auth_window; /* sbinuptime */
 };
 
+#define	KP_LINE(f)	(offsetof(struct noise_keypair, f) / CACHE_LINE_SIZE)
+CTASSERT(KP_LINE(kp_smr) < KP_LINE(kp_refcnt));
+CTASSERT(KP_LINE(kp_refcnt) < KP_LINE(kp_nonce_send));
+CTASSERT(KP_LINE(kp_nonce_send) < KP_LINE(kp_nonce_lock));
+#undef KP_LINE
+
 struct noise_handshake {
 	uint8_t	 			 hs_e[NOISE_PUBLIC_KEY_LEN];
 	uint8_t	 			 hs_hash[NOISE_HASH_LEN];
@@ -97,6 +166,9 @@ struct noise_remote {
 	CK_LIST_ENTRY(noise_remote) 	 r_entry;
 	bool				 r_entry_inserted;
 	uint8_t				 r_public[NOISE_PUBLIC_KEY_LEN];
+	/* noise_param_init of r_public, where we are the initiator */
+	uint8_t				 r_ck[NOISE_HASH_LEN];
+	uint8_t				 r_hash[NOISE_HASH_LEN];
 
 	struct rwlock			 r_handshake_lock;
 	struct noise_handshake		 r_handshake;
@@ -123,6 +195,9 @@ struct noise_local {
 	bool				 l_has_identity;
 	uint8_t				 l_public[NOISE_PUBLIC_KEY_LEN];
 	uint8_t				 l_private[NOISE_PUBLIC_KEY_LEN];
+	/* noise_param_init of l_public, where we are the responder */
+	uint8_t				 l_ck[NOISE_HASH_LEN];
+	uint8_t				 l_hash[NOISE_HASH_LEN];
 
 	u_int				 l_refcnt;
 	uint8_t				 l_hash_key[SIPHASH_KEY_LENGTH];
@@ -135,10 +210,24 @@ struct noise_local {
 
 	struct mtx			 l_index_mtx;
 	CK_LIST_HEAD(,noise_index)	 l_index_hash[HT_INDEX_SIZE];
+
+	/* Initiations seen recently, see noise_consume_initiation */
+	struct mtx			 l_replay_mtx;
+	struct noise_replay {
+		uint64_t		 rp_hash;
+		sbintime_t		 rp_time;
+	}				 l_replay[HT_REPLAY_SIZE];
+
+	u_int				 l_keypair_num;
 };
 
 static void	noise_precompute_ss(struct noise_local *, struct noise_remote *);
 
+static uint64_t	noise_replay_hash(struct noise_local *, const uint8_t *,
+		    const uint8_t *, const uint8_t *);
+static bool	noise_replay_check(struct noise_local *, uint64_t);
+static void	noise_replay_insert(struct noise_local *, uint64_t);
+
 static void	noise_remote_index_insert(struct noise_local *, struct noise_remote *);
 static struct noise_remote *
 		noise_remote_index_lookup(struct noise_local *, uint32_t, bool);
@@ -148,6 +237,9 @@ static void	noise_remote_expire_current(struct noise_remote *);
 static void	noise_add_new_keypair(struct noise_local *, struct noise_remote *, struct noise_keypair *);
 static int	noise_begin_session(struct noise_remote *);
 static void	noise_keypair_drop(struct noise_keypair *);
+static uint64_t	noise_nonce_load(struct noise_keypair *, uint64_t *);
+static void	noise_nonce_store(struct noise_keypair *, uint64_t *, uint64_t);
+static uint64_t	noise_nonce_fetchadd(struct noise_keypair *, uint64_t *, u_int);
 
 static void	noise_kdf(uint8_t *, uint8_t *, uint8_t *, const uint8_t *,
 		    size_t, size_t, size_t, size_t,
@@ -174,6 +266,25 @@ static uint64_t siphash24(const uint8_t [SIPHASH_KEY_LENGTH], const void *, size
 
 MALLOC_DEFINE(M_NOISE, "NOISE", "wgnoise");
 
+/* malloc(9) does not promise the cache line alignment of noise_keypair. */
+static uma_zone_t noise_keypair_zone;
+
+int
+noise_init(void)
+{
+	if ((noise_keypair_zone = uma_zcreate("wg keypair",
+	    sizeof(struct noise_keypair), NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_CACHE, 0)) == NULL)
+		return (ENOMEM);
+	return (0);
+}
+
+void
+noise_deinit(void)
+{
+	uma_zdestroy(noise_keypair_zone);
+}
+
 /* Local configuration */
 struct noise_local *
 noise_local_alloc(void *arg)
@@ -202,6 +313,8 @@ noise_local_alloc(void *arg)
 	for (i = 0; i < HT_INDEX_SIZE; i++)
 		CK_LIST_INIT(&l->l_index_hash[i]);
 
+	mtx_init(&l->l_replay_mtx, "noise_replay", NULL, MTX_DEF);
+
 	return (l);
 }
 
@@ -221,6 +334,7 @@ noise_local_put(struct noise_local *l)
 		rw_destroy(&l->l_identity_lock);
 		mtx_destroy(&l->l_remote_mtx);
 		mtx_destroy(&l->l_index_mtx);
+		mtx_destroy(&l->l_replay_mtx);
 		explicit_bzero(l, sizeof(*l));
 		free(l, M_NOISE);
 	}
@@ -239,6 +353,20 @@ noise_local_arg(struct noise_local *l)
 	return (l->l_arg);
 }
 
+u_int
+noise_local_keypairs(struct noise_local *l)
+{
+	return (ck_pr_load_uint(&l->l_keypair_num));
+}
+
+void
+noise_object_sizes(size_t *local, size_t *remote, size_t *keypair)
+{
+	*local = sizeof(struct noise_local);
+	*remote = sizeof(struct noise_remote);
+	*keypair = sizeof(struct noise_keypair);
+}
+
 void
 noise_local_private(struct noise_local *l, const uint8_t private[NOISE_PUBLIC_KEY_LEN])
 {
@@ -250,6 +378,7 @@ noise_local_private(struct noise_local *l, const uint8_t private[NOISE_PUBLIC_KE
 	memcpy(l->l_private, private, NOISE_PUBLIC_KEY_LEN);
 	curve25519_clamp_secret(l->l_private);
 	l->l_has_identity = curve25519_generate_public(l->l_public, l->l_private);
+	noise_param_init(l->l_ck, l->l_hash, l->l_public);
 
 	NET_EPOCH_ENTER(et);
 	for (i = 0; i < HT_REMOTE_SIZE; i++) {
@@ -298,6 +427,7 @@ noise_remote_alloc(struct noise_local *l, void *arg,
 	if ((r = malloc(sizeof(*r), M_NOISE, M_NOWAIT | M_ZERO)) == NULL)
 		return (NULL);
 	memcpy(r->r_public, public, NOISE_PUBLIC_KEY_LEN);
+	noise_param_init(r->r_ck, r->r_hash, r->r_public);
 
 	rw_init(&r->r_handshake_lock, "noise_handshake");
 	r->r_handshake_state = HANDSHAKE_DEAD;
@@ -379,6 +509,7 @@ noise_remote_index_insert(struct noise_local *l, struct noise_remote *r)
 {
 	struct noise_index *i, *r_i = &r->r_index;
 	struct epoch_tracker et;
+	sbintime_t ls;
 	uint32_t idx;
 
 	noise_remote_index_remove(l, r);
@@ -392,15 +523,15 @@ assign_id:
 			goto assign_id;
 	}
 
-	mtx_lock(&l->l_index_mtx);
+	WG_MTX_LOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 	CK_LIST_FOREACH(i, &l->l_index_hash[idx], i_entry) {
 		if (i->i_local_index == r_i->i_local_index) {
-			mtx_unlock(&l->l_index_mtx);
+			WG_MTX_UNLOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 			goto assign_id;
 		}
 	}
 	CK_LIST_INSERT_HEAD(&l->l_index_hash[idx], r_i, i_entry);
-	mtx_unlock(&l->l_index_mtx);
+	WG_MTX_UNLOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 
 	NET_EPOCH_EXIT(et);
 }
@@ -443,12 +574,14 @@ noise_remote_index(struct noise_local *l, uint32_t idx)
 static int
 noise_remote_index_remove(struct noise_local *l, struct noise_remote *r)
 {
+	sbintime_t ls;
+
 	rw_assert(&r->r_handshake_lock, RA_WLOCKED);
 	if (r->r_handshake_state != HANDSHAKE_DEAD) {
-		mtx_lock(&l->l_index_mtx);
+		WG_MTX_LOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 		r->r_handshake_state = HANDSHAKE_DEAD;
 		CK_LIST_REMOVE(&r->r_index, i_entry);
-		mtx_unlock(&l->l_index_mtx);
+		WG_MTX_UNLOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 		return (1);
 	}
 	return (0);
@@ -561,8 +694,9 @@ void
 noise_remote_keypairs_clear(struct noise_remote *r)
 {
 	struct noise_keypair *kp;
+	sbintime_t ls;
 
-	mtx_lock(&r->r_keypair_mtx);
+	WG_MTX_LOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
 	kp = ck_pr_load_ptr(&r->r_next);
 	ck_pr_store_ptr(&r->r_next, NULL);
 	noise_keypair_drop(kp);
@@ -574,7 +708,7 @@ noise_remote_keypairs_clear(struct noise_remote *r)
 	kp = ck_pr_load_ptr(&r->r_previous);
 	ck_pr_store_ptr(&r->r_previous, NULL);
 	noise_keypair_drop(kp);
-	mtx_unlock(&r->r_keypair_mtx);
+	WG_MTX_UNLOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
 }
 
 static void
@@ -602,9 +736,10 @@ noise_add_new_keypair(struct noise_local *l, struct noise_remote *r,
 {
 	struct noise_keypair *next, *current, *previous;
 	struct noise_index *r_i = &r->r_index;
+	sbintime_t ls;
 
 	/* Insert into the keypair table */
-	mtx_lock(&r->r_keypair_mtx);
+	WG_MTX_LOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
 	next = ck_pr_load_ptr(&r->r_next);
 	current = ck_pr_load_ptr(&r->r_current);
 	previous = ck_pr_load_ptr(&r->r_previous);
@@ -626,7 +761,7 @@ noise_add_new_keypair(struct noise_local *l, struct noise_remote *r,
 		noise_keypair_drop(previous);
 
 	}
-	mtx_unlock(&r->r_keypair_mtx);
+	WG_MTX_UNLOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
 
 	/* Insert into index table */
 	rw_assert(&r->r_handshake_lock, RA_WLOCKED);
@@ -635,11 +770,11 @@ noise_add_new_keypair(struct noise_local *l, struct noise_remote *r,
 	kp->kp_index.i_local_index = r_i->i_local_index;
 	kp->kp_index.i_remote_index = r_i->i_remote_index;
 
-	mtx_lock(&l->l_index_mtx);
+	WG_MTX_LOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 	CK_LIST_INSERT_BEFORE(r_i, &kp->kp_index, i_entry);
 	r->r_handshake_state = HANDSHAKE_DEAD;
 	CK_LIST_REMOVE(r_i, i_entry);
-	mtx_unlock(&l->l_index_mtx);
+	WG_MTX_UNLOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 
 	explicit_bzero(&r->r_handshake, sizeof(r->r_handshake));
 }
@@ -651,14 +786,16 @@ noise_begin_session(struct noise_remote *r)
 
 	rw_assert(&r->r_handshake_lock, RA_WLOCKED);
 
-	if ((kp = malloc(sizeof(*kp), M_NOISE, M_NOWAIT | M_ZERO)) == NULL)
+	if ((kp = uma_zalloc(noise_keypair_zone, M_NOWAIT | M_ZERO)) == NULL)
 		return (ENOSPC);
+	ck_pr_inc_uint(&r->r_local->l_keypair_num);
 
 	refcount_init(&kp->kp_refcnt, 1);
 	kp->kp_can_send = true;
 	kp->kp_is_initiator = r->r_handshake_state == HANDSHAKE_INITIATOR;
 	kp->kp_birthdate = getsbinuptime();
 	kp->kp_remote = noise_remote_ref(r);
+	kp->kp_aead = wg_aead_current();
 
 	if (kp->kp_is_initiator)
 		noise_kdf(kp->kp_send, kp->kp_recv, NULL, NULL,
@@ -675,6 +812,148 @@ noise_begin_session(struct noise_remote *r)
 	return (0);
 }
 
+/*
+ * Copy out the session state of a remote and stop it from sending, as the
+ * saved send nonces must not be used again by this remote. Keypairs that
+ * have expired are left out.
+ */
+void
+noise_remote_save(struct noise_remote *r, struct noise_remote_state *rs)
+{
+	struct noise_keypair *kps[NOISE_KEYPAIR_SLOTS], *kp;
+	struct noise_keypair_state *ks;
+	sbintime_t ls;
+	bool can_send;
+	int i;
+
+	bzero(rs, sizeof(*rs));
+	rw_rlock(&r->r_handshake_lock);
+	memcpy(rs->rs_timestamp, r->r_timestamp, NOISE_TIMESTAMP_LEN);
+	rs->rs_last_sent = r->r_last_sent;
+	rs->rs_last_init_recv = r->r_last_init_recv;
+	rw_runlock(&r->r_handshake_lock);
+
+	WG_MTX_LOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
+	kps[NOISE_KEYPAIR_NEXT] = ck_pr_load_ptr(&r->r_next);
+	kps[NOISE_KEYPAIR_CURRENT] = ck_pr_load_ptr(&r->r_current);
+	kps[NOISE_KEYPAIR_PREVIOUS] = ck_pr_load_ptr(&r->r_previous);
+	for (i = 0; i < NOISE_KEYPAIR_SLOTS; i++)
+		if (kps[i] != NULL && !refcount_acquire_if_not_zero(&kps[i]->kp_refcnt))
+			kps[i] = NULL;
+	WG_MTX_UNLOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
+
+	for (i = 0; i < NOISE_KEYPAIR_SLOTS; i++) {
+		if ((kp = kps[i]) == NULL)
+			continue;
+		can_send = ck_pr_load_bool(&kp->kp_can_send);
+		ck_pr_store_bool(&kp->kp_can_send, false);
+		if (noise_timer_expired(kp->kp_birthdate, REJECT_AFTER_TIME, 0)) {
+			noise_keypair_put(kp);
+			continue;
+		}
+		ks = &rs->rs_keypairs[rs->rs_nkeypairs++];
+		ks->ks_slot = i;
+		ks->ks_can_send = can_send;
+		ks->ks_is_initiator = kp->kp_is_initiator;
+		ks->ks_local_index = kp->kp_index.i_local_index;
+		ks->ks_remote_index = kp->kp_index.i_remote_index;
+		ks->ks_birthdate = kp->kp_birthdate;
+		memcpy(ks->ks_send, kp->kp_send, NOISE_SYMMETRIC_KEY_LEN);
+		memcpy(ks->ks_recv, kp->kp_recv, NOISE_SYMMETRIC_KEY_LEN);
+
+		WG_RW_WLOCK(&kp->kp_nonce_lock, WG_LOCK_NONCE, ls);
+		ks->ks_nonce_send = noise_nonce_load(kp, &kp->kp_nonce_send) +
+		    SAVE_NONCE_SKIP;
+		ks->ks_nonce_recv = kp->kp_nonce_recv;
+		memcpy(ks->ks_backtrack, kp->kp_backtrack, NOISE_REPLAY_WINDOW_LEN);
+		WG_RW_WUNLOCK(&kp->kp_nonce_lock, WG_LOCK_NONCE, ls);
+
+		noise_keypair_put(kp);
+	}
+}
+
+/*
+ * Put the keypairs saved by noise_remote_save back into a remote, each under
+ * its old local index so that the peer can carry on without a handshake. A
+ * keypair that has expired since, or whose index has been taken in the
+ * meantime, is left out. Returns ENOENT if no keypair was restored.
+ */
+int
+noise_remote_restore(struct noise_remote *r, const struct noise_remote_state *rs)
+{
+	struct noise_keypair *kps[NOISE_KEYPAIR_SLOTS] = { NULL }, *kp;
+	const struct noise_keypair_state *ks;
+	struct noise_local *l = r->r_local;
+	struct noise_index *i;
+	struct noise_keypair *next, *current, *previous;
+	sbintime_t ls;
+	uint32_t idx;
+	int n, ret = ENOENT;
+
+	rw_wlock(&r->r_handshake_lock);
+	memcpy(r->r_timestamp, rs->rs_timestamp, NOISE_TIMESTAMP_LEN);
+	r->r_last_sent = rs->rs_last_sent;
+	r->r_last_init_recv = rs->rs_last_init_recv;
+	rw_wunlock(&r->r_handshake_lock);
+
+	for (n = 0; n < MIN(rs->rs_nkeypairs, NOISE_KEYPAIR_SLOTS); n++) {
+		ks = &rs->rs_keypairs[n];
+		if (ks->ks_slot >= NOISE_KEYPAIR_SLOTS || kps[ks->ks_slot] != NULL ||
+		    noise_timer_expired(ks->ks_birthdate, REJECT_AFTER_TIME, 0))
+			continue;
+		if ((kp = uma_zalloc(noise_keypair_zone, M_NOWAIT | M_ZERO)) == NULL)
+			break;
+		ck_pr_inc_uint(&l->l_keypair_num);
+
+		refcount_init(&kp->kp_refcnt, 1);
+		kp->kp_can_send = ks->ks_can_send;
+		kp->kp_is_initiator = ks->ks_is_initiator;
+		kp->kp_birthdate = ks->ks_birthdate;
+		kp->kp_remote = noise_remote_ref(r);
+		kp->kp_aead = wg_aead_current();
+		memcpy(kp->kp_send, ks->ks_send, NOISE_SYMMETRIC_KEY_LEN);
+		memcpy(kp->kp_recv, ks->ks_recv, NOISE_SYMMETRIC_KEY_LEN);
+		kp->kp_nonce_send = ks->ks_nonce_send;
+		kp->kp_nonce_recv = ks->ks_nonce_recv;
+		memcpy(kp->kp_backtrack, ks->ks_backtrack, NOISE_REPLAY_WINDOW_LEN);
+		rw_init(&kp->kp_nonce_lock, "noise_nonce");
+
+		kp->kp_index.i_is_keypair = true;
+		kp->kp_index.i_local_index = ks->ks_local_index;
+		kp->kp_index.i_remote_index = ks->ks_remote_index;
+
+		idx = ks->ks_local_index & HT_INDEX_MASK;
+		WG_MTX_LOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
+		CK_LIST_FOREACH(i, &l->l_index_hash[idx], i_entry)
+			if (i->i_local_index == ks->ks_local_index)
+				break;
+		if (i == NULL)
+			CK_LIST_INSERT_HEAD(&l->l_index_hash[idx], &kp->kp_index, i_entry);
+		WG_MTX_UNLOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
+
+		if (i != NULL) {
+			noise_keypair_put(kp);
+			continue;
+		}
+		kps[ks->ks_slot] = kp;
+		ret = 0;
+	}
+
+	WG_MTX_LOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
+	next = ck_pr_load_ptr(&r->r_next);
+	current = ck_pr_load_ptr(&r->r_current);
+	previous = ck_pr_load_ptr(&r->r_previous);
+	ck_pr_store_ptr(&r->r_next, kps[NOISE_KEYPAIR_NEXT]);
+	ck_pr_store_ptr(&r->r_current, kps[NOISE_KEYPAIR_CURRENT]);
+	ck_pr_store_ptr(&r->r_previous, kps[NOISE_KEYPAIR_PREVIOUS]);
+	noise_keypair_drop(next);
+	noise_keypair_drop(current);
+	noise_keypair_drop(previous);
+	WG_MTX_UNLOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
+
+	return (ret);
+}
+
 struct noise_keypair *
 noise_keypair_lookup(struct noise_local *l, uint32_t idx0)
 {
@@ -726,13 +1005,14 @@ noise_keypair_received_with(struct noise_keypair *kp)
 {
 	struct noise_keypair *old;
 	struct noise_remote *r = kp->kp_remote;
+	sbintime_t ls;
 
 	if (kp != ck_pr_load_ptr(&r->r_next))
 		return (0);
 
-	mtx_lock(&r->r_keypair_mtx);
+	WG_MTX_LOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
 	if (kp != ck_pr_load_ptr(&r->r_next)) {
-		mtx_unlock(&r->r_keypair_mtx);
+		WG_MTX_UNLOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
 		return (0);
 	}
 
@@ -741,7 +1021,7 @@ noise_keypair_received_with(struct noise_keypair *kp)
 	noise_keypair_drop(old);
 	ck_pr_store_ptr(&r->r_current, kp);
 	ck_pr_store_ptr(&r->r_next, NULL);
-	mtx_unlock(&r->r_keypair_mtx);
+	WG_MTX_UNLOCK(&r->r_keypair_mtx, WG_LOCK_KEYPAIR, ls);
 
 	return (ECONNRESET);
 }
@@ -751,10 +1031,15 @@ noise_keypair_smr_free(struct epoch_context *smr)
 {
 	struct noise_keypair *kp;
 	kp = __containerof(smr, struct noise_keypair, kp_smr);
+	ck_pr_dec_uint(&kp->kp_remote->r_local->l_keypair_num);
 	noise_remote_put(kp->kp_remote);
 	rw_destroy(&kp->kp_nonce_lock);
+	if (kp->kp_session_send != NULL)
+		kp->kp_aead->a_session_free(kp->kp_session_send);
+	if (kp->kp_session_recv != NULL)
+		kp->kp_aead->a_session_free(kp->kp_session_recv);
 	explicit_bzero(kp, sizeof(*kp));
-	free(kp, M_NOISE);
+	uma_zfree(noise_keypair_zone, kp);
 }
 
 void
@@ -769,6 +1054,7 @@ noise_keypair_drop(struct noise_keypair *kp)
 {
 	struct noise_remote *r;
 	struct noise_local *l;
+	sbintime_t ls;
 
 	if (kp == NULL)
 		return;
@@ -776,9 +1062,9 @@ noise_keypair_drop(struct noise_keypair *kp)
 	r = kp->kp_remote;
 	l = r->r_local;
 
-	mtx_lock(&l->l_index_mtx);
+	WG_MTX_LOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 	CK_LIST_REMOVE(&kp->kp_index, i_entry);
-	mtx_unlock(&l->l_index_mtx);
+	WG_MTX_UNLOCK(&l->l_index_mtx, WG_LOCK_INDEX, ls);
 
 	noise_keypair_put(kp);
 }
@@ -789,20 +1075,78 @@ noise_keypair_remote(struct noise_keypair *kp)
 	return (noise_remote_ref(kp->kp_remote));
 }
 
+static inline uint64_t
+noise_nonce_load(struct noise_keypair *kp __unused, uint64_t *nonce)
+{
+#if defined(__LP64__)
+	return (ck_pr_load_64(nonce));
+#elif defined(NONCE_ATOMIC64)
+	return (atomic_load_acq_64(nonce));
+#else
+	uint64_t ret;
+	seqc_t seqc;
+
+	do {
+		seqc = seqc_read(&kp->kp_nonce_seqc);
+		ret = *nonce;
+	} while (!seqc_consistent(&kp->kp_nonce_seqc, seqc));
+	return (ret);
+#endif
+}
+
+/* Called with kp_nonce_lock held for writing where there are no atomics. */
+static inline void
+noise_nonce_store(struct noise_keypair *kp __unused, uint64_t *nonce,
+    uint64_t val)
+{
+#if defined(__LP64__)
+	ck_pr_store_64(nonce, val);
+#elif defined(NONCE_ATOMIC64)
+	atomic_store_rel_64(nonce, val);
+#else
+	rw_assert(&kp->kp_nonce_lock, RA_WLOCKED);
+	critical_enter();
+	seqc_write_begin(&kp->kp_nonce_seqc);
+	*nonce = val;
+	seqc_write_end(&kp->kp_nonce_seqc);
+	critical_exit();
+#endif
+}
+
+static inline uint64_t
+noise_nonce_fetchadd(struct noise_keypair *kp __unused, uint64_t *nonce, u_int n)
+{
+#if defined(__LP64__)
+	return (ck_pr_faa_64(nonce, n));
+#elif defined(NONCE_ATOMIC64)
+	return (atomic_fetchadd_64(nonce, n));
+#else
+	sbintime_t ls;
+	uint64_t ret;
+
+	WG_RW_WLOCK(&kp->kp_nonce_lock, WG_LOCK_NONCE, ls);
+	ret = *nonce;
+	noise_nonce_store(kp, nonce, ret + n);
+	WG_RW_WUNLOCK(&kp->kp_nonce_lock, WG_LOCK_NONCE, ls);
+	return (ret);
+#endif
+}
+
 int
 noise_keypair_nonce_next(struct noise_keypair *kp, uint64_t *send)
+{
+	return (noise_keypair_nonce_reserve(kp, 1, send));
+}
+
+/* Reserve n consecutive send nonces, starting at *send. */
+int
+noise_keypair_nonce_reserve(struct noise_keypair *kp, u_int n, uint64_t *send)
 {
 	if (!ck_pr_load_bool(&kp->kp_can_send))
 		return (EINVAL);
 
-#ifdef __LP64__
-	*send = ck_pr_faa_64(&kp->kp_nonce_send, 1);
-#else
-	rw_wlock(&kp->kp_nonce_lock);
-	*send = kp->kp_nonce_send++;
-	rw_wunlock(&kp->kp_nonce_lock);
-#endif
-	if (*send < REJECT_AFTER_MESSAGES)
+	*send = noise_nonce_fetchadd(kp, &kp->kp_nonce_send, n);
+	if (*send + n <= REJECT_AFTER_MESSAGES)
 		return (0);
 	ck_pr_store_bool(&kp->kp_can_send, false);
 	return (EINVAL);
@@ -812,9 +1156,10 @@ int
 noise_keypair_nonce_check(struct noise_keypair *kp, uint64_t recv)
 {
 	unsigned long index, index_current, top, i, bit;
+	sbintime_t ls;
 	int ret = EEXIST;
 
-	rw_wlock(&kp->kp_nonce_lock);
+	WG_RW_WLOCK(&kp->kp_nonce_lock, WG_LOCK_NONCE, ls);
 
 	if (__predict_false(kp->kp_nonce_recv >= REJECT_AFTER_MESSAGES + 1 ||
 			    recv >= REJECT_AFTER_MESSAGES))
@@ -834,11 +1179,7 @@ noise_keypair_nonce_check(struct noise_keypair *kp, uint64_t recv)
 			kp->kp_backtrack[
 			    (i + index_current) &
 				((COUNTER_BITS_TOTAL / COUNTER_BITS) - 1)] = 0;
-#ifdef __LP64__
-		ck_pr_store_64(&kp->kp_nonce_recv, recv);
-#else
-		kp->kp_nonce_recv = recv;
-#endif
+		noise_nonce_store(kp, &kp->kp_nonce_recv, recv);
 	}
 
 	index &= (COUNTER_BITS_TOTAL / COUNTER_BITS) - 1;
@@ -849,7 +1190,7 @@ noise_keypair_nonce_check(struct noise_keypair *kp, uint64_t recv)
 	kp->kp_backtrack[index] |= bit;
 	ret = 0;
 error:
-	rw_wunlock(&kp->kp_nonce_lock);
+	WG_RW_WUNLOCK(&kp->kp_nonce_lock, WG_LOCK_NONCE, ls);
 	return (ret);
 }
 
@@ -866,13 +1207,7 @@ noise_keep_key_fresh_send(struct noise_remote *r)
 	keep_key_fresh = current != NULL && ck_pr_load_bool(&current->kp_can_send);
 	if (!keep_key_fresh)
 		goto out;
-#ifdef __LP64__
-	nonce = ck_pr_load_64(&current->kp_nonce_send);
-#else
-	rw_rlock(&current->kp_nonce_lock);
-	nonce = current->kp_nonce_send;
-	rw_runlock(&current->kp_nonce_lock);
-#endif
+	nonce = noise_nonce_load(current, &current->kp_nonce_send);
 	keep_key_fresh = nonce > REKEY_AFTER_MESSAGES;
 	if (keep_key_fresh)
 		goto out;
@@ -900,42 +1235,110 @@ noise_keep_key_fresh_recv(struct noise_remote *r)
 	return (keep_key_fresh ? ESTALE : 0);
 }
 
+static int
+noise_keypair_session(struct noise_keypair *kp, void **sessionp,
+    const uint8_t key[NOISE_SYMMETRIC_KEY_LEN], void **session)
+{
+	const struct wg_aead *aead = kp->kp_aead;
+	void *s;
+	int ret;
+
+	if ((*session = ck_pr_load_ptr(sessionp)) != NULL ||
+	    aead->a_session_new == NULL)
+		return (0);
+	if ((ret = aead->a_session_new(&s, key)) != 0)
+		return (ret);
+	if (!ck_pr_cas_ptr(sessionp, NULL, s)) {
+		aead->a_session_free(s);
+		s = ck_pr_load_ptr(sessionp);
+	}
+	*session = s;
+	return (0);
+}
+
+/*
+ * Both of these return EINPROGRESS if the backend will complete req later, in
+ * which case req->ar_done is called with the result.
+ */
 int
-noise_keypair_encrypt(struct noise_keypair *kp, uint32_t *r_idx, uint64_t nonce, struct mbuf *m)
+noise_keypair_encrypt(struct noise_keypair *kp, uint32_t *r_idx, uint64_t nonce,
+    struct mbuf *m, struct wg_aead_req *req)
 {
+	void *session;
 	int ret;
 
-	ret = chacha20poly1305_encrypt_mbuf(m, nonce, kp->kp_send);
+	ret = noise_keypair_session(kp, &kp->kp_session_send, kp->kp_send, &session);
 	if (ret)
 		return (ret);
 
 	*r_idx = kp->kp_index.i_remote_index;
-	return (0);
+	req->ar_m = m;
+	req->ar_key = kp->kp_send;
+	req->ar_nonce = nonce;
+	req->ar_encrypt = true;
+	return (kp->kp_aead->a_crypt(session, req));
 }
 
 int
-noise_keypair_decrypt(struct noise_keypair *kp, uint64_t nonce, struct mbuf *m)
+noise_keypair_decrypt(struct noise_keypair *kp, uint64_t nonce, struct mbuf *m,
+    struct wg_aead_req *req)
 {
+	void *session;
 	uint64_t cur_nonce;
 	int ret;
 
-#ifdef __LP64__
-	cur_nonce = ck_pr_load_64(&kp->kp_nonce_recv);
-#else
-	rw_rlock(&kp->kp_nonce_lock);
-	cur_nonce = kp->kp_nonce_recv;
-	rw_runlock(&kp->kp_nonce_lock);
-#endif
+	cur_nonce = noise_nonce_load(kp, &kp->kp_nonce_recv);
 
 	if (cur_nonce >= REJECT_AFTER_MESSAGES ||
 	    noise_timer_expired(kp->kp_birthdate, REJECT_AFTER_TIME, 0))
 		return (EINVAL);
 
-	ret = chacha20poly1305_decrypt_mbuf(m, nonce, kp->kp_recv);
+	ret = noise_keypair_session(kp, &kp->kp_session_recv, kp->kp_recv, &session);
 	if (ret)
 		return (ret);
 
-	return (0);
+	req->ar_m = m;
+	req->ar_key = kp->kp_recv;
+	req->ar_nonce = nonce;
+	req->ar_encrypt = false;
+	req->ar_verify_first = ck_pr_load_bool(&kp->kp_verify_first);
+	return (kp->kp_aead->a_crypt(session, req));
+}
+
+/*
+ * Called for each packet on the keypair that failed to authenticate. Anyone
+ * who knows a receiver index can send packets that get that far, so once
+ * they arrive at more than AUTH_FAILURE_RATE a second, the keypair switches
+ * for the rest of its life to verifying the tag before decrypting. Returns
+ * true when it switches. The count is approximate, racing updates may be lost.
+ */
+bool
+noise_keypair_auth_failed(struct noise_keypair *kp)
+{
+	sbintime_t now = getsbinuptime();
+
+	if (ck_pr_load_bool(&kp->kp_verify_first))
+		return (false);
+	if (now - kp->kp_auth_window > SBT_1S) {
+		kp->kp_auth_window = now;
+		ck_pr_store_uint(&kp->kp_auth_failures, 0);
+	}
+	if (ck_pr_faa_uint(&kp->kp_auth_failures, 1) + 1 < AUTH_FAILURE_RATE)
+		return (false);
+	ck_pr_store_bool(&kp->kp_verify_first, true);
+	return (true);
+}
+
+/*
+ * Whether any packet on the keypair has failed to authenticate. The count is
+ * only reset to start a new window for the next failure, so it stays nonzero
+ * once there has been one.
+ */
+bool
+noise_keypair_auth_suspect(struct noise_keypair *kp)
+{
+	return (ck_pr_load_bool(&kp->kp_verify_first) ||
+	    ck_pr_load_uint(&kp->kp_auth_failures) != 0);
 }
 
 /* Handshake functions */
@@ -957,7 +1360,8 @@ noise_create_initiation(struct noise_remote *r,
 		goto error;
 	if (!noise_timer_expired(r->r_last_sent, REKEY_TIMEOUT, 0))
 		goto error;
-	noise_param_init(hs->hs_ck, hs->hs_hash, r->r_public);
+	memcpy(hs->hs_ck, r->r_ck, NOISE_HASH_LEN);
+	memcpy(hs->hs_hash, r->r_hash, NOISE_HASH_LEN);
 
 	/* e */
 	curve25519_generate_secret(hs->hs_e);
@@ -1006,12 +1410,25 @@ noise_consume_initiation(struct noise_local *l, struct noise_remote **rp,
 	uint8_t key[NOISE_SYMMETRIC_KEY_LEN];
 	uint8_t r_public[NOISE_PUBLIC_KEY_LEN];
 	uint8_t	timestamp[NOISE_TIMESTAMP_LEN];
+	uint64_t replay;
 	int ret = EINVAL;
 
 	rw_rlock(&l->l_identity_lock);
 	if (!l->l_has_identity)
 		goto error;
-	noise_param_init(hs.hs_ck, hs.hs_hash, l->l_public);
+
+	/* An exact copy of an initiation we have already authenticated can
+	 * only be rejected as a timestamp replay or a flood, so reject it
+	 * before spending a DH on it. Initiators never resend an initiation,
+	 * a retry uses a new ephemeral. */
+	replay = noise_replay_hash(l, ue, es, ets);
+	if (noise_replay_check(l, replay)) {
+		ret = EALREADY;
+		goto error;
+	}
+
+	memcpy(hs.hs_ck, l->l_ck, NOISE_HASH_LEN);
+	memcpy(hs.hs_hash, l->l_hash, NOISE_HASH_LEN);
 
 	/* e */
 	noise_msg_ephemeral(hs.hs_ck, hs.hs_hash, ue);
@@ -1039,6 +1456,7 @@ noise_consume_initiation(struct noise_local *l, struct noise_remote **rp,
 		goto error_put;
 
 	memcpy(hs.hs_e, ue, NOISE_PUBLIC_KEY_LEN);
+	noise_replay_insert(l, replay);
 
 	/* We have successfully computed the same results, now we ensure that
 	 * this is not an initiation replay, or a flood attack */
@@ -1287,6 +1705,11 @@ noise_mix_psk(uint8_t ck[NOISE_HASH_LEN], uint8_t hash[NOISE_HASH_LEN],
 	explicit_bzero(tmp, NOISE_HASH_LEN);
 }
 
+/*
+ * The initial chaining key and hash only depend on the responder's static
+ * public key, so they are computed once per identity, in noise_local_private
+ * and noise_remote_alloc, rather than for every handshake.
+ */
 static void
 noise_param_init(uint8_t ck[NOISE_HASH_LEN], uint8_t hash[NOISE_HASH_LEN],
     const uint8_t s[NOISE_PUBLIC_KEY_LEN])
@@ -1363,6 +1786,45 @@ noise_timer_expired(sbintime_t timer, uint32_t sec, uint32_t nsec)
 	return (now > (timer + sec * SBT_1S + nstosbt(nsec))) ? ETIMEDOUT : 0;
 }
 
+static uint64_t
+noise_replay_hash(struct noise_local *l, const uint8_t *ue, const uint8_t *es,
+    const uint8_t *ets)
+{
+	SIPHASH_CTX ctx;
+
+	SipHash24_Init(&ctx);
+	SipHash_SetKey(&ctx, l->l_hash_key);
+	SipHash_Update(&ctx, ue, NOISE_PUBLIC_KEY_LEN);
+	SipHash_Update(&ctx, es, NOISE_PUBLIC_KEY_LEN + NOISE_AUTHTAG_LEN);
+	SipHash_Update(&ctx, ets, NOISE_TIMESTAMP_LEN + NOISE_AUTHTAG_LEN);
+	return (SipHash_End(&ctx));
+}
+
+static bool
+noise_replay_check(struct noise_local *l, uint64_t hash)
+{
+	struct noise_replay *rp = &l->l_replay[hash & HT_REPLAY_MASK];
+	bool ret;
+
+	mtx_lock(&l->l_replay_mtx);
+	ret = rp->rp_hash == hash && rp->rp_time != 0 &&
+	    !noise_timer_expired(rp->rp_time, REKEY_TIMEOUT, 0);
+	mtx_unlock(&l->l_replay_mtx);
+	return (ret);
+}
+
+/* A collision just evicts the older entry, which then costs a DH again. */
+static void
+noise_replay_insert(struct noise_local *l, uint64_t hash)
+{
+	struct noise_replay *rp = &l->l_replay[hash & HT_REPLAY_MASK];
+
+	mtx_lock(&l->l_replay_mtx);
+	rp->rp_hash = hash;
+	rp->rp_time = getsbinuptime();
+	mtx_unlock(&l->l_replay_mtx);
+}
+
 static uint64_t siphash24(const uint8_t key[SIPHASH_KEY_LENGTH], const void *src, size_t len)
 {
 	SIPHASH_CTX ctx;
@@ -1371,4 +1833,6 @@ static uint64_t siphash24(const uint8_t key[SIPHASH_KEY_LENGTH], const void *src
 
 #ifdef SELFTESTS
 #include "selftest/counter.c"
+#include "selftest/keypair.c"
+#include "selftest/session.c"
 #endif /* SELFTESTS */
@@ -23,9 +23,54 @@
 #define REKEY_TIMEOUT		5
 #define KEEPALIVE_TIMEOUT	10
 
+#define NOISE_REPLAY_WINDOW_LEN	1024	/* bytes of the receive replay window */
+
 struct noise_local;
 struct noise_remote;
 struct noise_keypair;
+struct wg_aead_req;
+
+/*
+ * Session state of a remote, copied out by noise_remote_save so that it can
+ * be put back into a new remote by noise_remote_restore after the module is
+ * reloaded. Times are sbinuptime, which carries on across a reload. Only the
+ * first rs_nkeypairs entries of rs_keypairs are used, so the state can be
+ * stored without the rest, see NOISE_REMOTE_STATE_LEN.
+ */
+enum noise_keypair_slot {
+	NOISE_KEYPAIR_NEXT,
+	NOISE_KEYPAIR_CURRENT,
+	NOISE_KEYPAIR_PREVIOUS,
+	NOISE_KEYPAIR_SLOTS,
+};
+
+struct noise_keypair_state {
+	uint8_t		ks_slot;	/* enum noise_keypair_slot */
+	bool		ks_can_send;
+	bool		ks_is_initiator;
+	uint32_t	ks_local_index;
+	uint32_t	ks_remote_index;
+	sbintime_t	ks_birthdate;
+	uint64_t	ks_nonce_send;
+	uint64_t	ks_nonce_recv;
+	uint8_t		ks_send[NOISE_SYMMETRIC_KEY_LEN];
+	uint8_t		ks_recv[NOISE_SYMMETRIC_KEY_LEN];
+	uint8_t		ks_backtrack[NOISE_REPLAY_WINDOW_LEN];
+};
+
+struct noise_remote_state {
+	uint8_t		rs_timestamp[NOISE_TIMESTAMP_LEN];
+	sbintime_t	rs_last_sent;
+	sbintime_t	rs_last_init_recv;
+	u_int		rs_nkeypairs;
+	struct noise_keypair_state rs_keypairs[NOISE_KEYPAIR_SLOTS];
+};
+
+#define NOISE_REMOTE_STATE_LEN(n) \
+	offsetof(struct noise_remote_state, rs_keypairs[n])
+
+int	noise_init(void);
+void	noise_deinit(void);
 
 /* Local configuration */
 struct noise_local *
@@ -35,6 +80,8 @@ struct noise_local *
 void	noise_local_put(struct noise_local *);
 void	noise_local_free(struct noise_local *, void (*)(struct noise_local *));
 void *	noise_local_arg(struct noise_local *);
+u_int	noise_local_keypairs(struct noise_local *);
+void	noise_object_sizes(size_t *, size_t *, size_t *);
 
 void	noise_local_private(struct noise_local *,
 	    const uint8_t[NOISE_PUBLIC_KEY_LEN]);
@@ -68,6 +115,9 @@ int	noise_remote_keys(struct noise_remote *,
 int	noise_remote_initiation_expired(struct noise_remote *);
 void	noise_remote_handshake_clear(struct noise_remote *);
 void	noise_remote_keypairs_clear(struct noise_remote *);
+void	noise_remote_save(struct noise_remote *, struct noise_remote_state *);
+int	noise_remote_restore(struct noise_remote *,
+	    const struct noise_remote_state *);
 
 /* Keypair functions */
 struct noise_keypair *
@@ -83,6 +133,7 @@ struct noise_remote *
 	noise_keypair_remote(struct noise_keypair *);
 
 int	noise_keypair_nonce_next(struct noise_keypair *, uint64_t *);
+int	noise_keypair_nonce_reserve(struct noise_keypair *, u_int, uint64_t *);
 int	noise_keypair_nonce_check(struct noise_keypair *, uint64_t);
 
 int	noise_keep_key_fresh_send(struct noise_remote *);
@@ -91,11 +142,15 @@ int	noise_keypair_encrypt(
 	    struct noise_keypair *,
 	    uint32_t *r_idx,
 	    uint64_t nonce,
-	    struct mbuf *);
+	    struct mbuf *,
+	    struct wg_aead_req *);
 int	noise_keypair_decrypt(
 	    struct noise_keypair *,
 	    uint64_t nonce,
-	    struct mbuf *);
+	    struct mbuf *,
+	    struct wg_aead_req *);
+bool	noise_keypair_auth_failed(struct noise_keypair *);
+bool	noise_keypair_auth_suspect(struct noise_keypair *);
 
 /* Handshake functions */
 int	noise_create_initiation(
@@ -130,6 +185,8 @@ int	noise_consume_response(
 
 #ifdef SELFTESTS
 bool	noise_counter_selftest(void);
+bool	noise_keypair_benchmark(void);
+bool	noise_session_selftest(void);
 #endif /* SELFTESTS */
 
 #endif /* __NOISE_H__ */
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: ISC
+ *
+ * Copyright (C) 2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#ifndef _WG_TRACE_H_
+#define _WG_TRACE_H_
+
+#include <sys/sdt.h>
+
+/*
+ * Tracepoints for the wg DTrace provider. These are thin wrappers around
+ * SDT(9), so that the call sites do not depend on the tracing framework and
+ * compile to nothing in kernels built without KDTRACE_HOOKS. Probe names use
+ * the SDT convention of a double underscore for a dash, so handshake__send is
+ * wg:::handshake-send.
+ */
+SDT_PROVIDER_DECLARE(wg);
+
+#define WG_TRACE_DEFINE1(name, t0)					\
+	SDT_PROBE_DEFINE1(wg, , , name, t0)
+#define WG_TRACE_DEFINE2(name, t0, t1)					\
+	SDT_PROBE_DEFINE2(wg, , , name, t0, t1)
+#define WG_TRACE_DEFINE3(name, t0, t1, t2)				\
+	SDT_PROBE_DEFINE3(wg, , , name, t0, t1, t2)
+#define WG_TRACE_DEFINE4(name, t0, t1, t2, t3)				\
+	SDT_PROBE_DEFINE4(wg, , , name, t0, t1, t2, t3)
+
+#define WG_TRACE1(name, a0)						\
+	SDT_PROBE1(wg, , , name, a0)
+#define WG_TRACE2(name, a0, a1)						\
+	SDT_PROBE2(wg, , , name, a0, a1)
+#define WG_TRACE3(name, a0, a1, a2)					\
+	SDT_PROBE3(wg, , , name, a0, a1, a2)
+#define WG_TRACE4(name, a0, a1, a2, a3)					\
+	SDT_PROBE4(wg, , , name, a0, a1, a2, a3)
+
+#endif /* _WG_TRACE_H_ */